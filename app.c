@@ -0,0 +1,494 @@
+/*  --- app ---
+ *
+ *  One frame of cpaint: tool & color selection, painting, fills, undo,
+ *  saves, view movement and bringing the view up to date with the canvas,
+ *  then working out which part of the window that changed. Resizes come in
+ *  between frames.
+ */
+
+#include "app.h"
+#include "fill.h"
+#include "profile.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Monotonic time in seconds
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool pointInRect(Point point, Rect rect) {
+  return point.x >= rect.x && point.x < rect.x + rect.width &&
+         point.y >= rect.y && point.y < rect.y + rect.height;
+}
+
+static Bounds rectBounds(Rect rect) {
+  return (Bounds){(int)floorf(rect.x), (int)floorf(rect.y),
+                  (int)ceilf(rect.x + rect.width),
+                  (int)ceilf(rect.y + rect.height)};
+}
+
+// Adds area to what the window recomposites this frame
+static void damageWindow(App *app, Bounds area) {
+  area = intersectBounds(area,
+                         (Bounds){0, 0, app->window_width, app->window_height});
+  if (!boundsEmpty(area)) {
+    app->damage = unionBounds(app->damage, area);
+  }
+}
+
+// Window pixels the cursor guide covers as the window draws it, outline
+// included, empty while it's hidden
+static Bounds guideBounds(const App *app, const InputFrame *input) {
+  if (app->mouse.x <= SIDEBAR_WIDTH || keyDown(input, INPUT_KEY_ALT)) {
+    return emptyBounds();
+  }
+  float radius = app->cursor_radius * app->view.zoom;
+  float reach_x = radius + 2;
+  float reach_y = radius + 2;
+  if (app->tool == TOOL_FILL) {
+    reach_x = reach_y = 6;
+  } else if (app->tool == TOOL_PENCIL) {
+    reach_x = reach_y = radius / 2 + 1;
+  } else if (app->brush_shape == SHAPE_TRIANGLE) {
+    reach_x = radius * 1.3f + 2;
+  }
+  return (Bounds){(int)floorf(app->mouse.x - reach_x) - 1,
+                  (int)floorf(app->mouse.y - reach_y) - 1,
+                  (int)ceilf(app->mouse.x + reach_x) + 2,
+                  (int)ceilf(app->mouse.y + reach_y) + 2};
+}
+
+// Sizes the palette swatches to the window height
+static void layoutSidebar(App *app) {
+  for (int i = 0; i < NUM_COLORS; i++) {
+    app->color_rectangles[i].x = 4;
+    app->color_rectangles[i].y = 4 + (app->window_height / 30.0) * i + 2 * i;
+    app->color_rectangles[i].width = 40;
+    app->color_rectangles[i].height = app->window_height / 30.0;
+  }
+}
+
+// Sets up everything but the canvas & history, which the caller has already
+// created, blank or from a project. The view starts out rendered.
+void initApp(App *app, int window_width, int window_height, int background) {
+  app->journal = NULL;
+  app->upload = NULL;
+  app->upload_context = NULL;
+  app->headless = false;
+  app->window_width = window_width;
+  app->window_height = window_height;
+  app->background_color = background;
+  app->tool = TOOL_BRUSH;
+  app->brush_shape = SHAPE_CIRCLE;
+  app->cursor_radius = 64;
+  app->prev_radius = 0;
+  app->selected_color = 23; // BLACK by default
+  app->color_hovered = -1;
+  app->mouse = (Point){0, 0};
+  app->prev_mouse = (Point){0, 0};
+  app->is_saving = false;
+  app->save_message_counter = 0;
+  app->save_message[0] = '\0';
+  app->save_format = 2; // PNG by default
+  app->guide = emptyBounds();
+  app->damage = (Bounds){0, 0, window_width, window_height};
+  app->active = false;
+  app->resampling = false;
+  app->resample_again = false;
+  app->late_dirty = emptyBounds();
+  app->view_resized = false;
+  initSaveQueue(&app->saves);
+  initStroke(&app->stroke);
+  initResampler(&app->resampler);
+  layoutSidebar(app);
+
+  // The view only holds what the window shows, whatever the document size
+  initView(&app->view, window_width - SIDEBAR_WIDTH, window_height);
+  app->view_pixels = (Pixel *)malloc((size_t)app->view.width *
+                                     app->view.height * sizeof(Pixel));
+  renderView(&app->canvas, &app->view,
+             (Bounds){0, 0, app->view.width, app->view.height},
+             app->view_pixels);
+}
+
+// Starts resampling the view in the background, or has the run in flight
+// start over once it's done
+static void requestResample(App *app) {
+  if (app->resampling) {
+    app->resample_again = true;
+    return;
+  }
+  startResample(&app->resampler, &app->canvas, &app->view);
+  app->resampling = true;
+  app->resample_again = false;
+  app->late_dirty = emptyBounds();
+}
+
+// Takes the resampled view once it's done. If the view changed meanwhile
+// it's resampled again, otherwise it's swapped in whole for the window to
+// reload, & what was painted meanwhile is drawn over it next frame.
+static void landResample(App *app) {
+  app->resampling = false;
+  if (app->resample_again) {
+    requestResample(app);
+    return;
+  }
+  memcpy(app->view_pixels, app->resampler.pixels,
+         (size_t)app->view.width * app->view.height * sizeof(Pixel));
+  if (!boundsEmpty(app->late_dirty)) {
+    markDirty(&app->canvas, app->late_dirty);
+  }
+  app->view_resized = true;
+  damageWindow(app, (Bounds){SIDEBAR_WIDTH, 0,
+                             SIDEBAR_WIDTH + app->view.width,
+                             app->view.height});
+}
+
+// Lays the app out for a resized window. The canvas scales by the view's
+// smaller change of side, keeping its top left corner in place, & the view
+// is resampled in the background.
+void resizeApp(App *app, int window_width, int window_height) {
+  if ((window_width == app->window_width &&
+       window_height == app->window_height) ||
+      window_width <= SIDEBAR_WIDTH || window_height <= 0) {
+    return;
+  }
+  View *view = &app->view;
+  int width = window_width - SIDEBAR_WIDTH;
+  float scale = fminf((float)width / view->width,
+                      (float)window_height / view->height);
+  app->window_width = window_width;
+  app->window_height = window_height;
+  layoutSidebar(app);
+
+  view->width = width;
+  view->height = window_height;
+  view->zoom = fminf(fmaxf(view->zoom * scale, MIN_ZOOM), MAX_ZOOM);
+  clampView(view, &app->canvas);
+  free(app->view_pixels);
+  app->view_pixels =
+      (Pixel *)malloc((size_t)view->width * view->height * sizeof(Pixel));
+  if (app->view_pixels == NULL) {
+    fprintf(stderr, "Failed to allocate memory for the view\n");
+    exit(1);
+  }
+  app->damage = (Bounds){0, 0, window_width, window_height};
+  if (!app->headless) {
+    requestResample(app);
+  }
+}
+
+// Runs one frame of input through the update logic
+void updateApp(App *app, const InputFrame *input) {
+  Canvas *canvas = &app->canvas;
+  UndoHistory *history = &app->history;
+  View *view = &app->view;
+  Point mouse = input->mouse;
+  Point mouse_wheel = input->wheel;
+  app->mouse = mouse;
+  double start = beginPhase();
+
+  // What the window draws besides the canvas, to tell what changed
+  int previous_color = app->selected_color;
+  int previous_hovered = app->color_hovered;
+  Tool previous_tool = app->tool;
+  Shape previous_shape = app->brush_shape;
+  bool was_saving = app->is_saving;
+
+  // Select tool with B (brush), P (pencil) or F (fill) (default B brush)
+  bool ctrl_down = keyDown(input, INPUT_KEY_CTRL);
+  bool shift_down = keyDown(input, INPUT_KEY_SHIFT);
+  if (keyPressed(input, INPUT_KEY_P) && app->tool != TOOL_PENCIL) {
+    if (app->tool == TOOL_BRUSH) {
+      app->prev_radius = app->cursor_radius;
+    }
+    app->tool = TOOL_PENCIL;
+    app->cursor_radius = 4;
+  } else if (keyPressed(input, INPUT_KEY_F) && !ctrl_down &&
+             app->tool != TOOL_FILL) {
+    if (app->tool == TOOL_BRUSH) {
+      app->prev_radius = app->cursor_radius;
+    }
+    app->tool = TOOL_FILL;
+  } else if (keyPressed(input, INPUT_KEY_B) && app->tool != TOOL_BRUSH) {
+    app->tool = TOOL_BRUSH;
+    if (app->prev_radius) {
+      app->cursor_radius = app->prev_radius;
+    }
+  }
+
+  // Clear canvas with C
+  if (keyPressed(input, INPUT_KEY_C)) {
+    clearCanvas(canvas, app->background_color);
+    addClearStep(history, app->background_color, canvas);
+    if (app->journal != NULL) {
+      journalStroke(app->journal, newestStroke(history));
+    }
+  }
+
+  // Pan with the middle button, zoom about the mouse with 'ctrl+scroll' &
+  // go back to 1:1 with '0'
+  View previous_view = *view;
+  if (buttonDown(input, INPUT_BUTTON_MIDDLE)) {
+    panView(view, app->prev_mouse.x - mouse.x, app->prev_mouse.y - mouse.y);
+  }
+  if (ctrl_down && mouse_wheel.y != 0) {
+    zoomView(view, mouse_wheel.y > 0 ? 1.25f : 0.8f, mouse.x - SIDEBAR_WIDTH,
+             mouse.y);
+    mouse_wheel.y = 0; // Not a brush size change
+  }
+  if (keyPressed(input, INPUT_KEY_ZERO)) {
+    resetView(view);
+  }
+  clampView(view, canvas);
+
+  // Update cursor size on scroll for brush
+  bool grow = mouse_wheel.y > 0 || keyPressed(input, INPUT_KEY_EQUAL);
+  bool shrink = mouse_wheel.y < 0 || keyPressed(input, INPUT_KEY_MINUS);
+  if (app->tool == TOOL_BRUSH) {
+    if (grow && app->cursor_radius <= 256) {
+      app->cursor_radius += 8;
+    } else if (shrink && app->cursor_radius > 8) {
+      app->cursor_radius -= 8;
+    } else if (shrink && app->cursor_radius <= 8) {
+      app->cursor_radius = 4;
+    }
+  }
+  // Update cursor size on scroll for pencil
+  if (app->tool == TOOL_PENCIL) {
+    if (grow && app->cursor_radius <= 6) {
+      app->cursor_radius += 2;
+    } else if (shrink && app->cursor_radius > 2) {
+      app->cursor_radius -= 2;
+    } else if (shrink && app->cursor_radius <= 2) {
+      app->cursor_radius = 2;
+    }
+  }
+
+  // Cycle through colors with arrow keys
+  if (keyPressed(input, INPUT_KEY_DOWN) || keyPressed(input, INPUT_KEY_RIGHT)) {
+    app->selected_color = (app->selected_color + 1) % NUM_COLORS;
+  }
+  if (keyPressed(input, INPUT_KEY_UP) || keyPressed(input, INPUT_KEY_LEFT)) {
+    app->selected_color = (app->selected_color + NUM_COLORS - 1) % NUM_COLORS;
+  }
+
+  // Select colors with mouse
+  app->color_hovered = -1;
+  for (int i = 0; i < NUM_COLORS; i++) {
+    if (pointInRect(mouse, app->color_rectangles[i])) {
+      app->color_hovered = i;
+      if (buttonPressed(input, INPUT_BUTTON_LEFT)) {
+        app->selected_color = i;
+      }
+    }
+  }
+
+  // Cycle through shapes with tab
+  if (keyPressed(input, INPUT_KEY_TAB) && app->tool == TOOL_BRUSH) {
+    app->brush_shape = (Shape)((app->brush_shape + 1) % (SHAPE_TRIANGLE + 1));
+  }
+  endPhase(PHASE_UPDATE, start);
+
+  //-Update-canvas------------------------------------------------------------------
+  start = beginPhase();
+  // update canvas on mouse click, the view maps the mouse onto the canvas
+  Point canvas_mouse = viewToCanvas(view, mouse.x - SIDEBAR_WIDTH, mouse.y);
+  Stroke *stroke = &app->stroke;
+
+  // If mouse && prev mouse are on the canvas
+  if (app->tool != TOOL_FILL && mouse.x > SIDEBAR_WIDTH &&
+      app->prev_mouse.x > SIDEBAR_WIDTH &&
+      buttonDown(input, INPUT_BUTTON_LEFT)) {
+    if (stroke->point_count == 0) {
+      beginStroke(history, canvas);
+    }
+    // Render only the newest point, replay uses the same path
+    if (addToStroke(history, stroke, canvas_mouse.x, canvas_mouse.y,
+                    app->selected_color, app->cursor_radius, app->tool,
+                    app->brush_shape)) {
+      renderStrokeTip(canvas, stroke);
+    }
+  } else if (stroke->point_count > 0) {
+    addUndoStep(history, stroke, canvas);
+    if (app->journal != NULL) {
+      journalStroke(app->journal, newestStroke(history));
+    }
+  }
+
+  // Fill the region under a click, one step in the history
+  if (app->tool == TOOL_FILL && mouse.x > SIDEBAR_WIDTH &&
+      buttonPressed(input, INPUT_BUTTON_LEFT)) {
+    int seed_x = (int)floorf(canvas_mouse.x);
+    int seed_y = (int)floorf(canvas_mouse.y);
+    Bounds filled = floodFill(canvas, seed_x, seed_y, app->selected_color);
+    if (!boundsEmpty(filled) &&
+        addFillStep(history, seed_x, seed_y, app->selected_color, filled,
+                    canvas) &&
+        app->journal != NULL) {
+      journalStroke(app->journal, newestStroke(history));
+    }
+  }
+
+  // Fold the journal into a snapshot before it grows unbounded
+  if (app->journal != NULL && journalNeedsCompaction(app->journal)) {
+    compactJournal(app->journal, canvas, history);
+  }
+  app->prev_mouse = mouse;
+  endPhase(PHASE_CANVAS, start);
+  //--------------------------------------------------------------------------------
+
+  // Save file with 'ctrl-s', or the whole project with 'ctrl-shift-s'.
+  // Encoding happens on a background thread
+  start = beginPhase();
+  if (ctrl_down && keyPressed(input, INPUT_KEY_S)) {
+    const SaveFormat *format = &save_formats[app->save_format];
+    bool started =
+        shift_down
+            ? startProjectSave(&app->saves, canvas, history)
+            : startSave(&app->saves, canvas, format->writer, format->extension);
+    if (!started) {
+      snprintf(app->save_message, sizeof(app->save_message),
+               "Couldn't start save");
+      app->save_message_counter = 0;
+    }
+    app->is_saving = true;
+  }
+  // Cycle save format with 'ctrl-f'
+  if (ctrl_down && keyPressed(input, INPUT_KEY_F)) {
+    app->save_format = (app->save_format + 1) % NUM_SAVE_FORMATS;
+    snprintf(app->save_message, sizeof(app->save_message), "Save format: %s",
+             save_formats[app->save_format].name);
+    app->save_message_counter = 0;
+    app->is_saving = true;
+  }
+  if (pollSaves(&app->saves, app->save_message, sizeof(app->save_message))) {
+    app->save_message_counter = 0;
+  }
+  if (app->is_saving && savesInFlight(&app->saves) == 0) {
+    app->save_message_counter++;
+    if (app->save_message_counter >= 240) {
+      app->is_saving = false;
+      app->save_message_counter = 0;
+    }
+  }
+  endPhase(PHASE_SAVE, start);
+
+  // Handle undo with 'ctrl-z' & redo with 'ctrl-shift-z'
+  start = beginPhase();
+  if (ctrl_down && keyPressed(input, INPUT_KEY_Z)) {
+    if (shift_down) {
+      // Paints the undone stroke again
+      if (redoStep(history, canvas) && app->journal != NULL) {
+        journalRedo(app->journal);
+      }
+    } else if (undoStep(history, canvas) && app->journal != NULL) {
+      // Restores the nearest checkpoint & replays the strokes after it
+      journalUndo(app->journal);
+    }
+  }
+  endPhase(PHASE_UNDO, start);
+
+  // Decode an opened project's tiles a few at a time so the window shows
+  // up at once, painting on a tile that's still pending decodes it first
+  start = beginPhase();
+  if (canvas->pending_tiles > 0) {
+    double deadline = now() + 0.004;
+    int column, row;
+    while (now() < deadline && loadNextTile(canvas, &column, &row)) {
+    }
+  }
+
+  // A moved view redraws the whole window. Otherwise only the tiles drawn
+  // on since the last frame are redrawn, a run of dirty tiles along a row as
+  // one rectangle, and only if the view shows them. Headless, the dirty
+  // tiles are only cleared.
+  Bounds dirty;
+  bool moved = view->x != previous_view.x || view->y != previous_view.y ||
+               view->zoom != previous_view.zoom;
+  if (app->headless) {
+    while (nextDirtyRun(canvas, &dirty)) {
+    }
+  } else if (app->resampling) {
+    // The resample shows the canvas as it started out, what's painted since
+    // is drawn once it lands. A view that moved starts it over.
+    while (nextDirtyRun(canvas, &dirty)) {
+      app->late_dirty = unionBounds(app->late_dirty, dirty);
+    }
+    app->resample_again = app->resample_again || moved;
+    if (resampleDone(&app->resampler)) {
+      landResample(app);
+    }
+  } else {
+    if (moved) {
+      while (nextDirtyRun(canvas, &dirty)) {
+      }
+      Bounds whole = {0, 0, view->width, view->height};
+      renderView(canvas, view, whole, app->view_pixels);
+      if (app->upload != NULL) {
+        app->upload(app->upload_context, whole, app->view_pixels);
+      }
+      damageWindow(app, (Bounds){SIDEBAR_WIDTH, 0,
+                                 SIDEBAR_WIDTH + view->width, view->height});
+    }
+    while (nextDirtyRun(canvas, &dirty)) {
+      Bounds shown = canvasToView(view, dirty);
+      if (!boundsEmpty(shown)) {
+        renderView(canvas, view, shown, app->view_pixels);
+        if (app->upload != NULL) {
+          app->upload(app->upload_context, shown, app->view_pixels);
+        }
+        damageWindow(app, (Bounds){shown.x0 + SIDEBAR_WIDTH, shown.y0,
+                                   shown.x1 + SIDEBAR_WIDTH, shown.y1});
+      }
+    }
+  }
+
+  // Besides the view, the cursor guide changes where it was & where it is
+  // once it moves or looks different, swatches when the hover moves, and
+  // the save overlay covers the whole window while it's up
+  Bounds guide = guideBounds(app, input);
+  if (guide.x0 != app->guide.x0 || guide.y0 != app->guide.y0 ||
+      guide.x1 != app->guide.x1 || guide.y1 != app->guide.y1 ||
+      app->selected_color != previous_color || app->tool != previous_tool ||
+      app->brush_shape != previous_shape) {
+    damageWindow(app, app->guide);
+    damageWindow(app, guide);
+    app->guide = guide;
+  }
+  if (app->color_hovered != previous_hovered) {
+    if (previous_hovered >= 0) {
+      damageWindow(app, rectBounds(app->color_rectangles[previous_hovered]));
+    }
+    if (app->color_hovered >= 0) {
+      damageWindow(app, rectBounds(app->color_rectangles[app->color_hovered]));
+    }
+  }
+  if (app->is_saving || was_saving) {
+    damageWindow(app, (Bounds){0, 0, app->window_width, app->window_height});
+  }
+
+  // Strokes sample the mouse every frame, the save message counts frames &
+  // a resample in flight is polled for
+  app->active = stroke->point_count > 0 ||
+                buttonDown(input, INPUT_BUTTON_LEFT) ||
+                buttonDown(input, INPUT_BUTTON_MIDDLE) || app->is_saving ||
+                canvas->pending_tiles > 0 || app->resampling;
+  endPhase(PHASE_VIEW, start);
+}
+
+// Waits for saves in flight & frees everything, the journal is the caller's
+void freeApp(App *app) {
+  freeResampler(&app->resampler);
+  freeSaveQueue(&app->saves);
+  freeUndoHistory(&app->history);
+  freeCanvas(&app->canvas);
+  free(app->view_pixels);
+}
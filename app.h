@@ -0,0 +1,90 @@
+/*  --- app ---
+ *
+ *  cpaint's state & update logic, free of raylib. The window feeds it one
+ *  InputFrame a frame, live or from a trace, and draws what it leaves
+ *  behind; the benchmarks run it headless. Each frame also says which part
+ *  of the window changed & whether frames are needed without new input, so
+ *  an idle window can sleep.
+ *
+ *  The canvas scales with the window. After a resize the view is rendered
+ *  again on a worker thread, the window stretches what it last showed until
+ *  it lands.
+ */
+
+#ifndef APP_H
+#define APP_H
+
+#include "export.h"
+#include "history.h"
+#include "journal.h"
+#include "raster.h"
+#include "resample.h"
+#include "stroke.h"
+#include "trace.h"
+#include "view.h"
+#include <stdbool.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define SIDEBAR_WIDTH 50 // Window pixels left of the canvas
+//--------------------------------------------------------------------------------
+
+// Struct to store a rectangle, same layout as raylib's Rectangle
+typedef struct {
+  float x;
+  float y;
+  float width;
+  float height;
+} Rect;
+
+// Called with the part of the view that changed, pixels packed row after
+// row. Uploads it to wherever the view is shown.
+typedef void (*ViewUpload)(void *context, Bounds area, const Pixel *pixels);
+
+// Struct to store everything the update logic works on
+typedef struct {
+  Canvas canvas;        // Document being painted
+  UndoHistory history;  // Strokes painted on it
+  Journal *journal;     // Where commits are journaled, NULL for none
+  SaveQueue saves;      // Saves in flight
+  View view;            // Part of the canvas the window shows
+  Pixel *view_pixels;   // What the view shows, or the last area updated
+  ViewUpload upload;    // Where changed view pixels go, NULL for nowhere
+  void *upload_context; // Passed to upload
+  bool headless;        // No window shows the view, it's left unrendered
+  Resampler resampler;  // Renders the view again after a resize
+  bool resampling;      // A resampled view is in flight
+  bool resample_again;  // The view changed while it was, start over
+  Bounds late_dirty;    // Canvas area painted since the resample started
+  bool view_resized; // view_pixels hold a resampled view of a new size, not
+                     // uploaded: the window reloads it whole & clears this
+
+  int window_width;                // Window the app is shown in
+  int window_height;               // Window the app is shown in
+  int background_color;            // Palette index the clear key uses
+  Tool tool;                       // Tool in use
+  Shape brush_shape;               // Shape the brush stamps
+  int cursor_radius;               // Radius of the tool in use
+  int prev_radius;                 // Brush radius while another tool is used
+  int selected_color;              // Palette index painted with
+  int color_hovered;               // Palette index under the mouse, or -1
+  Rect color_rectangles[NUM_COLORS]; // Palette swatches in the sidebar
+  Stroke stroke;                   // Stroke being painted
+  Point mouse;                     // Mouse this frame
+  Point prev_mouse;                // Mouse last frame
+  bool is_saving;                  // Save overlay shown
+  int save_message_counter;        // Frames the save message has been up
+  char save_message[MAX_FILENAME + 32]; // Shown once saves finish
+  int save_format;                 // Index into save_formats
+  Bounds guide;                    // Window pixels the cursor guide covers
+  Bounds damage; // Window pixels changed since the window last drew them,
+                 // whoever draws empties it
+  bool active;   // Painting, panning, saving or loading tiles: frames are
+                 // needed whether or not input arrives
+} App;
+
+void initApp(App *app, int window_width, int window_height, int background);
+void resizeApp(App *app, int window_width, int window_height);
+void updateApp(App *app, const InputFrame *input);
+void freeApp(App *app);
+
+#endif
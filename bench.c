@@ -0,0 +1,1589 @@
+/*  --- cpaint-bench ---
+ *
+ *  Headless benchmarks for cpaint's CPU paths. Needs no window, GPU or
+ *  raylib, so it runs on CI boxes.
+ *
+ *  --- compile & run --
+ *  cc -O2 -o cpaint-bench bench.c raster.c stroke.c history.c export.c \
+ *    project.c view.c fill.c journal.c trace.c app.c profile.c replay.c \
+ *    render.c resample.c -lz -lm -lpthread && ./cpaint-bench [benchmark...]
+ */
+
+#include "app.h"
+#include "export.h"
+#include "fill.h"
+#include "history.h"
+#include "profile.h"
+#include "project.h"
+#include "raster.h"
+#include "render.h"
+#include "resample.h"
+#include "trace.h"
+#include "view.h"
+#include <dirent.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILE "cpaint-bench.tmp" // Scratch file encoders write to
+
+// Monotonic time in milliseconds
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Fills a canvas with something like a real painting: big flat strokes of
+// a few colors with some pencil detail on top
+static void paintSample(Canvas *canvas, unsigned int seed) {
+  srand(seed);
+  clearCanvas(canvas, 1);
+  int strokes = canvas->width * canvas->height / 4000;
+  for (int i = 0; i < strokes; i++) {
+    Point center = {rand() % canvas->width, rand() % canvas->height};
+    int color = rand() % NUM_COLORS;
+    switch (rand() % 4) {
+    case 0:
+      stampCircle(canvas, center, 8 + rand() % 64, color);
+      break;
+    case 1:
+      stampSquare(canvas, center, 8 + rand() % 48, color);
+      break;
+    case 2:
+      stampTriangle(canvas, center, 8 + rand() % 48, color);
+      break;
+    default: {
+      Point end = {center.x + rand() % 200 - 100, center.y + rand() % 200 - 100};
+      drawThickLine(canvas, center, end, 2 + rand() % 6, color);
+    } break;
+    }
+  }
+}
+
+//-Export-------------------------------------------------------------------------
+// True if both files hold the same bytes
+static bool sameFile(const char *a, const char *b) {
+  FILE *file_a = fopen(a, "rb");
+  FILE *file_b = fopen(b, "rb");
+  bool same = file_a != NULL && file_b != NULL;
+  while (same) {
+    int c = fgetc(file_a);
+    same = c == fgetc(file_b);
+    if (c == EOF) {
+      break;
+    }
+  }
+  if (file_a != NULL) {
+    fclose(file_a);
+  }
+  if (file_b != NULL) {
+    fclose(file_b);
+  }
+  return same;
+}
+
+// Encode time & output size of every save format across canvas sizes
+static void benchExport(void) {
+  static const int sizes[][2] = {
+      {640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+
+  printf("%-12s %-10s %10s %12s %10s\n", "canvas", "format", "ms", "bytes",
+         "ratio");
+  for (int s = 0; s < 4; s++) {
+    Canvas canvas;
+    initCanvas(&canvas, sizes[s][0], sizes[s][1], 1);
+    paintSample(&canvas, 1);
+    double raw = (double)canvas.width * canvas.height * sizeof(Pixel);
+    Pixel *pixels = (Pixel *)malloc((size_t)raw);
+    readPixels(&canvas, canvasBounds(&canvas), pixels);
+
+    for (int f = 0; f < NUM_SAVE_FORMATS; f++) {
+      const SaveFormat *format = &save_formats[f];
+
+      // Best of three runs
+      double best = 0;
+      for (int run = 0; run < 3; run++) {
+        double start = now();
+        ImageRows image = pixelRows(pixels, canvas.width, canvas.height);
+        format->writer(&image, BENCH_FILE, NULL);
+        double elapsed = now() - start;
+        if (run == 0 || elapsed < best) {
+          best = elapsed;
+        }
+      }
+
+      struct stat info;
+      stat(BENCH_FILE, &info);
+      char label[32];
+      snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+      printf("%-12s %-10s %10.2f %12lld %9.1f%%\n", label, format->name, best,
+             (long long)info.st_size, info.st_size * 100.0 / raw);
+    }
+    free(pixels);
+    freeCanvas(&canvas);
+  }
+  remove(BENCH_FILE);
+
+  // What a ctrl-s costs the render thread, against the whole save, and
+  // whether reading the tiles writes the same file as a dense copy does
+  static const int sides[] = {2048, 8192, CANVAS_MAX_SIDE};
+  printf("\n%-12s %12s %10s %6s\n", "ctrl-s", "start ms", "save ms",
+         "same");
+  for (int s = 0; s < 3; s++) {
+    Canvas canvas;
+    initCanvas(&canvas, sides[s], sides[s], 1);
+    srand(1);
+    for (int i = 0; i < 1000; i++) {
+      Point center = {rand() % 2048, rand() % 2048};
+      stampCircle(&canvas, center, 8 + rand() % 64, rand() % NUM_COLORS);
+    }
+
+    SaveQueue saves;
+    initSaveQueue(&saves);
+    double start = now();
+    if (!startSave(&saves, &canvas, writeQoi, "qoi")) {
+      fprintf(stderr, "Failed to start save\n");
+      exit(1);
+    }
+    double started = now() - start;
+    char filename[MAX_FILENAME];
+    snprintf(filename, sizeof(filename), "%s", saves.jobs[0].filename);
+    freeSaveQueue(&saves);
+    double saved = now() - start;
+
+    // Dense copies past 8192 pixels a side take more memory than CI has
+    const char *same = "-";
+    if (sides[s] <= 8192) {
+      Pixel *pixels =
+          (Pixel *)malloc((size_t)canvas.width * canvas.height * sizeof(Pixel));
+      readPixels(&canvas, canvasBounds(&canvas), pixels);
+      ImageRows image = pixelRows(pixels, canvas.width, canvas.height);
+      writeQoi(&image, BENCH_FILE, NULL);
+      free(pixels);
+      same = sameFile(filename, BENCH_FILE) ? "yes" : "NO";
+      remove(BENCH_FILE);
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+    printf("%-12s %12.3f %10.2f %6s\n", label, started, saved, same);
+    remove(filename);
+    freeCanvas(&canvas);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Project------------------------------------------------------------------------
+// True if both canvases hold the same pixels, decoding pending tiles
+static bool samePixels(Canvas *a, Canvas *b) {
+  Pixel *row_a = (Pixel *)malloc((size_t)a->width * sizeof(Pixel));
+  Pixel *row_b = (Pixel *)malloc((size_t)a->width * sizeof(Pixel));
+  bool same = a->width == b->width && a->height == b->height;
+  for (int y = 0; y < a->height && same; y++) {
+    readPixels(a, (Bounds){0, y, a->width, y + 1}, row_a);
+    readPixels(b, (Bounds){0, y, a->width, y + 1}, row_b);
+    same = memcmp(row_a, row_b, (size_t)a->width * sizeof(Pixel)) == 0;
+  }
+  free(row_b);
+  free(row_a);
+  return same;
+}
+
+// Time to open a project & show a 1280x720 window of it, against decoding
+// every tile up front. Resaving the project with only that window decoded
+// should cost the render thread next to nothing & write the same pixels.
+static void benchProject(void) {
+  static const int sizes[][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+
+  printf("%-12s %12s %10s %10s %10s %12s %10s %6s\n", "canvas", "bytes",
+         "save ms", "view ms", "full ms", "capture ms", "write ms", "same");
+  for (int s = 0; s < 3; s++) {
+    Canvas canvas;
+    initCanvas(&canvas, sizes[s][0], sizes[s][1], 1);
+    paintSample(&canvas, 1);
+    UndoHistory history;
+    initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+
+    SaveQueue saves;
+    initSaveQueue(&saves);
+    double start = now();
+    if (!startProjectSave(&saves, &canvas, &history)) {
+      fprintf(stderr, "Failed to start project save\n");
+      exit(1);
+    }
+    char filename[MAX_FILENAME];
+    snprintf(filename, sizeof(filename), "%s", saves.jobs[0].filename);
+    freeSaveQueue(&saves);
+    double save = now() - start;
+
+    double view = 0;
+    double full = 0;
+    for (int pass = 0; pass < 2; pass++) {
+      Project project;
+      Canvas loaded;
+      UndoHistory restored;
+      start = now();
+      openProject(&project, filename);
+      initHistory(&restored, project.width, project.height, HISTORY_BUDGET,
+                  project.background);
+      attachProject(&project, &loaded, &restored);
+      if (pass == 0) {
+        loadTiles(&loaded, (Bounds){0, 0, 1280, 720});
+        view = now() - start;
+      } else {
+        loadAllTiles(&loaded);
+        full = now() - start;
+      }
+      freeUndoHistory(&restored);
+      freeCanvas(&loaded);
+      closeProject(&project);
+    }
+
+    // Resave with only the window decoded, then check what was written
+    Project project;
+    Canvas loaded;
+    UndoHistory restored;
+    openProject(&project, filename);
+    initHistory(&restored, project.width, project.height, HISTORY_BUDGET,
+                project.background);
+    attachProject(&project, &loaded, &restored);
+    loadTiles(&loaded, (Bounds){0, 0, 1280, 720});
+    start = now();
+    ProjectSnapshot *snapshot = captureProject(&loaded, &restored);
+    double capture = now() - start;
+    start = now();
+    bool same = writeProjectFile(snapshot, BENCH_FILE, false, NULL);
+    double write = now() - start;
+    freeProjectSnapshot(snapshot);
+    freeUndoHistory(&restored);
+    freeCanvas(&loaded);
+    closeProject(&project);
+    if (same && openProject(&project, BENCH_FILE)) {
+      initHistory(&restored, project.width, project.height, HISTORY_BUDGET,
+                  project.background);
+      attachProject(&project, &loaded, &restored);
+      same = samePixels(&loaded, &canvas) &&
+             samePixels(historyBase(&restored), historyBase(&history));
+      freeUndoHistory(&restored);
+      freeCanvas(&loaded);
+      closeProject(&project);
+    } else {
+      same = false;
+    }
+    remove(BENCH_FILE);
+
+    struct stat info;
+    stat(filename, &info);
+    char label[32];
+    snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+    printf("%-12s %12lld %10.2f %10.2f %10.2f %12.3f %10.2f %6s\n", label,
+           (long long)info.st_size, save, view, full, capture, write,
+           same ? "yes" : "NO");
+    remove(filename);
+    freeUndoHistory(&history);
+    freeCanvas(&canvas);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Upload-------------------------------------------------------------------------
+// Bytes a frame of small pencil strokes sends to the texture with dirty
+// tiles, against uploading the whole canvas every frame
+static void benchUpload(void) {
+  static const int sizes[][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+  static const int frames = 240;
+
+  printf("%-12s %14s %14s %10s %10s\n", "canvas", "tile bytes", "full bytes",
+         "tile ms", "full ms");
+  for (int s = 0; s < 3; s++) {
+    Canvas canvas;
+    initCanvas(&canvas, sizes[s][0], sizes[s][1], 1);
+    Pixel *buffer =
+        (Pixel *)malloc((size_t)canvas.width * canvas.height * sizeof(Pixel));
+    Bounds dirty;
+    while (nextDirtyRun(&canvas, &dirty)) {
+    }
+
+    // A pencil scribble moving a few pixels a frame, as the mouse would
+    srand(1);
+    Point last = {canvas.width / 2.0f, canvas.height / 2.0f};
+    long long tile_bytes = 0;
+    double tile_ms = 0;
+    double full_ms = 0;
+    for (int f = 0; f < frames; f++) {
+      Point next = {last.x + rand() % 17 - 8, last.y + rand() % 17 - 8};
+      drawThickLine(&canvas, last, next, 4, 23);
+      last = next;
+
+      double start = now();
+      while (nextDirtyRun(&canvas, &dirty)) {
+        readPixels(&canvas, dirty, buffer);
+        tile_bytes +=
+            (long long)(dirty.x1 - dirty.x0) * (dirty.y1 - dirty.y0) * 4;
+      }
+      tile_ms += now() - start;
+
+      start = now();
+      readPixels(&canvas, canvasBounds(&canvas), buffer);
+      full_ms += now() - start;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+    printf("%-12s %14lld %14lld %10.4f %10.4f\n", label, tile_bytes / frames,
+           (long long)canvas.width * canvas.height * 4, tile_ms / frames,
+           full_ms / frames);
+    free(buffer);
+    freeCanvas(&canvas);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-View---------------------------------------------------------------------------
+// Memory of a big document with one corner painted, against a dense buffer,
+// and the time to render a 1280x720 window of it at a few zooms
+static void benchView(void) {
+  static const int sides[] = {4096, 16384, CANVAS_MAX_SIDE};
+  static const float zooms[] = {1, 0.25f, MIN_ZOOM};
+
+  printf("%-12s %12s %12s %10s %10s %10s\n", "canvas", "tile bytes",
+         "dense bytes", "1:1 ms", "1:4 ms", "fit ms");
+  for (int s = 0; s < 3; s++) {
+    Canvas canvas;
+    initCanvas(&canvas, sides[s], sides[s], 1);
+
+    // A 2048 pixel square of strokes, the rest left blank
+    srand(1);
+    for (int i = 0; i < 1000; i++) {
+      Point center = {rand() % 2048, rand() % 2048};
+      stampCircle(&canvas, center, 8 + rand() % 64, rand() % NUM_COLORS);
+    }
+
+    View view;
+    initView(&view, 1280, 720);
+    Pixel *window = (Pixel *)malloc((size_t)view.width * view.height *
+                                    sizeof(Pixel));
+    double ms[3];
+    for (int z = 0; z < 3; z++) {
+      view.zoom = zooms[z];
+      renderView(&canvas, &view, (Bounds){0, 0, view.width, view.height},
+                 window); // Builds the mips once
+      double start = now();
+      for (int run = 0; run < 10; run++) {
+        renderView(&canvas, &view, (Bounds){0, 0, view.width, view.height},
+                   window);
+      }
+      ms[z] = (now() - start) / 10;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+    printf("%-12s %12zu %12lld %10.2f %10.2f %10.2f\n", label,
+           canvasMemory(&canvas), (long long)canvas.width * canvas.height * 4,
+           ms[0], ms[1], ms[2]);
+    free(window);
+    freeCanvas(&canvas);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Fill---------------------------------------------------------------------------
+// A corridor spiralling in from the edges, one pixel walls every 4 pixels, so
+// the fill has to wind through every ring of it
+static void paintSpiral(Canvas *canvas) {
+  clearCanvas(canvas, 1);
+  int x0 = 2, y0 = 2, x1 = canvas->width - 3, y1 = canvas->height - 3;
+  while (x1 - x0 > 8 && y1 - y0 > 8) {
+    fillSpan(canvas, y0, x0, x1 + 1, 22);
+    for (int y = y0; y <= y1; y++) {
+      fillSpan(canvas, y, x1, x1 + 1, 22);
+    }
+    fillSpan(canvas, y1, x0, x1 + 1, 22);
+    for (int y = y0 + 4; y <= y1; y++) {
+      fillSpan(canvas, y, x0, x0 + 1, 22);
+    }
+    x0 += 4;
+    y0 += 4;
+    x1 -= 4;
+    y1 -= 4;
+    fillSpan(canvas, y0, x0 - 4, x0 + 1, 22);
+  }
+}
+
+// A grid of single pixel dots, every row is broken into many short runs
+static void paintDots(Canvas *canvas) {
+  clearCanvas(canvas, 1);
+  for (int y = 0; y < canvas->height; y += 2) {
+    for (int x = y % 4; x < canvas->width; x += 4) {
+      fillSpan(canvas, y, x, x + 1, 22);
+    }
+  }
+}
+
+// Fill time of a few regions on one thread against as many bands as the
+// machine has cores for
+static void benchFill(void) {
+  static const char *scenes[] = {"blank", "spiral", "dots", "sample"};
+  static const int sides[] = {1024, 4096, 8192};
+
+  printf("%-12s %-8s %12s %10s %10s\n", "canvas", "scene", "area",
+         "1 band ms", "auto ms");
+  for (int s = 0; s < 3; s++) {
+    for (int scene = 0; scene < 4; scene++) {
+      Canvas canvas;
+      initCanvas(&canvas, sides[s], sides[s], 1);
+      double ms[2];
+      Bounds filled = emptyBounds();
+      for (int mode = 0; mode < 2; mode++) {
+        switch (scene) {
+        case 0:
+          clearCanvas(&canvas, 1);
+          break;
+        case 1:
+          paintSpiral(&canvas);
+          break;
+        case 2:
+          paintDots(&canvas);
+          break;
+        default:
+          paintSample(&canvas, 1);
+          break;
+        }
+        double start = now();
+        filled = mode == 0 ? floodFillBands(&canvas, 1, 1, 12, 1)
+                           : floodFill(&canvas, 1, 1, 12);
+        ms[mode] = now() - start;
+      }
+
+      char label[32];
+      snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+      printf("%-12s %-8s %12lld %10.2f %10.2f\n", label, scenes[scene],
+             (long long)(filled.x1 - filled.x0) * (filled.y1 - filled.y0),
+             ms[0], ms[1]);
+      freeCanvas(&canvas);
+    }
+  }
+
+  // A box spanning several bands, filled on a project opened lazily, should
+  // only decode the tile rows the fill reaches & paint what it would have
+  Canvas canvas;
+  initCanvas(&canvas, 8192, 8192, 1);
+  for (int y = 256; y < 1792; y++) {
+    bool edge = y < 260 || y >= 1788;
+    fillSpan(&canvas, y, 256, edge ? 1792 : 260, 0);
+    fillSpan(&canvas, y, 1788, 1792, 0);
+  }
+  UndoHistory history;
+  initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+  ProjectSnapshot *snapshot = captureProject(&canvas, &history);
+  bool saved = writeProjectFile(snapshot, BENCH_FILE, false, NULL);
+  freeProjectSnapshot(snapshot);
+  Project project;
+  if (saved && openProject(&project, BENCH_FILE)) {
+    Canvas opened;
+    UndoHistory restored;
+    initHistory(&restored, project.width, project.height, HISTORY_BUDGET,
+                project.background);
+    attachProject(&project, &opened, &restored);
+    double start = now();
+    floodFillBands(&opened, 1000, 1000, 12, 8);
+    double ms = now() - start;
+    int tiles = opened.tile_columns * opened.tile_rows;
+    int decoded = tiles - opened.pending_tiles;
+    floodFillBands(&canvas, 1000, 1000, 12, 8);
+    printf("\nopened 8192x8192, 8 bands: %.2f ms, decoded %d of %d tiles, "
+           "same %s\n",
+           ms, decoded, tiles, samePixels(&opened, &canvas) ? "yes" : "NO");
+    freeUndoHistory(&restored);
+    freeCanvas(&opened);
+    closeProject(&project);
+  }
+  remove(BENCH_FILE);
+  freeUndoHistory(&history);
+  freeCanvas(&canvas);
+}
+//--------------------------------------------------------------------------------
+
+//-Stamp--------------------------------------------------------------------------
+// Time per stamp of each brush shape & the pencil line across brush sizes,
+// for every span kernel the CPU has
+static void benchStamp(void) {
+  static const char *shapes[] = {"circle", "square", "triangle", "pencil"};
+  static const float radii[] = {4, 16, 64, 264};
+  static const int stamps = 2000;
+
+  // Tiles already hold pixels, as they do mid painting
+  Canvas canvas;
+  initCanvas(&canvas, 2048, 2048, 1);
+  paintSample(&canvas, 1);
+  Point *points = (Point *)malloc(stamps * sizeof(Point));
+  srand(1);
+  for (int i = 0; i < stamps; i++) {
+    points[i] = (Point){300 + rand() % 1448, 300 + rand() % 1448};
+  }
+
+  printf("%-10s %6s", "shape", "radius");
+  for (int k = 0; k < NUM_SPAN_KERNELS; k++) {
+    printf(" %10s", span_kernel_names[k]);
+  }
+  printf(" %10s\n", "GB/s");
+  for (int s = 0; s < 4; s++) {
+    for (int r = 0; r < 4; r++) {
+      float radius = radii[r];
+      double best = 0;
+      printf("%-10s %6.0f", shapes[s], radius);
+      for (int k = 0; k < NUM_SPAN_KERNELS; k++) {
+        if (!setSpanKernel((SpanKernel)k)) {
+          printf(" %10s", "-");
+          continue;
+        }
+        double start = now();
+        for (int i = 0; i < stamps; i++) {
+          int color = i % NUM_COLORS;
+          switch (s) {
+          case 0:
+            stampCircle(&canvas, points[i], radius, color);
+            break;
+          case 1:
+            stampSquare(&canvas, points[i], radius, color);
+            break;
+          case 2:
+            stampTriangle(&canvas, points[i], radius, color);
+            break;
+          default: { // A pencil line as long as the brush is wide
+            Point end = {points[i].x + radius * 2, points[i].y + radius};
+            drawThickLine(&canvas, points[i], end, radius / 4 + 2, color);
+          } break;
+          }
+        }
+        double ns = (now() - start) * 1000000.0 / stamps;
+        printf(" %10.0f", ns);
+        best = k == 0 || ns < best ? ns : best;
+      }
+
+      // Bytes written per stamp, from the shape's area
+      double area[] = {3.14159 * radius * radius, 4 * radius * radius,
+                       2.6 * radius * radius,
+                       sqrtf(5) * radius * 2 * (radius / 4 + 2)};
+      printf(" %10.2f\n", area[s] * sizeof(Pixel) / best);
+    }
+  }
+  setSpanKernel(bestSpanKernel());
+  free(points);
+  freeCanvas(&canvas);
+}
+//--------------------------------------------------------------------------------
+
+//-Stroke-------------------------------------------------------------------------
+// Pixels of a canvas that aren't the background any more
+static long long paintedPixels(Canvas *canvas, Pixel *buffer) {
+  readPixels(canvas, canvasBounds(canvas), buffer);
+  long long painted = 0;
+  for (long long i = 0; i < (long long)canvas->width * canvas->height; i++) {
+    painted += memcmp(&buffer[i], &palette[1], sizeof(Pixel)) != 0;
+  }
+  return painted;
+}
+
+// Replay time & coverage of one brush stroke stamped at every point against
+// swept between them, for a slow drag (overdraw) and a fast one (gaps). The
+// dense stamps are a pixel apart along every move, what stamping needs to
+// leave no gaps either, rounding the points in between to whole pixels
+// bulges them a little past the sweep.
+static void benchStroke(void) {
+  static const char *shapes[] = {"circle", "square", "triangle"};
+  static const float radii[] = {16, 128};
+  static const int steps[] = {1, 6, 48};
+
+  Canvas canvas;
+  initCanvas(&canvas, 2048, 2048, 1);
+  Pixel *buffer = (Pixel *)malloc((size_t)canvas.width * canvas.height *
+                                  sizeof(Pixel));
+  printf("%-10s %6s %5s %10s %10s %10s %12s %12s %12s\n", "shape", "radius",
+         "step", "stamp ms", "dense ms", "swept ms", "stamp px", "dense px",
+         "swept px");
+  for (int s = 0; s < 3; s++) {
+    for (int r = 0; r < 2; r++) {
+      for (int d = 0; d < 3; d++) {
+        // A diagonal wave across the canvas, one point per frame
+        // Open strokes build at the arena head, so each needs a history
+        UndoHistory history;
+        UndoHistory dense_history;
+        initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+        initHistory(&dense_history, canvas.width, canvas.height,
+                    HISTORY_BUDGET, 1);
+        Stroke stroke;
+        Stroke dense;
+        initStroke(&stroke);
+        initStroke(&dense);
+        int last_x = 200;
+        int last_y = 1024;
+        for (int x = 200; x < 1848; x += steps[d]) {
+          int y = 1024 + (int)(600 * sinf(x / 300.0f));
+          addToStroke(&history, &stroke, x, y, 12, radii[r], TOOL_BRUSH,
+                      (Shape)s);
+          int moves = abs(x - last_x) > abs(y - last_y) ? abs(x - last_x)
+                                                        : abs(y - last_y);
+          for (int i = 1; i <= moves; i++) {
+            addToStroke(&dense_history, &dense,
+                        (int)roundf(last_x + (x - last_x) * i / (float)moves),
+                        (int)roundf(last_y + (y - last_y) * i / (float)moves),
+                        12, radii[r], TOOL_BRUSH, (Shape)s);
+          }
+          last_x = x;
+          last_y = y;
+        }
+        dense.flags = 0;
+
+        // Stamped, densely stamped, swept
+        Stroke *strokes[3] = {&stroke, &dense, &stroke};
+        double ms[3];
+        long long painted[3];
+        for (int v = 0; v < 3; v++) {
+          stroke.flags = v == 2 ? STROKE_SWEPT : 0;
+
+          // Best of five, tiles already holding pixels as in a replay
+          for (int run = 0; run < 5; run++) {
+            clearCanvas(&canvas, 1);
+            renderStroke(&canvas, strokes[v]);
+            double start = now();
+            renderStroke(&canvas, strokes[v]);
+            double elapsed = now() - start;
+            ms[v] = run == 0 || elapsed < ms[v] ? elapsed : ms[v];
+          }
+          painted[v] = paintedPixels(&canvas, buffer);
+        }
+        printf("%-10s %6.0f %5d %10.2f %10.2f %10.2f %12lld %12lld %12lld\n",
+               shapes[s], radii[r], steps[d], ms[0], ms[1], ms[2], painted[0],
+               painted[1], painted[2]);
+        freeUndoHistory(&history);
+        freeUndoHistory(&dense_history);
+      }
+    }
+  }
+  free(buffer);
+  freeCanvas(&canvas);
+}
+//--------------------------------------------------------------------------------
+
+//-Simplify-----------------------------------------------------------------------
+// Points, bytes & replay time of strokes recorded from 120 FPS mouse input
+// at a few simplification tolerances, the time committing them takes, the
+// pixels the commit redraws differently from what was painted live, and
+// the pixels replay then paints differently from the canvas, which must be
+// none
+static void benchSimplify(void) {
+  static const float tolerances[] = {0, 0.5f, 1, 2};
+  static const char *tools[] = {"brush", "brush", "brush", "pencil"};
+  static const int radii[] = {24, 64, 264, 4};
+
+  Canvas canvas;
+  Canvas exact;
+  initCanvas(&canvas, 2048, 2048, 1);
+  initCanvas(&exact, 2048, 2048, 1);
+  size_t size = (size_t)canvas.width * canvas.height * sizeof(Pixel);
+  Pixel *buffer = (Pixel *)malloc(size);
+  Pixel *reference = (Pixel *)malloc(size);
+  Pixel *live = (Pixel *)malloc(size);
+
+  printf("%-8s %6s %9s %8s %8s %8s %10s %10s %10s %10s\n", "tool", "radius",
+         "tolerance", "input", "kept", "bytes", "commit ms", "replay ms",
+         "moved px", "changed px");
+  for (int t = 0; t < 4; t++) {
+    for (int i = 0; i < 4; i++) {
+      UndoHistory history;
+      initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+      history.tolerance = tolerances[i];
+      clearCanvas(&canvas, 1);
+
+      // Loops of a wobbling hand that keeps stopping, sampled every frame
+      Stroke stroke;
+      initStroke(&stroke);
+      beginStroke(&history, &canvas);
+      Tool tool = t < 3 ? TOOL_BRUSH : TOOL_PENCIL;
+      float angle = 0;
+      for (int frame = 0; frame < 120 * 20; frame++) {
+        float time = frame / 120.0f;
+        float speed = fmaxf(0, sinf(time * 1.7f));
+        angle += speed * 1.5f / 120;
+        float x = 1024 + 700 * cosf(angle) + 6 * speed * sinf(time * 23);
+        float y = 1024 + 500 * sinf(angle * 1.3f) + 6 * speed * cosf(time * 19);
+        if (addToStroke(&history, &stroke, x, y, 12, radii[t], tool,
+                        SHAPE_CIRCLE)) {
+          renderStrokeTip(&canvas, &stroke);
+        }
+      }
+      long long input = stroke.point_count + history.repeated_points;
+      readPixels(&canvas, canvasBounds(&canvas), live);
+      double commit = now();
+      addUndoStep(&history, &stroke, &canvas);
+      commit = now() - commit;
+      const Stroke *committed = newestStroke(&history);
+
+      // Best of three replays
+      double best = 0;
+      for (int run = 0; run < 3; run++) {
+        clearCanvas(&exact, 1);
+        double start = now();
+        renderStroke(&exact, committed);
+        double elapsed = now() - start;
+        best = run == 0 || elapsed < best ? elapsed : best;
+      }
+
+      // Compare the commit against what was painted live, and replay
+      // against the commit
+      readPixels(&canvas, canvasBounds(&canvas), reference);
+      readPixels(&exact, canvasBounds(&exact), buffer);
+      long long moved = 0;
+      long long changed = 0;
+      for (long long p = 0; p < (long long)canvas.width * canvas.height; p++) {
+        moved += memcmp(&live[p], &reference[p], sizeof(Pixel)) != 0;
+        changed += memcmp(&buffer[p], &reference[p], sizeof(Pixel)) != 0;
+      }
+      printf("%-8s %6d %9.2f %8lld %8d %8d %10.3f %10.3f %10lld %10lld\n",
+             tools[t], radii[t], tolerances[i], input, committed->point_count,
+             committed->size, commit, best, moved, changed);
+      if (changed != 0) {
+        fprintf(stderr, "Replayed %s stroke changed %lld px\n", tools[t],
+                changed);
+        exit(1);
+      }
+      freeUndoHistory(&history);
+    }
+  }
+  free(live);
+  free(reference);
+  free(buffer);
+  freeCanvas(&exact);
+  freeCanvas(&canvas);
+}
+//--------------------------------------------------------------------------------
+
+//-Trace--------------------------------------------------------------------------
+#define TRACE_WINDOW_WIDTH 1280  // Window synthetic traces are played in
+#define TRACE_WINDOW_HEIGHT 720  // Window synthetic traces are played in
+#define TRACE_DOCUMENT_SIDE 2048 // Blank document they start from
+#define TRACE_SCRATCH "cpaint-bench.d" // Directory replayed saves land in
+
+// Struct to store a session's input, built up a frame at a time
+typedef struct {
+  InputFrame *frames;
+  int count;
+  int capacity;
+} TraceFrames;
+
+// Appends a frame with the mouse where the last one left it & nothing held
+static InputFrame *addFrame(TraceFrames *trace) {
+  if (trace->count == trace->capacity) {
+    trace->capacity = trace->capacity ? trace->capacity * 2 : 1024;
+    trace->frames = (InputFrame *)realloc(
+        trace->frames, (size_t)trace->capacity * sizeof(InputFrame));
+  }
+  InputFrame *frame = &trace->frames[trace->count];
+  *frame = (InputFrame){0};
+  if (trace->count > 0) {
+    frame->mouse = trace->frames[trace->count - 1].mouse;
+  }
+  trace->count++;
+  return frame;
+}
+
+// One frame pressing key, with ctrl & shift held as asked
+static void pressKey(TraceFrames *trace, InputKey key, bool ctrl, bool shift) {
+  InputFrame *frame = addFrame(trace);
+  frame->keys_down = 1u << key | (ctrl ? 1u << INPUT_KEY_CTRL : 0) |
+                     (shift ? 1u << INPUT_KEY_SHIFT : 0);
+  frame->keys_pressed = 1u << key;
+}
+
+// Drags the left button from one window position to another over frames,
+// wobbling like a hand, then lets go
+static void drag(TraceFrames *trace, float x0, float y0, float x1, float y1,
+                 int frames) {
+  for (int i = 0; i <= frames; i++) {
+    float t = (float)i / frames;
+    InputFrame *frame = addFrame(trace);
+    frame->mouse = (Point){x0 + (x1 - x0) * t + 4 * sinf(i * 0.31f),
+                           y0 + (y1 - y0) * t + 4 * cosf(i * 0.23f)};
+    frame->buttons_down = 1 << INPUT_BUTTON_LEFT;
+    frame->buttons_pressed = i == 0 ? 1 << INPUT_BUTTON_LEFT : 0;
+  }
+  addFrame(trace); // Released, the stroke is committed
+}
+
+static float randomX(void) { return 60 + rand() % (TRACE_WINDOW_WIDTH - 70); }
+static float randomY(void) { return 10 + rand() % (TRACE_WINDOW_HEIGHT - 20); }
+
+// Long strokes sweeping the whole window, several seconds each
+static void traceLongStrokes(TraceFrames *trace) {
+  for (int i = 0; i < 20; i++) {
+    addFrame(trace)->mouse = (Point){randomX(), randomY()};
+    drag(trace, trace->frames[trace->count - 1].mouse.x,
+         trace->frames[trace->count - 1].mouse.y, randomX(), randomY(), 600);
+  }
+}
+
+// 250 short strokes undone one a frame, then all redone
+static void traceUndoStorm(TraceFrames *trace) {
+  for (int i = 0; i < 250; i++) {
+    float x = randomX();
+    float y = randomY();
+    addFrame(trace)->mouse = (Point){x, y};
+    drag(trace, x, y, x + rand() % 200 - 100, y + rand() % 200 - 100, 20);
+  }
+  for (int i = 0; i < 250; i++) {
+    pressKey(trace, INPUT_KEY_Z, true, false);
+  }
+  for (int i = 0; i < 250; i++) {
+    pressKey(trace, INPUT_KEY_Z, true, true);
+  }
+}
+
+// The largest brush in every shape
+static void traceHugeBrushes(TraceFrames *trace) {
+  for (int i = 0; i < 40; i++) {
+    addFrame(trace)->wheel = (Point){0, 1};
+  }
+  for (int shape = 0; shape < 3; shape++) {
+    for (int i = 0; i < 4; i++) {
+      addFrame(trace)->mouse = (Point){randomX(), randomY()};
+      drag(trace, trace->frames[trace->count - 1].mouse.x,
+           trace->frames[trace->count - 1].mouse.y, randomX(), randomY(),
+           240);
+    }
+    pressKey(trace, INPUT_KEY_TAB, false, false);
+  }
+}
+
+// A stroke, then a save, over & over, every few a project save
+static void traceSaves(TraceFrames *trace) {
+  for (int i = 0; i < 24; i++) {
+    addFrame(trace)->mouse = (Point){randomX(), randomY()};
+    drag(trace, trace->frames[trace->count - 1].mouse.x,
+         trace->frames[trace->count - 1].mouse.y, randomX(), randomY(), 60);
+    pressKey(trace, INPUT_KEY_S, true, i % 6 == 5);
+  }
+}
+
+// Paint bucket clicks between strokes that split up the canvas
+static void traceFills(TraceFrames *trace) {
+  for (int i = 0; i < 12; i++) {
+    addFrame(trace)->mouse = (Point){randomX(), randomY()};
+    drag(trace, trace->frames[trace->count - 1].mouse.x,
+         trace->frames[trace->count - 1].mouse.y, randomX(), randomY(), 60);
+  }
+  pressKey(trace, INPUT_KEY_F, false, false);
+  for (int i = 0; i < 100; i++) {
+    pressKey(trace, INPUT_KEY_RIGHT, false, false);
+    InputFrame *click = addFrame(trace);
+    click->mouse = (Point){randomX(), randomY()};
+    click->buttons_down = click->buttons_pressed = 1 << INPUT_BUTTON_LEFT;
+    addFrame(trace);
+  }
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Plays frames through the update logic on a blank document, the view
+// rendered but not shown. Returns the total time, each frame's goes in times.
+static double playFrames(const InputFrame *frames, int count, double *times,
+                         int window_width, int window_height,
+                         int document_width, int document_height) {
+  App app;
+  initCanvas(&app.canvas, document_width, document_height, 1);
+  initHistory(&app.history, document_width, document_height, HISTORY_BUDGET,
+              1);
+  initApp(&app, window_width, window_height, 0);
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    double frame = now();
+    updateApp(&app, &frames[i]);
+    times[i] = now() - frame;
+  }
+  double total = now() - start;
+  freeApp(&app); // Waits for saves still encoding
+  return total;
+}
+
+// Replays frames & reports percentiles of the time each frame took
+static void replayFrames(const char *name, const InputFrame *frames,
+                         int count, int window_width, int window_height,
+                         int document_width, int document_height) {
+  double *times = (double *)malloc((size_t)count * sizeof(double));
+  double total = playFrames(frames, count, times, window_width, window_height,
+                            document_width, document_height);
+
+  qsort(times, count, sizeof(double), compareDoubles);
+  printf("%-14s %7d %9.3f %9.3f %9.3f %9.3f %10.1f\n", name, count,
+         times[count / 2], times[(int)(count * 0.95)],
+         times[(int)(count * 0.99)], times[count - 1], total);
+  free(times);
+}
+
+// Frame time percentiles of synthetic sessions replayed headless, plus the
+// trace in CPAINT_BENCH_TRACE if one was recorded with CPAINT_RECORD
+static void benchTrace(void) {
+  static const struct {
+    const char *name;
+    void (*build)(TraceFrames *trace);
+  } sessions[] = {
+      {"long strokes", traceLongStrokes}, {"undo storm", traceUndoStorm},
+      {"huge brushes", traceHugeBrushes}, {"saves", traceSaves},
+      {"fills", traceFills},
+  };
+
+  // Read the recorded trace before moving into the scratch directory
+  TraceFrames recorded = {0};
+  Trace trace;
+  const char *filename = getenv("CPAINT_BENCH_TRACE");
+  if (filename != NULL && !openTrace(&trace, filename)) {
+    fprintf(stderr, "Failed to open trace %s\n", filename);
+    filename = NULL;
+  }
+  if (filename != NULL) {
+    InputFrame frame;
+    while (readTraceFrame(&trace, &frame)) {
+      *addFrame(&recorded) = frame;
+    }
+    closeTrace(&trace);
+  }
+
+  // Saves write next to the working directory, keep them out of the way
+  mkdir(TRACE_SCRATCH, 0755);
+  if (chdir(TRACE_SCRATCH) != 0) {
+    fprintf(stderr, "Failed to enter %s\n", TRACE_SCRATCH);
+    exit(1);
+  }
+
+  printf("%-14s %7s %9s %9s %9s %9s %10s\n", "session", "frames", "p50 ms",
+         "p95 ms", "p99 ms", "max ms", "total ms");
+  for (int s = 0; s < 5; s++) {
+    TraceFrames frames = {0};
+    srand(1);
+    sessions[s].build(&frames);
+    replayFrames(sessions[s].name, frames.frames, frames.count,
+                 TRACE_WINDOW_WIDTH, TRACE_WINDOW_HEIGHT, TRACE_DOCUMENT_SIDE,
+                 TRACE_DOCUMENT_SIDE);
+    free(frames.frames);
+  }
+  if (recorded.count > 0) {
+    replayFrames("recorded", recorded.frames, recorded.count,
+                 trace.window_width, trace.window_height,
+                 trace.document_width, trace.document_height);
+  }
+  free(recorded.frames);
+
+  DIR *dir = opendir(".");
+  struct dirent *entry;
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "cpaint-", 7) == 0) {
+      remove(entry->d_name);
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  if (chdir("..") == 0) {
+    rmdir(TRACE_SCRATCH);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Idle---------------------------------------------------------------------------
+// The mouse resting over the canvas
+static void traceIdle(TraceFrames *trace) {
+  addFrame(trace)->mouse = (Point){640, 360};
+  for (int i = 0; i < 1200; i++) {
+    addFrame(trace);
+  }
+}
+
+// The mouse wandering over the canvas & the swatches, nothing pressed
+static void traceHover(TraceFrames *trace) {
+  for (int i = 0; i < 1200; i++) {
+    addFrame(trace)->mouse =
+        (Point){620 + 580 * sinf(i * 0.01f), 360 + 300 * cosf(i * 0.013f)};
+  }
+}
+
+// What each session asks of the window: frames it needs whatever the input,
+// frames with anything to recomposite, how much of the window those cover
+// on average & the update time a frame
+static void benchIdle(void) {
+  static const struct {
+    const char *name;
+    void (*build)(TraceFrames *trace);
+  } sessions[] = {
+      {"idle", traceIdle},
+      {"hover", traceHover},
+      {"long strokes", traceLongStrokes},
+      {"fills", traceFills},
+  };
+
+  printf("%-14s %7s %7s %8s %9s %10s\n", "session", "frames", "active",
+         "damaged", "damage %", "update us");
+  for (int s = 0; s < 4; s++) {
+    TraceFrames frames = {0};
+    srand(1);
+    sessions[s].build(&frames);
+
+    App app;
+    initCanvas(&app.canvas, TRACE_DOCUMENT_SIDE, TRACE_DOCUMENT_SIDE, 1);
+    initHistory(&app.history, TRACE_DOCUMENT_SIDE, TRACE_DOCUMENT_SIDE,
+                HISTORY_BUDGET, 1);
+    initApp(&app, TRACE_WINDOW_WIDTH, TRACE_WINDOW_HEIGHT, 0);
+    app.damage = emptyBounds(); // The first frame draws everything anyway
+
+    int active = 0;
+    int damaged = 0;
+    long long damaged_pixels = 0;
+    double start = now();
+    for (int i = 0; i < frames.count; i++) {
+      updateApp(&app, &frames.frames[i]);
+      active += app.active;
+      if (!boundsEmpty(app.damage)) {
+        damaged++;
+        damaged_pixels += (long long)(app.damage.x1 - app.damage.x0) *
+                          (app.damage.y1 - app.damage.y0);
+        app.damage = emptyBounds();
+      }
+    }
+    double update = (now() - start) * 1000 / frames.count;
+
+    printf("%-14s %7d %7d %8d %9.2f %10.1f\n", sessions[s].name, frames.count,
+           active, damaged,
+           damaged > 0 ? 100.0 * damaged_pixels / damaged /
+                             (TRACE_WINDOW_WIDTH * TRACE_WINDOW_HEIGHT)
+                       : 0.0,
+           update);
+    freeApp(&app);
+    free(frames.frames);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Profile------------------------------------------------------------------------
+// Cost of the frame phase timers: beginPhase/endPhase pairs in a tight loop
+// with profiling off, with rolling percentiles only & with every phase kept
+// for a trace, best of five. Every phase runs once a frame. With
+// CPAINT_PROFILE set a recorded session is written there as a Chrome trace.
+static void benchProfile(void) {
+  static const char *modes[] = {"off", "percentiles", "trace"};
+  const int pairs = 100000;
+
+  printf("%-12s %7s %10s %10s\n", "profiling", "pairs", "ns / pair",
+         "ns / frame");
+  for (int mode = 0; mode < 3; mode++) {
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+      if (mode > 0) {
+        startProfile(mode == 2);
+      }
+      double start = now();
+      for (int i = 0; i < pairs; i++) {
+        double phase = beginPhase();
+        // Reloads profiling as the code between phases in a frame would
+        atomic_signal_fence(memory_order_seq_cst);
+        endPhase((Phase)(i % NUM_PHASES), phase);
+      }
+      double elapsed = now() - start;
+      stopProfile();
+      best = run == 0 || elapsed < best ? elapsed : best;
+    }
+    double pair = best * 1e6 / pairs;
+    printf("%-12s %7d %10.1f %10.1f\n", modes[mode], pairs, pair,
+           pair * NUM_PHASES);
+  }
+
+  const char *filename = getenv("CPAINT_PROFILE");
+  if (filename != NULL) {
+    TraceFrames frames = {0};
+    srand(1);
+    traceLongStrokes(&frames);
+    traceUndoStorm(&frames);
+    double *times = (double *)malloc((size_t)frames.count * sizeof(double));
+    startProfile(true);
+    playFrames(frames.frames, frames.count, times, TRACE_WINDOW_WIDTH,
+               TRACE_WINDOW_HEIGHT, TRACE_DOCUMENT_SIDE, TRACE_DOCUMENT_SIDE);
+    stopProfile();
+    if (!writeProfile(filename)) {
+      fprintf(stderr, "Failed to write profile %s\n", filename);
+    }
+    free(times);
+    free(frames.frames);
+  }
+  freeProfile();
+}
+//--------------------------------------------------------------------------------
+
+//-Replay-------------------------------------------------------------------------
+// Paints strokes all over of every tool & shape, a few fills between them
+static void paintStrokes(Canvas *canvas, UndoHistory *history, int strokes) {
+  srand(1);
+  for (int s = 0; s < strokes; s++) {
+    Stroke stroke;
+    initStroke(&stroke);
+    Tool tool = rand() % 3 == 0 ? TOOL_PENCIL : TOOL_BRUSH;
+    int radius = tool == TOOL_PENCIL ? 2 + rand() % 6 : 4 + rand() % 64;
+    Shape shape = (Shape)(rand() % 3);
+    int color = rand() % NUM_COLORS;
+    float x = rand() % canvas->width;
+    float y = rand() % canvas->height;
+    float angle = rand() % 628 / 100.0f;
+    beginStroke(history, canvas);
+    for (int p = 0; p < 200; p++) {
+      angle += (rand() % 21 - 10) / 100.0f;
+      x = fminf(fmaxf(x + 6 * cosf(angle), 0), canvas->width - 1);
+      y = fminf(fmaxf(y + 6 * sinf(angle), 0), canvas->height - 1);
+      if (addToStroke(history, &stroke, x, y, color, radius, tool, shape)) {
+        renderStrokeTip(canvas, &stroke);
+      }
+    }
+    addUndoStep(history, &stroke, canvas);
+    if (s % 64 == 63) {
+      int fx = rand() % canvas->width;
+      int fy = rand() % canvas->height;
+      Bounds filled = floodFill(canvas, fx, fy, color);
+      if (!boundsEmpty(filled)) {
+        addFillStep(history, fx, fy, color, filled, canvas);
+      }
+    }
+  }
+}
+
+// Undo of a clear over a painted canvas replays every stroke before it across
+// the whole canvas, a full rebuild. Time by thread count, each checked
+// against the single threaded result. CPU time is every thread's, so against
+// one thread's it shows what splitting the replay into blocks costs, on a
+// machine without the cores for any speedup too.
+static void benchReplay(void) {
+  static const int thread_counts[] = {1, 2, 4, 8, 16, 0};
+  static const int sides[] = {2048, 4096};
+
+  printf("%-12s %8s %8s %10s %10s %8s %10s\n", "canvas", "strokes",
+         "threads", "undo ms", "cpu ms", "speedup", "identical");
+  for (int i = 0; i < 2; i++) {
+    Canvas canvas;
+    initCanvas(&canvas, sides[i], sides[i], 1);
+    UndoHistory history;
+    initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+    history.checkpoint_strokes = 1 << 20; // Undo replays from the base
+    history.checkpoint_bytes = 1 << 30;
+    paintStrokes(&canvas, &history, sides[i] / 8);
+    clearCanvas(&canvas, 0);
+    addClearStep(&history, 0, &canvas);
+
+    size_t size = (size_t)canvas.width * canvas.height * sizeof(Pixel);
+    Pixel *reference = (Pixel *)malloc(size);
+    Pixel *pixels = (Pixel *)malloc(size);
+    double serial = 0;
+    for (int t = 0; t < 6; t++) {
+      history.replay_threads = thread_counts[t];
+
+      // Best of five
+      double best = 0;
+      double cpu = 0;
+      int replayed = 0;
+      for (int run = 0; run < 5; run++) {
+        clock_t cpu_start = clock();
+        double start = now();
+        undoStep(&history, &canvas);
+        double elapsed = now() - start;
+        double cpu_elapsed = (clock() - cpu_start) * 1000.0 / CLOCKS_PER_SEC;
+        replayed = history.replayed_strokes;
+        best = run == 0 || elapsed < best ? elapsed : best;
+        cpu = run == 0 || cpu_elapsed < cpu ? cpu_elapsed : cpu;
+        readPixels(&canvas, canvasBounds(&canvas), pixels);
+        redoStep(&history, &canvas);
+      }
+      if (t == 0) {
+        serial = best;
+        memcpy(reference, pixels, size);
+      }
+
+      char label[32];
+      char threads[16];
+      snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+      snprintf(threads, sizeof(threads), "%d", thread_counts[t]);
+      printf("%-12s %8d %8s %10.2f %10.2f %7.2fx %10s\n", label, replayed,
+             thread_counts[t] ? threads : "auto", best, cpu, serial / best,
+             memcmp(pixels, reference, size) == 0 ? "yes" : "NO");
+    }
+    free(pixels);
+    free(reference);
+    freeUndoHistory(&history);
+    freeCanvas(&canvas);
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Indexed------------------------------------------------------------------------
+// The same session painted on an RGBA & an indexed canvas: memory held by
+// the canvas & the history's snapshots, paint, undo, view & save times, and
+// whether every result reads back the same
+static void benchIndexed(void) {
+  static const int sides[] = {2048, 4096};
+  mkdir("cpaint-bench.d", 0755);
+
+  printf("%-12s %-8s %10s %10s %9s %9s %9s %9s %10s\n", "canvas", "format",
+         "canvas MiB", "snaps MiB", "paint ms", "undo ms", "view ms",
+         "save ms", "identical");
+  for (int i = 0; i < 2; i++) {
+    size_t size = (size_t)sides[i] * sides[i] * sizeof(Pixel);
+    Pixel *painted = (Pixel *)malloc(size);
+    Pixel *undone = (Pixel *)malloc(size);
+    Pixel *pixels = (Pixel *)malloc(size);
+    for (int indexed = 0; indexed < 2; indexed++) {
+      Canvas canvas;
+      initCanvas(&canvas, sides[i], sides[i], 1);
+      convertCanvas(&canvas, indexed);
+      UndoHistory history;
+      initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+      convertCanvas(historyBase(&history), indexed);
+
+      double start = now();
+      paintStrokes(&canvas, &history, sides[i] / 8);
+      double paint = now() - start;
+
+      // Every read must match the RGBA canvas's
+      readPixels(&canvas, canvasBounds(&canvas), pixels);
+      if (!indexed) {
+        memcpy(painted, pixels, size);
+      }
+      bool identical = memcmp(pixels, painted, size) == 0;
+
+      View view;
+      initView(&view, 1920, 1080);
+      Pixel *window = (Pixel *)malloc((size_t)view.width * view.height *
+                                      sizeof(Pixel));
+      Bounds shown = {0, 0, view.width, view.height};
+      start = now();
+      for (int frame = 0; frame < 10; frame++) {
+        renderView(&canvas, &view, shown, window);
+      }
+      double view_ms = (now() - start) / 10;
+      free(window);
+
+      // Project written from one format, reopened into the same one
+      start = now();
+      ProjectSnapshot *snapshot = captureProject(&canvas, &history);
+      bool saved = writeProjectFile(snapshot, "cpaint-bench.d/indexed.cpaint",
+                                    false, NULL);
+      freeProjectSnapshot(snapshot);
+      double save = now() - start;
+      Project project;
+      if (saved && openProject(&project, "cpaint-bench.d/indexed.cpaint")) {
+        Canvas opened;
+        UndoHistory restored;
+        initHistory(&restored, project.width, project.height, HISTORY_BUDGET,
+                    1);
+        attachProject(&project, &opened, &restored);
+        convertCanvas(&opened, indexed);
+        readPixels(&opened, canvasBounds(&opened), pixels);
+        identical = identical && memcmp(pixels, painted, size) == 0;
+        freeUndoHistory(&restored);
+        freeCanvas(&opened);
+        closeProject(&project);
+      } else {
+        identical = false;
+      }
+
+      // Undo reads back the packed snapshots
+      start = now();
+      for (int u = 0; u < 32; u++) {
+        undoStep(&history, &canvas);
+      }
+      double undo = (now() - start) / 32;
+      readPixels(&canvas, canvasBounds(&canvas), pixels);
+      if (!indexed) {
+        memcpy(undone, pixels, size);
+      }
+      identical = identical && memcmp(pixels, undone, size) == 0;
+
+      char label[32];
+      snprintf(label, sizeof(label), "%dx%d", canvas.width, canvas.height);
+      printf("%-12s %-8s %10.2f %10.2f %9.1f %9.2f %9.2f %9.1f %10s\n", label,
+             indexed ? "indexed" : "rgba",
+             canvasMemory(&canvas) / (1024.0 * 1024.0),
+             history.snapshot_bytes / (1024.0 * 1024.0), paint, undo, view_ms,
+             save, identical ? "yes" : "NO");
+      freeUndoHistory(&history);
+      freeCanvas(&canvas);
+    }
+    free(pixels);
+    free(undone);
+    free(painted);
+  }
+  remove("cpaint-bench.d/indexed.cpaint");
+  rmdir("cpaint-bench.d");
+}
+//--------------------------------------------------------------------------------
+
+//-Render-------------------------------------------------------------------------
+#define RENDER_SCRATCH "cpaint-bench.d" // Directory documents & images go in
+#define RENDER_DOCUMENTS 8              // Documents of each kind in the batch
+
+// A short session: strokes all over, a few of them undone
+static void traceSketch(TraceFrames *trace) {
+  for (int i = 0; i < 40; i++) {
+    addFrame(trace)->mouse = (Point){randomX(), randomY()};
+    drag(trace, trace->frames[trace->count - 1].mouse.x,
+         trace->frames[trace->count - 1].mouse.y, randomX(), randomY(), 30);
+  }
+  for (int i = 0; i < 10; i++) {
+    pressKey(trace, INPUT_KEY_Z, true, false);
+  }
+}
+
+// Documents a second the batch renderer gets through, on one thread & one
+// per core, for thumbnails & full size images of projects & traces
+static void benchRender(void) {
+  static const char *kinds[] = {"projects", "traces"};
+  mkdir(RENDER_SCRATCH, 0755);
+
+  // Projects of painted 2048x2048 canvases & traces of short sessions
+  char names[2][RENDER_DOCUMENTS][64];
+  const char *files[2][RENDER_DOCUMENTS];
+  for (int i = 0; i < RENDER_DOCUMENTS; i++) {
+    snprintf(names[0][i], sizeof(names[0][i]), RENDER_SCRATCH "/p%d.cpaint",
+             i);
+    Canvas canvas;
+    initCanvas(&canvas, TRACE_DOCUMENT_SIDE, TRACE_DOCUMENT_SIDE, 1);
+    paintSample(&canvas, i + 1);
+    UndoHistory history;
+    initHistory(&history, canvas.width, canvas.height, HISTORY_BUDGET, 1);
+    ProjectSnapshot *snapshot = captureProject(&canvas, &history);
+    bool saved = writeProjectFile(snapshot, names[0][i], false, NULL);
+    freeProjectSnapshot(snapshot);
+    freeUndoHistory(&history);
+    freeCanvas(&canvas);
+
+    snprintf(names[1][i], sizeof(names[1][i]), RENDER_SCRATCH "/t%d.trace", i);
+    TraceFrames frames = {0};
+    srand(i + 1);
+    traceSketch(&frames);
+    Trace trace = {0};
+    saved = saved && createTrace(&trace, names[1][i], TRACE_WINDOW_WIDTH,
+                                 TRACE_WINDOW_HEIGHT, TRACE_DOCUMENT_SIDE,
+                                 TRACE_DOCUMENT_SIDE);
+    for (int f = 0; saved && f < frames.count; f++) {
+      saved = writeTraceFrame(&trace, &frames.frames[f]);
+    }
+    if (trace.file != NULL) {
+      closeTrace(&trace);
+    }
+    free(frames.frames);
+    if (!saved) {
+      fprintf(stderr, "Failed to write the documents to render\n");
+      exit(1);
+    }
+    files[0][i] = names[0][i];
+    files[1][i] = names[1][i];
+  }
+
+  printf("%-10s %-10s %8s %9s %8s\n", "documents", "image", "threads",
+         "total ms", "docs/s");
+  for (int kind = 0; kind < 2; kind++) {
+    for (int thumbnail = 1; thumbnail >= 0; thumbnail--) {
+      for (int threads = 1; threads >= 0; threads--) {
+        RenderOptions options = {.width = thumbnail ? 256 : 0,
+                                 .height = thumbnail ? 256 : 0,
+                                 .scale = 1,
+                                 .format = &save_formats[1], // PNG fast
+                                 .threads = threads,
+                                 .quiet = true};
+        double start = now();
+        int rendered = renderDocuments(files[kind], RENDER_DOCUMENTS, &options);
+        double total = now() - start;
+        if (rendered != RENDER_DOCUMENTS) {
+          fprintf(stderr, "Rendered %d of %d %s\n", rendered,
+                  RENDER_DOCUMENTS, kinds[kind]);
+        }
+        printf("%-10s %-10s %8s %9.1f %8.1f\n", kinds[kind],
+               thumbnail ? "256x256" : "full", threads ? "1" : "cores", total,
+               rendered * 1000 / total);
+      }
+    }
+  }
+
+  // Images land next to their documents
+  for (int i = 0; i < RENDER_DOCUMENTS; i++) {
+    for (int kind = 0; kind < 2; kind++) {
+      remove(files[kind][i]);
+      char image[64];
+      snprintf(image, sizeof(image), "%.*s.png",
+               (int)(strrchr(files[kind][i], '.') - files[kind][i]),
+               files[kind][i]);
+      remove(image);
+    }
+  }
+  rmdir(RENDER_SCRATCH);
+}
+//--------------------------------------------------------------------------------
+
+//-Resample-----------------------------------------------------------------------
+// A window dragged through a few sizes over a painted 4096 pixel canvas, the
+// view fitting the canvas each time. Compares rendering each view in full
+// on the main thread against the resampler with no levels yet, with every
+// level up to date, after a stroke, which only refilters the tiles it
+// touched, and after painting that spot again between two runs with nothing
+// drawing the tiles' mips in between, as painting at full zoom does. The
+// resampled view has to match renderView exactly. Then the
+// memory the levels take on the largest canvas with only a corner painted.
+static void benchResample(void) {
+  static const int sizes[][2] = {
+      {1280, 720}, {1600, 900}, {1920, 1080}, {1000, 800}, {640, 480}};
+
+  Canvas canvas;
+  initCanvas(&canvas, 4096, 4096, 1);
+  paintSample(&canvas, 1);
+  Resampler resampler;
+  initResampler(&resampler);
+
+  printf("%-10s %8s %12s %10s %10s %12s %12s %10s %10s %6s\n", "view",
+         "zoom", "render ms", "cold ms", "warm ms", "stroke ms", "repaint ms",
+         "refilter", "levels MiB", "same");
+  for (int s = 0; s < 5; s++) {
+    View view;
+    initView(&view, sizes[s][0], sizes[s][1]);
+    view.zoom = fminf((float)view.width / canvas.width,
+                      (float)view.height / canvas.height);
+    clampView(&view, &canvas);
+    size_t size = (size_t)view.width * view.height;
+    Pixel *expected = (Pixel *)malloc(size * sizeof(Pixel));
+    Bounds whole = {0, 0, view.width, view.height};
+    renderView(&canvas, &view, whole, expected); // Builds the tiles' mips
+    double start = now();
+    renderView(&canvas, &view, whole, expected);
+    double render_ms = now() - start;
+
+    // Only the first size starts with no levels at all
+    double ms[4];
+    int refiltered = 0;
+    bool same = true;
+    for (int pass = 0; pass < 4; pass++) {
+      if (pass == 0 && s > 0) {
+        freeResampler(&resampler);
+        initResampler(&resampler);
+      }
+      if (pass == 2) {
+        Point center = {rand() % canvas.width, rand() % canvas.height};
+        stampCircle(&canvas, center, 64, rand() % NUM_COLORS);
+        renderView(&canvas, &view, whole, expected);
+        Bounds dirty;
+        while (nextDirtyRun(&canvas, &dirty)) {
+        }
+      }
+      if (pass == 3) {
+        Point center = {rand() % canvas.width, rand() % canvas.height};
+        stampCircle(&canvas, center, 64, rand() % NUM_COLORS);
+        startResample(&resampler, &canvas, &view);
+        finishResample(&resampler);
+        stampCircle(&canvas, center, 32, rand() % NUM_COLORS);
+        renderView(&canvas, &view, whole, expected);
+        Bounds dirty;
+        while (nextDirtyRun(&canvas, &dirty)) {
+        }
+      }
+      start = now();
+      startResample(&resampler, &canvas, &view);
+      finishResample(&resampler);
+      ms[pass] = now() - start;
+      refiltered = pass == 2 ? resampler.filtered_tiles : refiltered;
+      same = same && memcmp(resampler.pixels, expected,
+                            size * sizeof(Pixel)) == 0;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "%dx%d", view.width, view.height);
+    printf("%-10s %8.3f %12.2f %10.2f %10.2f %12.2f %12.2f %10d %10.1f %6s\n",
+           label, view.zoom, render_ms, ms[0], ms[1], ms[2], ms[3], refiltered,
+           resampleMemory(&resampler) / (1024.0 * 1024.0),
+           same ? "yes" : "NO");
+    free(expected);
+  }
+  freeResampler(&resampler);
+  freeCanvas(&canvas);
+
+  // A 2048 pixel painting in the corner of the largest canvas, seen whole
+  Canvas large;
+  initCanvas(&large, CANVAS_MAX_SIDE, CANVAS_MAX_SIDE, 1);
+  srand(1);
+  for (int i = 0; i < 4000; i++) {
+    Point center = {rand() % 2048, rand() % 2048};
+    stampCircle(&large, center, 8 + rand() % 32, rand() % NUM_COLORS);
+  }
+  View view;
+  initView(&view, 1920, 1080);
+  view.zoom = fminf((float)view.width / large.width,
+                    (float)view.height / large.height);
+  clampView(&view, &large);
+  size_t size = (size_t)view.width * view.height;
+  Pixel *expected = (Pixel *)malloc(size * sizeof(Pixel));
+  renderView(&large, &view, (Bounds){0, 0, view.width, view.height},
+             expected);
+  initResampler(&resampler);
+  double start = now();
+  startResample(&resampler, &large, &view);
+  finishResample(&resampler);
+  double elapsed = now() - start;
+  printf("\n%dx%d, %dx%d painted: %.2f ms, levels %.1f MiB, same %s\n",
+         large.width, large.height, 2048, 2048, elapsed,
+         resampleMemory(&resampler) / (1024.0 * 1024.0),
+         memcmp(resampler.pixels, expected, size * sizeof(Pixel)) == 0 ? "yes"
+                                                                       : "NO");
+  free(expected);
+  freeResampler(&resampler);
+  freeCanvas(&large);
+}
+//--------------------------------------------------------------------------------
+
+// Struct to store a named benchmark
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    {"export", benchExport},
+    {"project", benchProject},
+    {"upload", benchUpload},
+    {"view", benchView},
+    {"fill", benchFill},
+    {"stamp", benchStamp},
+    {"stroke", benchStroke},
+    {"simplify", benchSimplify},
+    {"trace", benchTrace},
+    {"idle", benchIdle},
+    {"profile", benchProfile},
+    {"replay", benchReplay},
+    {"indexed", benchIndexed},
+    {"render", benchRender},
+    {"resample", benchResample},
+};
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv) {
+  for (int i = 0; i < NUM_BENCHMARKS; i++) {
+    bool selected = argc < 2;
+    for (int a = 1; a < argc; a++) {
+      selected = selected || strcmp(argv[a], benchmarks[i].name) == 0;
+    }
+    if (selected) {
+      printf("--- %s ---\n", benchmarks[i].name);
+      benchmarks[i].run();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,567 @@
+/*  --- export ---
+ *
+ *  Background save threads. Each save shares the canvas tiles copy-on-write,
+ *  so the user can keep painting (or save again) while earlier saves encode.
+ *
+ *  Both encoders work a row at a time with small fixed buffers, gathering
+ *  each row from the tiles as they reach it, so memory use doesn't grow with
+ *  the canvas and progress can be reported per row.
+ */
+
+#include "export.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define OUTPUT_BUFFER (64 * 1024) // Bytes encoders batch before writing
+
+const SaveFormat save_formats[NUM_SAVE_FORMATS] = {
+    {"QOI", "qoi", writeQoi},
+    {"PNG fast", "png", writePngFast},
+    {"PNG", "png", writePng},
+    {"PNG small", "png", writePngSmall},
+};
+
+static inline void setProgress(atomic_int *progress, int row, int height) {
+  if (progress != NULL) {
+    atomic_store(progress, (int)((long long)row * 100 / height));
+  }
+}
+
+static inline void putBigEndian(unsigned char *out, unsigned int value) {
+  out[0] = (unsigned char)(value >> 24);
+  out[1] = (unsigned char)(value >> 16);
+  out[2] = (unsigned char)(value >> 8);
+  out[3] = (unsigned char)value;
+}
+
+//-Image-rows---------------------------------------------------------------------
+static const Pixel *readPixelRow(ImageRows *image, int y) {
+  return image->pixels + (size_t)y * image->width;
+}
+
+// Gathers row y from the tiles, decoding a band of pending tiles once its
+// first row is reached. The live canvas never holds packed tiles, so
+// neither do snapshots of it.
+static const Pixel *readCanvasRow(ImageRows *image, int y) {
+  Canvas *canvas = image->canvas;
+  if (y % TILE_SIZE == 0) {
+    loadTiles(canvas, (Bounds){0, y, canvas->width, y + TILE_SIZE});
+  }
+  int r = y / TILE_SIZE;
+  int offset = (y - r * TILE_SIZE) * TILE_SIZE;
+  for (int c = 0; c < canvas->tile_columns; c++) {
+    const Tile *tile = &canvas->tiles[r * canvas->tile_columns + c];
+    Pixel *out = image->row + c * TILE_SIZE;
+    int count = c < canvas->tile_columns - 1 ? TILE_SIZE
+                                             : canvas->width - c * TILE_SIZE;
+    if (tile->data == NULL) {
+      writeSpan(out, count, tile->color);
+    } else if (canvas->indexed) {
+      const unsigned char *indices = tile->data->indices + offset;
+      for (int x = 0; x < count; x++) {
+        out[x] = palette[indices[x]];
+      }
+    } else {
+      memcpy(out, tile->data->pixels + offset, count * sizeof(Pixel));
+    }
+  }
+  return image->row;
+}
+
+// Reads a dense row major buffer
+ImageRows pixelRows(const Pixel *pixels, int width, int height) {
+  return (ImageRows){.width = width,
+                     .height = height,
+                     .read = readPixelRow,
+                     .pixels = pixels};
+}
+
+// Reads canvas from its tiles into row, which holds canvas->width pixels.
+// Only the reading thread may use canvas, it decodes pending tiles.
+ImageRows canvasRows(Canvas *canvas, Pixel *row) {
+  return (ImageRows){.width = canvas->width,
+                     .height = canvas->height,
+                     .read = readCanvasRow,
+                     .canvas = canvas,
+                     .row = row};
+}
+//--------------------------------------------------------------------------------
+
+//-QOI----------------------------------------------------------------------------
+// Encodes to the Quite OK Image format (qoiformat.org). A single pass with a
+// 64 entry color cache, painted canvases are mostly runs & cache hits.
+bool writeQoi(ImageRows *image, const char *filename, atomic_int *progress) {
+  int width = image->width;
+  int height = image->height;
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    return false;
+  }
+
+  unsigned char *out = (unsigned char *)malloc(OUTPUT_BUFFER);
+  if (out == NULL) {
+    fclose(file);
+    return false;
+  }
+
+  // Header
+  int size = 0;
+  memcpy(out, "qoif", 4);
+  putBigEndian(out + 4, width);
+  putBigEndian(out + 8, height);
+  out[12] = 4; // RGBA
+  out[13] = 0; // sRGB
+  size = 14;
+
+  Pixel index[64] = {0};
+  Pixel previous = {0, 0, 0, 255};
+  int run = 0;
+  size_t total = (size_t)width * height;
+  const Pixel *row = NULL;
+  bool ok = true;
+
+  for (size_t i = 0; i < total && ok; i++) {
+    // Flush before the worst case op (5 bytes) could overflow the buffer
+    if (size > OUTPUT_BUFFER - 8) {
+      ok = fwrite(out, 1, size, file) == (size_t)size;
+      size = 0;
+    }
+    if (i % width == 0) {
+      setProgress(progress, i / width, height);
+      row = image->read(image, i / width);
+    }
+
+    Pixel px = row[i % width];
+    if (memcmp(&px, &previous, sizeof(Pixel)) == 0) {
+      run++;
+      if (run == 62 || i == total - 1) {
+        out[size++] = 0xc0 | (run - 1); // QOI_OP_RUN
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out[size++] = 0xc0 | (run - 1);
+      run = 0;
+    }
+
+    int hash = (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+    if (memcmp(&index[hash], &px, sizeof(Pixel)) == 0) {
+      out[size++] = hash; // QOI_OP_INDEX
+    } else {
+      index[hash] = px;
+      if (px.a == previous.a) {
+        signed char vr = px.r - previous.r;
+        signed char vg = px.g - previous.g;
+        signed char vb = px.b - previous.b;
+        signed char vg_r = vr - vg;
+        signed char vg_b = vb - vg;
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+          out[size++] = 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                   vg_b > -9 && vg_b < 8) {
+          out[size++] = 0x80 | (vg + 32); // QOI_OP_LUMA
+          out[size++] = (vg_r + 8) << 4 | (vg_b + 8);
+        } else {
+          out[size++] = 0xfe; // QOI_OP_RGB
+          out[size++] = px.r;
+          out[size++] = px.g;
+          out[size++] = px.b;
+        }
+      } else {
+        out[size++] = 0xff; // QOI_OP_RGBA
+        out[size++] = px.r;
+        out[size++] = px.g;
+        out[size++] = px.b;
+        out[size++] = px.a;
+      }
+    }
+    previous = px;
+  }
+
+  // End marker
+  static const unsigned char padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  memcpy(out + size, padding, sizeof(padding));
+  size += sizeof(padding);
+  ok = ok && fwrite(out, 1, size, file) == (size_t)size;
+
+  free(out);
+  return fclose(file) == 0 && ok;
+}
+//--------------------------------------------------------------------------------
+
+//-PNG----------------------------------------------------------------------------
+static bool writeChunk(FILE *file, const char *type, const unsigned char *data,
+                       unsigned int size) {
+  unsigned char header[8];
+  unsigned char footer[4];
+  putBigEndian(header, size);
+  memcpy(header + 4, type, 4);
+  unsigned long crc = crc32(0, (const unsigned char *)type, 4);
+  if (size > 0) {
+    crc = crc32(crc, data, size); // A NULL buffer would reset the crc
+  }
+  putBigEndian(footer, (unsigned int)crc);
+
+  return fwrite(header, 1, 8, file) == 8 &&
+         (size == 0 || fwrite(data, 1, size, file) == size) &&
+         fwrite(footer, 1, 4, file) == 4;
+}
+
+static inline unsigned char paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+// Applies PNG filter type to an RGB row, out[0] receives the type byte.
+// Returns the sum of absolute filtered values, the usual cost heuristic.
+static unsigned int filterRow(unsigned char *out, int type,
+                              const unsigned char *row,
+                              const unsigned char *above, int bytes) {
+  unsigned int cost = 0;
+  out[0] = type;
+  for (int i = 0; i < bytes; i++) {
+    int left = i >= 3 ? row[i - 3] : 0;
+    int up = above[i];
+    int corner = i >= 3 ? above[i - 3] : 0;
+    unsigned char value = row[i];
+    switch (type) {
+    case 1: // Sub
+      value -= left;
+      break;
+    case 2: // Up
+      value -= up;
+      break;
+    case 4: // Paeth
+      value -= paeth(left, up, corner);
+      break;
+    }
+    out[i + 1] = value;
+    cost += value < 128 ? value : 256 - value;
+  }
+  return cost;
+}
+
+// Streams a PNG: each row is filtered, deflated & flushed as IDAT chunks
+// as soon as the output buffer fills, so nothing is held for the whole image.
+// Levels below 6 use the Sub filter, higher levels pick the cheapest filter
+// per row.
+bool writePngLevel(ImageRows *image, const char *filename, int level,
+                   atomic_int *progress) {
+  int width = image->width;
+  int height = image->height;
+  FILE *file = fopen(filename, "wb");
+  if (file == NULL) {
+    return false;
+  }
+
+  int bytes = width * 3; // Canvases are opaque, so RGB without alpha
+  unsigned char *rows = (unsigned char *)calloc(2, bytes);
+  unsigned char *filtered = (unsigned char *)malloc(2 * (bytes + 1));
+  unsigned char *out = (unsigned char *)malloc(OUTPUT_BUFFER);
+  z_stream stream = {0};
+  bool ok = rows && filtered && out && deflateInit(&stream, level) == Z_OK;
+
+  // Signature & header
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  unsigned char ihdr[13];
+  putBigEndian(ihdr, width);
+  putBigEndian(ihdr + 4, height);
+  ihdr[8] = 8;  // Bit depth
+  ihdr[9] = 2;  // Truecolor
+  ihdr[10] = 0; // Deflate
+  ihdr[11] = 0; // Adaptive filtering
+  ihdr[12] = 0; // No interlace
+  ok = ok && fwrite(signature, 1, 8, file) == 8 &&
+       writeChunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+  stream.next_out = out;
+  stream.avail_out = OUTPUT_BUFFER;
+  for (int y = 0; y <= height && ok; y++) {
+    int flush = y == height ? Z_FINISH : Z_NO_FLUSH;
+    unsigned char *best = filtered;
+
+    if (y < height) {
+      setProgress(progress, y, height);
+
+      // Pack the row to RGB, the previous row is kept for the Up filter
+      unsigned char *row = rows + (y % 2) * bytes;
+      unsigned char *above = rows + ((y + 1) % 2) * bytes;
+      const Pixel *src = image->read(image, y);
+      for (int x = 0; x < width; x++) {
+        row[x * 3] = src[x].r;
+        row[x * 3 + 1] = src[x].g;
+        row[x * 3 + 2] = src[x].b;
+      }
+
+      if (level < 6) {
+        filterRow(best, 1, row, above, bytes);
+      } else {
+        unsigned int best_cost = filterRow(best, 0, row, above, bytes);
+        static const int types[3] = {1, 2, 4};
+        for (int i = 0; i < 3; i++) {
+          unsigned char *candidate = best == filtered ? filtered + bytes + 1
+                                                      : filtered;
+          unsigned int cost = filterRow(candidate, types[i], row, above, bytes);
+          if (cost < best_cost) {
+            best_cost = cost;
+            best = candidate;
+          }
+        }
+      }
+      stream.next_in = best;
+      stream.avail_in = bytes + 1;
+    }
+
+    // Deflate the row, emitting an IDAT whenever the buffer fills
+    int status;
+    do {
+      status = deflate(&stream, flush);
+      if (status == Z_STREAM_ERROR) {
+        ok = false;
+        break;
+      }
+      if (stream.avail_out == 0 ||
+          (flush == Z_FINISH && status == Z_STREAM_END)) {
+        unsigned int size = OUTPUT_BUFFER - stream.avail_out;
+        ok = ok && (size == 0 || writeChunk(file, "IDAT", out, size));
+        stream.next_out = out;
+        stream.avail_out = OUTPUT_BUFFER;
+      }
+    } while (ok && (stream.avail_in > 0 ||
+                    (flush == Z_FINISH && status != Z_STREAM_END)));
+  }
+
+  ok = ok && writeChunk(file, "IEND", NULL, 0);
+  deflateEnd(&stream);
+  free(rows);
+  free(filtered);
+  free(out);
+  return fclose(file) == 0 && ok;
+}
+
+bool writePngFast(ImageRows *image, const char *filename,
+                  atomic_int *progress) {
+  return writePngLevel(image, filename, 1, progress);
+}
+
+bool writePng(ImageRows *image, const char *filename, atomic_int *progress) {
+  return writePngLevel(image, filename, 6, progress);
+}
+
+bool writePngSmall(ImageRows *image, const char *filename,
+                   atomic_int *progress) {
+  return writePngLevel(image, filename, 9, progress);
+}
+//--------------------------------------------------------------------------------
+
+//-Save-queue---------------------------------------------------------------------
+
+void initSaveQueue(SaveQueue *queue) {
+  for (int i = 0; i < MAX_SAVES; i++) {
+    queue->jobs[i].canvas.tiles = NULL;
+    queue->jobs[i].row = NULL;
+    queue->jobs[i].capacity = 0;
+    queue->jobs[i].filename[0] = '\0';
+    atomic_init(&queue->jobs[i].state, SAVE_IDLE);
+    atomic_init(&queue->jobs[i].progress, 0);
+  }
+}
+
+// Picks a timestamped name & creates the file exclusively, so neither other
+// saves in flight nor files already on disk can collide with it
+static bool reserveFilename(char *filename, const char *extension) {
+  char stamp[32];
+  time_t now = time(NULL);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    if (attempt == 0) {
+      snprintf(filename, MAX_FILENAME, "cpaint-%s.%s", stamp, extension);
+    } else {
+      snprintf(filename, MAX_FILENAME, "cpaint-%s-%d.%s", stamp, attempt,
+               extension);
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+      close(fd);
+      return true;
+    }
+    if (errno != EEXIST) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Encodes the job, then lets go of the tiles so painting doesn't keep
+// copying the ones the save shared
+static void *saveThread(void *arg) {
+  SaveJob *job = (SaveJob *)arg;
+  bool ok;
+  if (job->task != NULL) {
+    ok = job->task(job);
+  } else {
+    ImageRows image = canvasRows(&job->canvas, job->row);
+    ok = job->writer(&image, job->filename, &job->progress);
+    freeCanvas(&job->canvas);
+  }
+  if (!ok) {
+    remove(job->filename);
+  }
+  atomic_store(&job->progress, 100);
+  atomic_store(&job->state, ok ? SAVE_DONE : SAVE_FAILED);
+  return NULL;
+}
+
+// Claims an idle slot & creates its file. Returns NULL if every slot is busy
+// or the file couldn't be created.
+static SaveJob *prepareSave(SaveQueue *queue, const char *extension) {
+  SaveJob *job = NULL;
+  for (int i = 0; i < MAX_SAVES; i++) {
+    if (atomic_load(&queue->jobs[i].state) == SAVE_IDLE) {
+      job = &queue->jobs[i];
+      break;
+    }
+  }
+  if (job == NULL || !reserveFilename(job->filename, extension)) {
+    return NULL;
+  }
+
+  job->task = NULL;
+  job->context = NULL;
+  return job;
+}
+
+// Shares the canvas tiles with the job, the only work left on the render
+// thread, & makes room for the row the encoder reads. Returns false if out
+// of memory.
+static bool shareForSave(SaveJob *job, Canvas *canvas) {
+  if (job->capacity < canvas->width) {
+    free(job->row);
+    job->row = (Pixel *)malloc((size_t)canvas->width * sizeof(Pixel));
+    job->capacity = job->row ? canvas->width : 0;
+    if (job->row == NULL) {
+      remove(job->filename);
+      return false;
+    }
+  }
+  shareCanvas(&job->canvas, canvas);
+  return true;
+}
+
+static bool launchSave(SaveJob *job) {
+  atomic_store(&job->progress, 0);
+  atomic_store(&job->state, SAVE_RUNNING);
+
+  if (pthread_create(&job->thread, NULL, saveThread, job) != 0) {
+    freeCanvas(&job->canvas);
+    remove(job->filename);
+    atomic_store(&job->state, SAVE_IDLE);
+    return false;
+  }
+  return true;
+}
+
+// Shares the canvas with an encoder thread, returns false if every slot is
+// busy or the file couldn't be created
+bool startSave(SaveQueue *queue, Canvas *canvas, ImageWriter writer,
+               const char *extension) {
+  SaveJob *job = prepareSave(queue, extension);
+  if (job == NULL || !shareForSave(job, canvas)) {
+    return false;
+  }
+  job->writer = writer;
+  return launchSave(job);
+}
+
+// Same as startSave, but the thread runs task with context instead of
+// encoding the canvas. The caller keeps ownership of context if
+// this returns false.
+bool startSaveTask(SaveQueue *queue, SaveTask task, void *context,
+                   const char *extension) {
+  SaveJob *job = prepareSave(queue, extension);
+  if (job == NULL) {
+    return false;
+  }
+  job->task = task;
+  job->context = context;
+  return launchSave(job);
+}
+
+int savesInFlight(const SaveQueue *queue) {
+  int count = 0;
+  for (int i = 0; i < MAX_SAVES; i++) {
+    if (atomic_load(&queue->jobs[i].state) == SAVE_RUNNING) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Average progress of the saves still running, in percent
+int saveProgress(const SaveQueue *queue) {
+  int total = 0;
+  int count = 0;
+  for (int i = 0; i < MAX_SAVES; i++) {
+    if (atomic_load(&queue->jobs[i].state) == SAVE_RUNNING) {
+      total += atomic_load(&queue->jobs[i].progress);
+      count++;
+    }
+  }
+  return count ? total / count : 0;
+}
+
+// Reaps finished saves, copying a status message for the newest into
+// finished. Returns true if any save finished since the last poll.
+bool pollSaves(SaveQueue *queue, char *finished, int size) {
+  bool any = false;
+  for (int i = 0; i < MAX_SAVES; i++) {
+    SaveJob *job = &queue->jobs[i];
+    int state = atomic_load(&job->state);
+    if (state != SAVE_DONE && state != SAVE_FAILED) {
+      continue;
+    }
+
+    pthread_join(job->thread, NULL);
+    if (state == SAVE_DONE) {
+      snprintf(finished, size, "%s saved: %s",
+               job->task != NULL ? "Project" : "Image", job->filename);
+    } else {
+      snprintf(finished, size, "Failed to save %s", job->filename);
+    }
+    atomic_store(&job->state, SAVE_IDLE);
+    any = true;
+  }
+  return any;
+}
+
+// Waits for saves still in flight so no file is left half written
+void freeSaveQueue(SaveQueue *queue) {
+  for (int i = 0; i < MAX_SAVES; i++) {
+    SaveJob *job = &queue->jobs[i];
+    if (atomic_load(&job->state) != SAVE_IDLE) {
+      pthread_join(job->thread, NULL);
+      atomic_store(&job->state, SAVE_IDLE);
+    }
+    freeCanvas(&job->canvas);
+    free(job->row);
+    job->row = NULL;
+    job->capacity = 0;
+  }
+}
+//--------------------------------------------------------------------------------
@@ -0,0 +1,116 @@
+/*  --- export ---
+ *
+ *  Non-blocking image saves. startSave shares the canvas tiles on the render
+ *  thread, then a background thread encodes and writes them while the main
+ *  loop keeps drawing.
+ *
+ *  Encoders are pluggable: QOI for near memcpy speed autosaves, and a
+ *  streaming PNG encoder that deflates rows as they are filtered, at a
+ *  selectable zlib level.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "raster.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define MAX_SAVES 4     // Saves allowed in flight at once
+#define MAX_FILENAME 64 // Longest file name a save can pick
+#define NUM_SAVE_FORMATS 4 // Entries in save_formats
+//--------------------------------------------------------------------------------
+
+typedef struct ImageRows ImageRows;
+
+// Hands out row y of an image. Rows are read top to bottom, each one valid
+// until the next is read.
+typedef const Pixel *(*RowReader)(ImageRows *image, int y);
+
+// Struct to store an image encoders read a row at a time, from a dense
+// buffer or straight from canvas tiles
+struct ImageRows {
+  int width;           // Pixels across
+  int height;          // Pixels down
+  RowReader read;      // Fetches a row
+  const Pixel *pixels; // Dense buffer, row major, NULL for a canvas
+  Canvas *canvas;      // Canvas read tile by tile, NULL for a buffer
+  Pixel *row;          // width pixels a canvas row is gathered into
+};
+
+// Writes every row of image to filename, returns false on failure.
+// progress is updated with the percent written so far.
+typedef bool (*ImageWriter)(ImageRows *image, const char *filename,
+                            atomic_int *progress);
+
+// Struct to store a selectable save format
+typedef struct {
+  const char *name;      // Shown to the user
+  const char *extension; // File extension without the dot
+  ImageWriter writer;    // Encoder
+} SaveFormat;
+
+// Fastest first
+extern const SaveFormat save_formats[NUM_SAVE_FORMATS];
+
+// States a save slot moves through
+typedef enum {
+  SAVE_IDLE,    // Slot is free
+  SAVE_RUNNING, // Encoder thread is writing the file
+  SAVE_DONE,    // Finished, waiting to be reaped
+  SAVE_FAILED,  // Finished with an error, waiting to be reaped
+} SaveState;
+
+typedef struct SaveJob SaveJob;
+
+// Writes a whole job from job->context instead of the shared canvas. Owns
+// job->context & frees it when done.
+typedef bool (*SaveTask)(SaveJob *job);
+
+// Struct to store one save in flight
+struct SaveJob {
+  pthread_t thread;            // Encoder thread
+  ImageWriter writer;          // Encoder used for this save
+  SaveTask task;               // Used instead of writer when set
+  void *context;               // Extra data for task
+  Canvas canvas;               // Shares the canvas tiles, unused by tasks
+  Pixel *row;                  // One canvas row for the encoder, reused
+  int capacity;                // Pixels allocated for row
+  char filename[MAX_FILENAME]; // File being written
+  atomic_int state;            // A SaveState
+  atomic_int progress;         // Percent written, for the overlay
+};
+
+// Struct to store every save slot
+typedef struct {
+  SaveJob jobs[MAX_SAVES];
+} SaveQueue;
+
+// Image rows
+ImageRows pixelRows(const Pixel *pixels, int width, int height);
+ImageRows canvasRows(Canvas *canvas, Pixel *row);
+
+// Encoders
+bool writeQoi(ImageRows *image, const char *filename, atomic_int *progress);
+bool writePngLevel(ImageRows *image, const char *filename, int level,
+                   atomic_int *progress);
+bool writePngFast(ImageRows *image, const char *filename,
+                  atomic_int *progress);
+bool writePng(ImageRows *image, const char *filename, atomic_int *progress);
+bool writePngSmall(ImageRows *image, const char *filename,
+                   atomic_int *progress);
+
+// Save queue
+void initSaveQueue(SaveQueue *queue);
+bool startSave(SaveQueue *queue, Canvas *canvas, ImageWriter writer,
+               const char *extension);
+bool startSaveTask(SaveQueue *queue, SaveTask task, void *context,
+                   const char *extension);
+int savesInFlight(const SaveQueue *queue);
+int saveProgress(const SaveQueue *queue);
+bool pollSaves(SaveQueue *queue, char *finished, int size);
+void freeSaveQueue(SaveQueue *queue);
+
+#endif
@@ -0,0 +1,514 @@
+/*  --- fill ---
+ *
+ *  Fills the 4-connected region of the seed's color inside the clip
+ *  rectangle. The region only depends on the pixels it covers and the ring
+ *  around it, which is what lets undo replay a fill inside a smaller area.
+ */
+
+#include "fill.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Struct to store a run of pixels [x0, x1) of row y to scan for the target
+typedef struct {
+  int y;
+  int x0;
+  int x1;
+  int dy; // Row y - dy is already filled over [x0, x1), 0 if unknown
+} FillRun;
+
+// Struct to store a growable stack of runs
+typedef struct {
+  FillRun *runs;
+  int count;
+  int capacity;
+} FillStack;
+
+typedef struct FillJob FillJob;
+
+// Struct to store the rows one thread fills
+typedef struct {
+  FillJob *job;
+  int y0;          // First row the band owns
+  int y1;          // Row past the last one it owns
+  FillStack stack; // Runs to scan this round
+  FillStack above; // Runs for the band above, next round
+  FillStack below; // Runs for the band below, next round
+  FillStack later; // Runs on tile rows not decoded yet, next round
+  Bounds filled;   // Pixels written so far
+  pthread_t thread;
+} FillBand;
+
+// Struct to store a fill shared by its bands
+struct FillJob {
+  Canvas *canvas;
+  Bounds clip;      // Copy of the canvas clip
+  Pixel target;     // Color being replaced
+  Pixel value;      // Color painted
+  int color;        // Palette index painted
+  bool indexed;     // Canvas holds palette indices
+  int target_index; // Palette index being replaced, indexed canvases only
+  unsigned char *decoded; // Per tile row, no pending tiles inside the clip,
+                          // NULL while this thread scans or none are pending
+  FillBand *bands;
+  int count; // Bands
+
+  // Rounds: the caller bumps round, every band works through its stack &
+  // busy drops back to 0
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int round;
+  int busy;
+  bool finished;
+};
+
+static inline bool samePixel(Pixel a, Pixel b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void pushRun(FillStack *stack, FillRun run) {
+  if (stack->count == stack->capacity) {
+    int capacity = stack->capacity ? stack->capacity * 2 : 256;
+    FillRun *runs =
+        (FillRun *)realloc(stack->runs, (size_t)capacity * sizeof(FillRun));
+    if (runs == NULL) {
+      fprintf(stderr, "Failed to allocate memory for fill\n");
+      exit(1);
+    }
+    stack->runs = runs;
+    stack->capacity = capacity;
+  }
+  stack->runs[stack->count++] = run;
+}
+
+// Moves every run of from onto to
+static void moveRuns(FillStack *to, FillStack *from) {
+  for (int i = 0; i < from->count; i++) {
+    pushRun(to, from->runs[i]);
+  }
+  from->count = 0;
+}
+
+//-Scanning-----------------------------------------------------------------------
+// Row y of tile column c as pixels or palette indices, whichever the canvas
+// holds. NULL with color set if the tile is a single color.
+static inline const unsigned char *tileRow(Canvas *canvas, int c, int y,
+                                           Pixel *color) {
+  if (canvas->indexed) {
+    const unsigned char *indices =
+        tileIndices(canvas, c, y / TILE_SIZE, color);
+    return indices != NULL ? indices + (y % TILE_SIZE) * TILE_SIZE : NULL;
+  }
+  const Pixel *pixels = tileLevel(canvas, c, y / TILE_SIZE, 0, color);
+  return pixels != NULL
+             ? (const unsigned char *)(pixels + (y % TILE_SIZE) * TILE_SIZE)
+             : NULL;
+}
+
+// True if pixel x of a tileRow holds the target
+static inline bool isTarget(const FillJob *job, const unsigned char *row,
+                            int x) {
+  return job->indexed ? row[x] == job->target_index
+                      : samePixel(((const Pixel *)row)[x], job->target);
+}
+
+// First x in [x, end) of row y holding the target, end if none does
+static int findTarget(const FillJob *job, int y, int x, int end) {
+  while (x < end) {
+    int c = x / TILE_SIZE;
+    int tile_end = (c + 1) * TILE_SIZE < end ? (c + 1) * TILE_SIZE : end;
+    Pixel color;
+    const unsigned char *row = tileRow(job->canvas, c, y, &color);
+    if (row == NULL) {
+      if (samePixel(color, job->target)) {
+        return x;
+      }
+      x = tile_end;
+      continue;
+    }
+    for (; x < tile_end; x++) {
+      if (isTarget(job, row, x - c * TILE_SIZE)) {
+        return x;
+      }
+    }
+  }
+  return end;
+}
+
+// First x in [x, end) of row y not holding the target, end if all do
+static int findOther(const FillJob *job, int y, int x, int end) {
+  while (x < end) {
+    int c = x / TILE_SIZE;
+    int tile_end = (c + 1) * TILE_SIZE < end ? (c + 1) * TILE_SIZE : end;
+    Pixel color;
+    const unsigned char *row = tileRow(job->canvas, c, y, &color);
+    if (row == NULL) {
+      if (!samePixel(color, job->target)) {
+        return x;
+      }
+      x = tile_end;
+      continue;
+    }
+    for (; x < tile_end; x++) {
+      if (!isTarget(job, row, x - c * TILE_SIZE)) {
+        return x;
+      }
+    }
+  }
+  return end;
+}
+
+// Leftmost x at or after start such that [x, from] of row y all hold the
+// target, from must hold it
+static int findRunStart(const FillJob *job, int y, int from, int start) {
+  int x = from;
+  while (x > start) {
+    int c = (x - 1) / TILE_SIZE;
+    int tile_start = c * TILE_SIZE > start ? c * TILE_SIZE : start;
+    Pixel color;
+    const unsigned char *row = tileRow(job->canvas, c, y, &color);
+    if (row == NULL) {
+      if (!samePixel(color, job->target)) {
+        return x;
+      }
+      x = tile_start;
+      continue;
+    }
+    for (; x > tile_start; x--) {
+      if (!isTarget(job, row, x - 1 - c * TILE_SIZE)) {
+        return x;
+      }
+    }
+  }
+  return x;
+}
+//--------------------------------------------------------------------------------
+
+//-Filling------------------------------------------------------------------------
+// Queues a run for the band owning its row, dropping rows outside the clip
+static void queueRun(FillBand *band, int y, int x0, int x1, int dy) {
+  const Bounds *clip = &band->job->clip;
+  if (y < clip->y0 || y >= clip->y1 || x0 >= x1) {
+    return;
+  }
+  FillRun run = {y, x0, x1, dy};
+  if (y < band->y0) {
+    pushRun(&band->above, run);
+  } else if (y >= band->y1) {
+    pushRun(&band->below, run);
+  } else {
+    pushRun(&band->stack, run);
+  }
+}
+
+// Queues the pixels left or right of a tile that was filled whole. A single
+// colored neighbour is all connected, so one of its rows is enough.
+static void queueBeside(FillBand *band, Bounds tile, int x) {
+  FillJob *job = band->job;
+  if (x < job->clip.x0 || x >= job->clip.x1) {
+    return;
+  }
+  Pixel color;
+  if (tileRow(job->canvas, x / TILE_SIZE, tile.y0, &color) == NULL) {
+    if (samePixel(color, job->target)) {
+      queueRun(band, tile.y0, x, x + 1, 0);
+    }
+    return;
+  }
+  for (int y = tile.y0; y < tile.y1; y++) {
+    queueRun(band, y, x, x + 1, 0);
+  }
+}
+
+// Paints [x0, x1) of row y. Tiles that are the target color all over are
+// connected to the run & filled whole, queueing what borders them instead.
+static void fillRun(FillBand *band, int y, int x0, int x1) {
+  FillJob *job = band->job;
+  Canvas *canvas = job->canvas;
+  int r = y / TILE_SIZE;
+  for (int c = x0 / TILE_SIZE; c <= (x1 - 1) / TILE_SIZE; c++) {
+    Tile *tile = &canvas->tiles[r * canvas->tile_columns + c];
+    Bounds bounds = tileBounds(canvas, c, r);
+    if (tile->data == NULL && samePixel(tile->color, job->target) &&
+        bounds.x0 >= job->clip.x0 && bounds.y0 >= job->clip.y0 &&
+        bounds.x1 <= job->clip.x1 && bounds.y1 <= job->clip.y1) {
+      fillTile(canvas, c, r, job->value);
+      band->filled = unionBounds(band->filled, bounds);
+      queueRun(band, bounds.y0 - 1, bounds.x0, bounds.x1, -1);
+      queueRun(band, bounds.y1, bounds.x0, bounds.x1, 1);
+      queueBeside(band, bounds, bounds.x0 - 1);
+      queueBeside(band, bounds, bounds.x1);
+      continue;
+    }
+
+    int start = x0 > bounds.x0 ? x0 : bounds.x0;
+    int end = x1 < bounds.x1 ? x1 : bounds.x1;
+    unsigned char *samples = tilePixels(canvas, c, r);
+    int at = (y - bounds.y0) * TILE_SIZE + start - bounds.x0;
+    if (job->indexed) {
+      memset(samples + at, job->color, end - start);
+    } else {
+      writeSpan((Pixel *)samples + at, end - start, job->value);
+    }
+  }
+  band->filled = unionBounds(band->filled, (Bounds){x0, y, x1, y + 1});
+}
+
+// Fills every target run inside one queued run & queues the rows next to
+// them. The row the run came from only needs scanning where a run spills
+// past it.
+static void scanRun(FillBand *band, FillRun run) {
+  FillJob *job = band->job;
+  int x = run.x0 > job->clip.x0 ? run.x0 : job->clip.x0;
+  int end = run.x1 < job->clip.x1 ? run.x1 : job->clip.x1;
+  while ((x = findTarget(job, run.y, x, end)) < end) {
+    int x0 = findRunStart(job, run.y, x, job->clip.x0);
+    int x1 = findOther(job, run.y, x, job->clip.x1);
+    fillRun(band, run.y, x0, x1);
+    if (run.dy == 0) {
+      queueRun(band, run.y - 1, x0, x1, -1);
+      queueRun(band, run.y + 1, x0, x1, 1);
+    } else {
+      queueRun(band, run.y + run.dy, x0, x1, run.dy);
+      queueRun(band, run.y - run.dy, x0, run.x0 - 1, -run.dy);
+      queueRun(band, run.y - run.dy, run.x1 + 1, x1, -run.dy);
+    }
+    x = x1;
+  }
+}
+
+// Threads can't decode tiles, so runs on a tile row that still has pending
+// tiles wait for the next round, once this thread has decoded the row
+static void fillBand(FillBand *band) {
+  const unsigned char *decoded = band->job->decoded;
+  while (band->stack.count > 0) {
+    FillRun run = band->stack.runs[--band->stack.count];
+    if (decoded != NULL && !decoded[run.y / TILE_SIZE]) {
+      pushRun(&band->later, run);
+    } else {
+      scanRun(band, run);
+    }
+  }
+}
+
+// Fills its band once per round until the job is finished
+static void *fillThread(void *data) {
+  FillBand *band = (FillBand *)data;
+  FillJob *job = band->job;
+  for (int round = 1;; round++) {
+    pthread_mutex_lock(&job->lock);
+    while (job->round < round && !job->finished) {
+      pthread_cond_wait(&job->start, &job->lock);
+    }
+    bool finished = job->finished;
+    pthread_mutex_unlock(&job->lock);
+    if (finished) {
+      return NULL;
+    }
+
+    fillBand(band);
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->busy == 0) {
+      pthread_cond_signal(&job->done);
+    }
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+// True if tile row r has no pending tiles inside the clip
+static bool rowDecoded(const FillJob *job, int r) {
+  const Canvas *canvas = job->canvas;
+  for (int c = job->clip.x0 / TILE_SIZE; c <= (job->clip.x1 - 1) / TILE_SIZE;
+       c++) {
+    if (canvas->tiles[r * canvas->tile_columns + c].flags & TILE_PENDING) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Hands runs that crossed into a neighbour band over, decoding the tile rows
+// of runs that waited for them, returns true if any band has work for
+// another round
+static bool exchangeRuns(FillJob *job) {
+  for (int i = 0; i < job->count; i++) {
+    FillStack *later = &job->bands[i].later;
+    for (int k = 0; k < later->count; k++) {
+      int r = later->runs[k].y / TILE_SIZE;
+      if (!job->decoded[r]) {
+        loadTiles(job->canvas, (Bounds){job->clip.x0, r * TILE_SIZE,
+                                        job->clip.x1, (r + 1) * TILE_SIZE});
+        job->decoded[r] = 1;
+      }
+    }
+    moveRuns(&job->bands[i].stack, later);
+  }
+  for (int i = 0; i < job->count; i++) {
+    if (i > 0) {
+      moveRuns(&job->bands[i - 1].stack, &job->bands[i].above);
+    }
+    if (i < job->count - 1) {
+      moveRuns(&job->bands[i + 1].stack, &job->bands[i].below);
+    }
+  }
+  for (int i = 0; i < job->count; i++) {
+    if (job->bands[i].stack.count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs rounds on one thread per band until no runs are left. Tile rows the
+// fill reaches are decoded between rounds, only if it reaches them.
+static void runBands(FillJob *job) {
+  Canvas *canvas = job->canvas;
+  if (canvas->pending_tiles > 0) {
+    job->decoded = (unsigned char *)malloc(canvas->tile_rows);
+    if (job->decoded == NULL) {
+      fprintf(stderr, "Failed to allocate memory for fill\n");
+      exit(1);
+    }
+    for (int r = 0; r < canvas->tile_rows; r++) {
+      job->decoded[r] = rowDecoded(job, r);
+    }
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->start, NULL);
+  pthread_cond_init(&job->done, NULL);
+  job->round = 0;
+  job->finished = false;
+
+  int started = 0;
+  for (; started < job->count; started++) {
+    if (pthread_create(&job->bands[started].thread, NULL, fillThread,
+                       &job->bands[started]) != 0) {
+      break;
+    }
+  }
+
+  if (started == job->count) {
+    do {
+      pthread_mutex_lock(&job->lock);
+      job->busy = job->count;
+      job->round++;
+      pthread_cond_broadcast(&job->start);
+      while (job->busy > 0) {
+        pthread_cond_wait(&job->done, &job->lock);
+      }
+      pthread_mutex_unlock(&job->lock);
+    } while (exchangeRuns(job));
+  }
+
+  pthread_mutex_lock(&job->lock);
+  job->finished = true;
+  pthread_cond_broadcast(&job->start);
+  pthread_mutex_unlock(&job->lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(job->bands[i].thread, NULL);
+  }
+
+  // Out of threads, finish on this one
+  if (started < job->count) {
+    do {
+      for (int i = 0; i < job->count; i++) {
+        fillBand(&job->bands[i]);
+      }
+    } while (exchangeRuns(job));
+  }
+
+  pthread_cond_destroy(&job->done);
+  pthread_cond_destroy(&job->start);
+  pthread_mutex_destroy(&job->lock);
+  free(job->decoded);
+  job->decoded = NULL;
+}
+//--------------------------------------------------------------------------------
+
+// Band count for a canvas: enough rows per band to be worth a thread, at
+// most one per core
+static int fillBandCount(const Canvas *canvas) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int bands = canvas->tile_rows / FILL_BAND_TILES;
+  bands = bands < cores ? bands : (int)cores;
+  bands = bands < FILL_MAX_THREADS ? bands : FILL_MAX_THREADS;
+  return bands > 1 ? bands : 1;
+}
+
+// Fills the region of x, y's color with a palette color, returns the pixels
+// the fill read or wrote, empty if it changed nothing
+Bounds floodFill(Canvas *canvas, int x, int y, int color) {
+  return floodFillBands(canvas, x, y, color, fillBandCount(canvas));
+}
+
+// Same as floodFill, split across bands threads
+Bounds floodFillBands(Canvas *canvas, int x, int y, int color, int bands) {
+  Bounds clip = canvas->clip;
+  if (x < clip.x0 || x >= clip.x1 || y < clip.y0 || y >= clip.y1) {
+    return emptyBounds();
+  }
+  FillJob job = {.canvas = canvas,
+                 .clip = clip,
+                 .value = palette[color],
+                 .color = color,
+                 .indexed = canvas->indexed};
+  const unsigned char *row = tileRow(canvas, x / TILE_SIZE, y, &job.target);
+  if (row != NULL && job.indexed) {
+    job.target = palette[row[x % TILE_SIZE]];
+  } else if (row != NULL) {
+    job.target = ((const Pixel *)row)[x % TILE_SIZE];
+  }
+  job.target_index = paletteIndex(job.target);
+  if (samePixel(job.target, job.value)) {
+    return emptyBounds();
+  }
+
+  // Bands split the tile rows evenly
+  job.count = bands < canvas->tile_rows ? bands : canvas->tile_rows;
+  job.count = job.count > 1 ? job.count : 1;
+  job.bands = (FillBand *)calloc(job.count, sizeof(FillBand));
+  if (job.bands == NULL) {
+    fprintf(stderr, "Failed to allocate memory for fill\n");
+    exit(1);
+  }
+  for (int i = 0; i < job.count; i++) {
+    job.bands[i].job = &job;
+    job.bands[i].y0 = i * canvas->tile_rows / job.count * TILE_SIZE;
+    job.bands[i].y1 = (i + 1) * canvas->tile_rows / job.count * TILE_SIZE;
+    job.bands[i].filled = emptyBounds();
+    if (y >= job.bands[i].y0 && y < job.bands[i].y1) {
+      pushRun(&job.bands[i].stack, (FillRun){y, x, x + 1, 0});
+    }
+  }
+
+  // The seed's band goes first on this thread, most fills never leave it &
+  // don't need to start any others
+  for (int i = 0; i < job.count; i++) {
+    fillBand(&job.bands[i]);
+  }
+  if (exchangeRuns(&job)) {
+    runBands(&job);
+  }
+
+  // Dirty flags aren't thread safe, so they're set once the bands are done
+  Bounds filled = emptyBounds();
+  for (int i = 0; i < job.count; i++) {
+    FillBand *band = &job.bands[i];
+    if (!boundsEmpty(band->filled)) {
+      markDirty(canvas, band->filled);
+      filled = unionBounds(filled, band->filled);
+    }
+    free(band->stack.runs);
+    free(band->above.runs);
+    free(band->below.runs);
+    free(band->later.runs);
+  }
+  free(job.bands);
+  return (Bounds){filled.x0 - 1, filled.y0 - 1, filled.x1 + 1, filled.y1 + 1};
+}
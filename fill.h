@@ -0,0 +1,27 @@
+/*  --- fill ---
+ *
+ *  Paint bucket. A scanline flood fill: runs of the clicked color are found a
+ *  row at a time and the rows above and below them queued on an explicit
+ *  stack, so memory follows the number of runs instead of the region size.
+ *  Tiles that are a single color are filled whole.
+ *
+ *  Tall canvases are split into bands of tile rows, each filled by its own
+ *  thread. Runs reaching past a band are handed to the band next to it for
+ *  the next round, until no band has work left. Pending tiles of an opened
+ *  project are decoded between rounds, a tile row once a run reaches it.
+ */
+
+#ifndef FILL_H
+#define FILL_H
+
+#include "raster.h"
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define FILL_BAND_TILES 4  // Fewest tile rows a fill band spans
+#define FILL_MAX_THREADS 8 // Most threads a single fill uses
+//--------------------------------------------------------------------------------
+
+Bounds floodFill(Canvas *canvas, int x, int y, int color);
+Bounds floodFillBands(Canvas *canvas, int x, int y, int color, int bands);
+
+#endif
@@ -0,0 +1,1054 @@
+/*  --- history ---
+ *
+ *  Circular undo/redo history with periodic canvas checkpoints. Undo cost is
+ *  bounded by the checkpoint interval instead of the history depth, redo
+ *  costs one stroke. Encoded points are kept in a single arena so painting
+ *  never touches the heap, checkpoints share the canvas tiles they cover.
+ */
+
+#include "history.h"
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int oldestSequence(const UndoHistory *history);
+static int strokeIndex(const UndoHistory *history, int sequence);
+static void evictThrough(UndoHistory *history, int sequence);
+
+//-Arena--------------------------------------------------------------------------
+// Evicts, oldest first, every stored stroke up to the first one with bytes
+// in [start, end)
+static void evictOverlapping(UndoHistory *history, int start, int end) {
+  for (int s = oldestSequence(history) + 1; s <= history->sequence; s++) {
+    const Stroke *stored = &history->undos[strokeIndex(history, s)];
+    if (stored->size == 0) {
+      continue;
+    }
+    int first = stored->data - history->arena.bytes;
+    if (first >= end || first + stored->size <= start) {
+      return; // Later strokes sit even further ahead of the head
+    }
+    evictThrough(history, s);
+  }
+}
+
+// Forgets the undone strokes once history branches off with a new one,
+// their points & the snapshots taken after them are reused
+static void dropRedo(UndoHistory *history) {
+  if (history->redo_count == 0) {
+    return;
+  }
+  int last = history->sequence + history->redo_count;
+  for (int s = history->sequence + 1; s <= last; s++) {
+    const Stroke *undone = &history->undos[strokeIndex(history, s)];
+    if (undone->size > 0) {
+      history->arena.head = undone->data - history->arena.bytes;
+      break;
+    }
+  }
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    if (history->checkpoints[i].sequence > history->sequence) {
+      freeCanvas(&history->checkpoints[i].canvas);
+      history->checkpoints[i].sequence = -1;
+    }
+  }
+  history->redo_count = 0;
+}
+
+// Makes room for one more encoded point at the end of the open stroke
+static bool reservePoint(UndoHistory *history, Stroke *stroke) {
+  PointArena *arena = &history->arena;
+  if (stroke->point_count == 0) {
+    dropRedo(history);
+    stroke->data = arena->bytes + arena->head;
+  }
+  if (stroke->size + MAX_POINT_BYTES >= arena->capacity) {
+    return false; // A single stroke can't outgrow the whole arena
+  }
+
+  // Strokes are contiguous, so wrap by moving the open stroke to the front
+  int next = (stroke->data - arena->bytes) + stroke->size;
+  if (next + MAX_POINT_BYTES > arena->capacity) {
+    evictOverlapping(history, 0, stroke->size + MAX_POINT_BYTES);
+    memmove(arena->bytes, stroke->data, stroke->size);
+    stroke->data = arena->bytes;
+    next = stroke->size;
+  }
+
+  evictOverlapping(history, next, next + MAX_POINT_BYTES);
+  return true;
+}
+
+// Copies a finished stroke's points to the arena head, wrapping if needed
+static bool appendStroke(UndoHistory *history, Stroke *stroke) {
+  PointArena *arena = &history->arena;
+  if (stroke->size >= arena->capacity) {
+    return false;
+  }
+  dropRedo(history);
+  int start = arena->head;
+  if (start + stroke->size > arena->capacity) {
+    start = 0;
+  }
+  evictOverlapping(history, start, start + stroke->size);
+  memcpy(arena->bytes + start, stroke->data, stroke->size);
+  stroke->data = arena->bytes + start;
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-Strokes------------------------------------------------------------------------
+// Init an empty Stroke, its points are handed out by the history arena
+void initStroke(Stroke *stroke) {
+  stroke->data = NULL;
+  stroke->size = 0;
+  stroke->point_count = 0;
+  stroke->color = 0;
+  stroke->flags = 0;
+  stroke->radius = 0;
+  stroke->tool = TOOL_BRUSH;
+  stroke->shape = SHAPE_CIRCLE;
+  stroke->bounds = emptyBounds();
+}
+
+// Snapshots the canvas a stroke is about to paint, sharing its tiles, so
+// committing the stroke can redraw just it once simplified. Strokes begun
+// without one are kept whole.
+void beginStroke(UndoHistory *history, Canvas *canvas) {
+  if (history->tolerance > 0) {
+    shareCanvas(&history->stroke_start, canvas);
+  }
+}
+
+// Encodes a point onto the current stroke at the arena head. Returns false
+// if nothing was added: the point repeats the last one, which would paint
+// nothing new, or the stroke has grown too long to record.
+bool addToStroke(UndoHistory *history, Stroke *stroke, int x, int y, int color,
+                 int radius, Tool stroke_tool, Shape shape) {
+  Point point = quantizePoint(x, y);
+  if (stroke->point_count > 0 && point.x == stroke->last.x &&
+      point.y == stroke->last.y) {
+    history->repeated_points++;
+    return false;
+  }
+  if (!reservePoint(history, stroke)) {
+    return false;
+  }
+
+  // Add point to the stroke
+  stroke->size += encodePoint(stroke->data + stroke->size, stroke, point);
+  stroke->previous = stroke->point_count > 0 ? stroke->last : point;
+  stroke->last = point;
+  stroke->point_count++;
+  stroke->color = color;
+  stroke->radius = radius;
+  stroke->tool = stroke_tool;
+  stroke->shape = shape;
+  stroke->flags = stroke_tool == TOOL_BRUSH ? STROKE_SWEPT : 0;
+
+  // Grow the bounds by the area this point can paint
+  stroke->bounds = unionBounds(stroke->bounds,
+                               stampBounds(stroke_tool, shape, point, radius));
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-Simplification-----------------------------------------------------------------
+// Squared distance from p to the segment a-b
+static float segmentDistanceSq(Point p, Point a, Point b) {
+  float dx = b.x - a.x;
+  float dy = b.y - a.y;
+  float length_sq = dx * dx + dy * dy;
+  float t = 0;
+  if (length_sq > 0) {
+    t = ((p.x - a.x) * dx + (p.y - a.y) * dy) / length_sq;
+    t = t < 0 ? 0 : t > 1 ? 1 : t;
+  }
+  float ex = a.x + t * dx - p.x;
+  float ey = a.y + t * dy - p.y;
+  return ex * ex + ey * ey;
+}
+
+// Makes the scratch hold at least size bytes, false if it can't
+static bool growScratch(UndoHistory *history, size_t size) {
+  if (size <= history->scratch_size) {
+    return true;
+  }
+  size_t grown = history->scratch_size * 2 > size ? history->scratch_size * 2
+                                                   : size;
+  unsigned char *scratch = (unsigned char *)realloc(history->scratch, grown);
+  if (scratch == NULL) {
+    return false;
+  }
+  history->scratch = scratch;
+  history->scratch_size = grown;
+  history->allocations++;
+  return true;
+}
+
+// Drops the points of a finished stroke that the line through the others
+// passes within the tolerance of (Ramer-Douglas-Peucker), re-encoding the
+// rest in place. Only lines & swept brushes, where points are joined, can
+// lose points. Returns the area the dropped points' joins could paint,
+// empty if the stroke is kept whole.
+static Bounds simplifyStroke(UndoHistory *history, Stroke *stroke) {
+  int count = stroke->point_count;
+  if (history->tolerance <= 0 || count < 3 ||
+      !(stroke->tool == TOOL_PENCIL || (stroke->flags & STROKE_SWEPT))) {
+    return emptyBounds();
+  }
+
+  // Decoded points, a stack of ranges left to split, kept flags & the
+  // re-encoded bytes
+  size_t points_bytes = (size_t)count * sizeof(Point);
+  size_t stack_bytes = (size_t)count * 2 * sizeof(int);
+  if (!growScratch(history, points_bytes + stack_bytes + count +
+                                (size_t)stroke->size)) {
+    return emptyBounds();
+  }
+  Point *points = (Point *)history->scratch;
+  int *stack = (int *)(history->scratch + points_bytes);
+  unsigned char *keep = history->scratch + points_bytes + stack_bytes;
+  unsigned char *encoded = keep + count;
+
+  StrokeReader reader;
+  initStrokeReader(&reader, stroke);
+  for (int i = 0; i < count; i++) {
+    nextPoint(&reader, &points[i]);
+    keep[i] = i == 0 || i == count - 1;
+  }
+
+  // Keep the point furthest off each range's chord while it's out of
+  // tolerance & split the range there
+  float tolerance_sq = history->tolerance * history->tolerance;
+  int top = 0;
+  stack[top++] = 0;
+  stack[top++] = count - 1;
+  while (top > 0) {
+    int last = stack[--top];
+    int first = stack[--top];
+    int furthest = -1;
+    float furthest_sq = tolerance_sq;
+    for (int i = first + 1; i < last; i++) {
+      float distance_sq =
+          segmentDistanceSq(points[i], points[first], points[last]);
+      if (distance_sq > furthest_sq) {
+        furthest = i;
+        furthest_sq = distance_sq;
+      }
+    }
+    if (furthest >= 0) {
+      keep[furthest] = 1;
+      stack[top++] = first;
+      stack[top++] = furthest;
+      stack[top++] = furthest;
+      stack[top++] = last;
+    }
+  }
+
+  // A chord only paints inside the box of the stamps it replaces
+  Stroke simplified = *stroke;
+  simplified.size = 0;
+  simplified.point_count = 0;
+  Bounds changed = emptyBounds();
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    for (int dropped = kept; i > kept + 1 && dropped <= i; dropped++) {
+      changed = unionBounds(changed, stampBounds(stroke->tool, stroke->shape,
+                                                 points[dropped],
+                                                 stroke->radius));
+    }
+    kept = i;
+    simplified.size +=
+        encodePoint(encoded + simplified.size, &simplified, points[i]);
+    simplified.previous = simplified.point_count > 0 ? simplified.last
+                                                     : points[i];
+    simplified.last = points[i];
+    simplified.point_count++;
+  }
+  if (simplified.point_count == count || simplified.size > stroke->size) {
+    return emptyBounds();
+  }
+  memcpy(stroke->data, encoded, simplified.size);
+  history->simplified_points += count - simplified.point_count;
+  *stroke = simplified;
+  return changed;
+}
+//--------------------------------------------------------------------------------
+
+//-Checkpoints--------------------------------------------------------------------
+// Sequence number of the state just before the oldest stored stroke
+static int oldestSequence(const UndoHistory *history) {
+  return history->sequence - history->undo_count;
+}
+
+// Ring index of the stroke with the given sequence number, undone strokes
+// included
+static int strokeIndex(const UndoHistory *history, int sequence) {
+  int index = (history->current_undo_index - (history->sequence - sequence)) %
+              history->capacity;
+  return index < 0 ? index + history->capacity : index;
+}
+
+// Bytes snapshots may hold, what the arena & records leave of the budget
+static size_t snapshotBudget(const UndoHistory *history) {
+  size_t reserved =
+      (size_t)history->arena.capacity + history->budget / RECORD_SHARE;
+  return history->budget > reserved ? history->budget - reserved : 0;
+}
+
+// Bytes of a canvas's tiles that no canvas marked before holds, marking
+// them so shared tiles are counted once
+static size_t claimTiles(UndoHistory *history, const Canvas *canvas) {
+  int count = canvas->tile_columns * canvas->tile_rows;
+  size_t bytes = (size_t)count * sizeof(Tile);
+  for (int i = 0; i < count; i++) {
+    TileData *data = canvas->tiles[i].data;
+    if (data != NULL && data->mark != history->mark) {
+      data->mark = history->mark;
+      bytes += tileDataBytes(data);
+    }
+  }
+  return bytes;
+}
+
+// Bytes the base raster & the snapshots hold beyond what the canvas does
+static size_t measureSnapshots(UndoHistory *history, const Canvas *canvas) {
+  history->mark++;
+  claimTiles(history, canvas);
+  size_t bytes = claimTiles(history, &history->base.canvas);
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    if (history->checkpoints[i].canvas.tiles != NULL) {
+      bytes += claimTiles(history, &history->checkpoints[i].canvas);
+    }
+  }
+  return bytes;
+}
+
+// Frees the snapshots no newer than the base raster
+static void dropStaleCheckpoints(UndoHistory *history) {
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    Checkpoint *c = &history->checkpoints[i];
+    if (c->canvas.tiles != NULL && c->sequence <= oldestSequence(history)) {
+      freeCanvas(&c->canvas);
+      c->sequence = -1;
+    }
+  }
+}
+
+// Makes a checkpoint the new base raster, dropping the strokes before it.
+// The old base & the slot are freed.
+static void foldCheckpoint(UndoHistory *history, Checkpoint *checkpoint) {
+  Canvas base = history->base.canvas;
+  history->base.canvas = checkpoint->canvas;
+  history->base.sequence = checkpoint->sequence;
+  history->evictions += checkpoint->sequence - oldestSequence(history);
+  history->undo_count = history->sequence - checkpoint->sequence;
+  checkpoint->canvas = base;
+  freeCanvas(&checkpoint->canvas);
+  checkpoint->sequence = -1;
+}
+
+// Folds the oldest stored stroke into the base raster
+static void evictOldest(UndoHistory *history) {
+  renderStroke(&history->base.canvas,
+               &history->undos[strokeIndex(history,
+                                           oldestSequence(history) + 1)]);
+  history->undo_count--;
+  history->evictions++;
+  history->base.sequence++;
+}
+
+// Folds every stored stroke up to sequence into the base raster. The newest
+// checkpoint in that range is taken over first, so only the strokes after
+// it have to be painted.
+static void evictThrough(UndoHistory *history, int sequence) {
+  Checkpoint *newest = NULL;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    Checkpoint *c = &history->checkpoints[i];
+    if (c->sequence > oldestSequence(history) && c->sequence <= sequence &&
+        (newest == NULL || c->sequence > newest->sequence)) {
+      newest = c;
+    }
+  }
+  if (newest != NULL) {
+    foldCheckpoint(history, newest);
+  }
+  while (oldestSequence(history) < sequence) {
+    evictOldest(history);
+  }
+}
+
+// Oldest snapshot newer than the base raster, NULL if there's none
+static Checkpoint *oldestCheckpoint(UndoHistory *history) {
+  Checkpoint *oldest = NULL;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    Checkpoint *c = &history->checkpoints[i];
+    if (c->sequence > oldestSequence(history) &&
+        (oldest == NULL || c->sequence < oldest->sequence)) {
+      oldest = c;
+    }
+  }
+  return oldest;
+}
+
+// Packs the tiles the base raster & the snapshots no longer share with the
+// canvas, they're only read again to restore from
+static void packCheckpoints(UndoHistory *history, const Canvas *canvas) {
+  Canvas *snapshots[MAX_CHECKPOINTS + 1];
+  int count = 0;
+  snapshots[count++] = &history->base.canvas;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    if (history->checkpoints[i].canvas.tiles != NULL) {
+      snapshots[count++] = &history->checkpoints[i].canvas;
+    }
+  }
+  history->packed_tiles += packSnapshots(snapshots, count, canvas);
+}
+
+// Snapshot the canvas into a free slot. The snapshot shares every tile with
+// the canvas, so it only costs memory as the canvas is painted over, and the
+// tiles painted over are packed. Once the slots run out, or the tiles
+// painted over no longer fit the budget, the oldest snapshots become the
+// base raster.
+static void takeCheckpoint(UndoHistory *history, Canvas *canvas) {
+  dropStaleCheckpoints(history);
+  Checkpoint *slot = NULL;
+  for (int i = 0; i < history->max_checkpoints && slot == NULL; i++) {
+    if (history->checkpoints[i].sequence < 0) {
+      slot = &history->checkpoints[i];
+    }
+  }
+  if (slot == NULL) {
+    slot = oldestCheckpoint(history);
+    foldCheckpoint(history, slot);
+  }
+
+  history->allocations++;
+  shareCanvas(&slot->canvas, canvas);
+  slot->sequence = history->sequence;
+
+  packCheckpoints(history, canvas);
+  history->snapshot_bytes = measureSnapshots(history, canvas);
+  while (history->snapshot_bytes > snapshotBudget(history)) {
+    Checkpoint *oldest = oldestCheckpoint(history);
+    if (oldest == slot) {
+      break; // Only the base & the new snapshot left
+    }
+    foldCheckpoint(history, oldest);
+    history->snapshot_bytes = measureSnapshots(history, canvas);
+  }
+
+  history->strokes_since_checkpoint = 0;
+  history->bytes_since_checkpoint = 0;
+}
+
+// Newest checkpoint that the stored strokes can be replayed on top of, NULL
+// to replay from the base raster
+static Checkpoint *findCheckpoint(UndoHistory *history) {
+  Checkpoint *best = NULL;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    Checkpoint *c = &history->checkpoints[i];
+    if (c->sequence >= oldestSequence(history) &&
+        c->sequence <= history->sequence &&
+        (best == NULL || c->sequence > best->sequence)) {
+      best = c;
+    }
+  }
+  return best;
+}
+//--------------------------------------------------------------------------------
+
+//-Spatial-index------------------------------------------------------------------
+// Cells covered by bounds, returns false if none
+static bool gridRange(const StrokeGrid *grid, Bounds bounds, int *c0, int *r0,
+                      int *c1, int *r1) {
+  if (boundsEmpty(bounds)) {
+    return false;
+  }
+  *c0 = bounds.x0 < 0 ? 0 : bounds.x0 / grid->cell_size;
+  *r0 = bounds.y0 < 0 ? 0 : bounds.y0 / grid->cell_size;
+  *c1 = (bounds.x1 - 1) / grid->cell_size;
+  *r1 = (bounds.y1 - 1) / grid->cell_size;
+  if (*c1 >= grid->columns) {
+    *c1 = grid->columns - 1;
+  }
+  if (*r1 >= grid->rows) {
+    *r1 = grid->rows - 1;
+  }
+  return *c0 <= *c1 && *r0 <= *r1;
+}
+
+// Sets or clears the bit of a record slot in every cell its bounds cover
+static void gridMark(StrokeGrid *grid, int slot, Bounds bounds, bool on) {
+  int c0, r0, c1, r1;
+  if (!gridRange(grid, bounds, &c0, &r0, &c1, &r1)) {
+    return;
+  }
+  unsigned long long bit = 1ULL << (slot % 64);
+  for (int r = r0; r <= r1; r++) {
+    for (int c = c0; c <= c1; c++) {
+      unsigned long long *word =
+          &grid->cells[(size_t)(r * grid->columns + c) * grid->words +
+                       slot / 64];
+      *word = on ? *word | bit : *word & ~bit;
+    }
+  }
+}
+
+// ORs together the slot masks of every cell bounds covers into grid->mask
+static const unsigned long long *gridQuery(StrokeGrid *grid, Bounds bounds) {
+  memset(grid->mask, 0, grid->words * sizeof(unsigned long long));
+  int c0, r0, c1, r1;
+  if (!gridRange(grid, bounds, &c0, &r0, &c1, &r1)) {
+    return grid->mask;
+  }
+  for (int r = r0; r <= r1; r++) {
+    for (int c = c0; c <= c1; c++) {
+      const unsigned long long *cell =
+          &grid->cells[(size_t)(r * grid->columns + c) * grid->words];
+      for (int w = 0; w < grid->words; w++) {
+        grid->mask[w] |= cell[w];
+      }
+    }
+  }
+  return grid->mask;
+}
+
+// Bytes the stroke records & their index take with room for capacity strokes
+static size_t recordBytes(const UndoHistory *history, int capacity) {
+  size_t words = capacity / 64;
+  return (size_t)capacity * sizeof(Stroke) +
+         ((size_t)history->grid.columns * history->grid.rows + 1) * words *
+             sizeof(unsigned long long);
+}
+
+// Allocates the record ring & an empty index for capacity strokes, returns
+// false if out of memory
+static bool allocRecords(UndoHistory *history, int capacity, Stroke **undos,
+                         unsigned long long **cells,
+                         unsigned long long **mask) {
+  size_t words = capacity / 64;
+  *undos = (Stroke *)malloc((size_t)capacity * sizeof(Stroke));
+  *cells = (unsigned long long *)calloc(
+      (size_t)history->grid.columns * history->grid.rows * words,
+      sizeof(unsigned long long));
+  *mask = (unsigned long long *)malloc(words * sizeof(unsigned long long));
+  if (*undos == NULL || *cells == NULL || *mask == NULL) {
+    free(*undos);
+    free(*cells);
+    free(*mask);
+    return false;
+  }
+  history->allocations += 3;
+  for (int i = 0; i < capacity; i++) {
+    (*undos)[i].data = NULL;
+    (*undos)[i].size = 0;
+    (*undos)[i].point_count = 0;
+    (*undos)[i].bounds = emptyBounds();
+  }
+  return true;
+}
+
+// Doubles the record ring, oldest stroke first, & rebuilds the index for
+// it. Returns false if that would overrun the records' share of the budget.
+static bool growRecords(UndoHistory *history) {
+  int capacity = history->capacity * 2;
+  Stroke *undos;
+  unsigned long long *cells, *mask;
+  if (capacity > INT_MAX / 2 ||
+      recordBytes(history, capacity) > history->budget / RECORD_SHARE ||
+      !allocRecords(history, capacity, &undos, &cells, &mask)) {
+    return false;
+  }
+
+  int count = history->undo_count + history->redo_count;
+  int first = strokeIndex(history, oldestSequence(history) + 1);
+  for (int i = 0; i < count; i++) {
+    undos[i] = history->undos[(first + i) % history->capacity];
+  }
+  free(history->undos);
+  free(history->grid.cells);
+  free(history->grid.mask);
+  history->undos = undos;
+  history->capacity = capacity;
+  history->current_undo_index = (history->undo_count - 1 + capacity) % capacity;
+  history->grid.cells = cells;
+  history->grid.mask = mask;
+  history->grid.words = capacity / 64;
+  for (int i = 0; i < count; i++) {
+    gridMark(&history->grid, i, undos[i].bounds, true);
+  }
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-History------------------------------------------------------------------------
+// Init undo history for a width x height canvas. budget bounds the bytes it
+// may use, base_color is what the canvas shows before the first stroke.
+void initHistory(UndoHistory *history, int width, int height, size_t budget,
+                 int base_color) {
+  history->current_undo_index = INITIAL_RECORDS - 1;
+  history->undo_count = 0;
+  history->redo_count = 0;
+  history->sequence = 0;
+  history->width = width;
+  history->height = height;
+  history->budget = budget;
+  history->allocations = 0;
+  history->evictions = 0;
+  history->commits = 0;
+  history->packed_tiles = 0;
+  history->committed_points = 0;
+  history->committed_bytes = 0;
+  history->repeated_points = 0;
+  history->simplified_points = 0;
+  history->tolerance = SIMPLIFY_TOLERANCE;
+  history->scratch = NULL;
+  history->scratch_size = 0;
+  history->stroke_start.tiles = NULL;
+  history->replay_threads = REPLAY_DEFAULT_THREADS;
+
+  // The only allocation strokes ever need
+  size_t arena = budget / ARENA_SHARE;
+  arena = arena < MIN_ARENA_BYTES ? MIN_ARENA_BYTES : arena;
+  arena = arena > MAX_ARENA_BYTES ? MAX_ARENA_BYTES : arena;
+  history->arena.capacity = (int)arena;
+  history->arena.head = 0;
+  history->arena.bytes = (unsigned char *)malloc(arena);
+  history->allocations++;
+
+  // Index cells grow on huge canvases so the index stays small
+  StrokeGrid *grid = &history->grid;
+  grid->cell_size = GRID_CELL_SIZE;
+  for (;;) {
+    grid->columns = (width + grid->cell_size - 1) / grid->cell_size;
+    grid->rows = (height + grid->cell_size - 1) / grid->cell_size;
+    if (grid->columns * grid->rows <= MAX_GRID_CELLS) {
+      break;
+    }
+    grid->cell_size *= 2;
+  }
+
+  // Records start small & double while they fit their share of the budget
+  history->grid.words = INITIAL_RECORDS / 64;
+  history->capacity = INITIAL_RECORDS;
+  if (history->arena.bytes == NULL ||
+      !allocRecords(history, INITIAL_RECORDS, &history->undos,
+                    &history->grid.cells, &history->grid.mask)) {
+    fprintf(stderr, "Failed to allocate memory for undo history\n");
+    exit(1);
+  }
+
+  // Snapshots get what's left, slots are cheap until they diverge
+  history->max_checkpoints = MAX_CHECKPOINTS;
+  history->checkpoints =
+      (Checkpoint *)malloc(MAX_CHECKPOINTS * sizeof(Checkpoint));
+  history->allocations++;
+  if (history->checkpoints == NULL) {
+    fprintf(stderr, "Failed to allocate memory for undo history\n");
+    exit(1);
+  }
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    history->checkpoints[i] = (Checkpoint){.sequence = -1};
+  }
+  initCanvas(&history->base.canvas, width, height, base_color);
+  history->base.sequence = 0;
+  history->base_color = base_color;
+  history->snapshot_bytes = 0;
+  history->mark = 0;
+  history->checkpoint_strokes = CHECKPOINT_STROKES;
+  history->checkpoint_bytes = CHECKPOINT_BYTES;
+  history->strokes_since_checkpoint = 0;
+  history->bytes_since_checkpoint = 0;
+  history->replayed_strokes = 0;
+  history->damage = emptyBounds();
+}
+
+// Seals a stroke into the next record slot
+static void sealStroke(UndoHistory *history, const Stroke *stroke) {
+  // Advance to next undo step, folding the oldest into the base raster once
+  // the ring is full & can't grow
+  dropRedo(history);
+  if (history->undo_count == history->capacity && !growRecords(history)) {
+    evictThrough(history, oldestSequence(history) + 1);
+  }
+  history->current_undo_index =
+      (history->current_undo_index + 1) % history->capacity;
+  history->undo_count++;
+  history->sequence++;
+
+  Stroke *slot = &history->undos[history->current_undo_index];
+
+  // Move the slot in the spatial index from its old stroke to the new one
+  gridMark(&history->grid, history->current_undo_index, slot->bounds, false);
+  gridMark(&history->grid, history->current_undo_index, stroke->bounds, true);
+
+  // The points already sit in the arena, only the range is recorded
+  *slot = *stroke;
+  if (stroke->size > 0) {
+    history->arena.head = (stroke->data - history->arena.bytes) + stroke->size;
+  }
+}
+
+// Counts a sealed stroke & snapshots the canvas if it's time to
+static void countStroke(UndoHistory *history, const Stroke *stroke,
+                        Canvas *canvas) {
+  history->commits++;
+  history->committed_points += stroke->point_count;
+  history->committed_bytes += stroke->size;
+
+  // Snapshot every N strokes or M bytes of point data
+  history->strokes_since_checkpoint++;
+  history->bytes_since_checkpoint += stroke->size;
+  if (history->strokes_since_checkpoint >= history->checkpoint_strokes ||
+      history->bytes_since_checkpoint >= history->checkpoint_bytes) {
+    takeCheckpoint(history, canvas);
+  }
+}
+
+// Commits a stroke, the canvas must already show it
+static void pushStroke(UndoHistory *history, const Stroke *stroke,
+                       Canvas *canvas) {
+  sealStroke(history, stroke);
+  countStroke(history, stroke, canvas);
+}
+
+// Commits the stroke just painted. Simplifying it changes what replay draws,
+// so where its dropped points painted the canvas is put back as the stroke
+// found it & the simplified stroke drawn again, nothing else is replayed.
+void addUndoStep(UndoHistory *history, Stroke *stroke, Canvas *canvas) {
+  Canvas *start = &history->stroke_start;
+  if (start->tiles != NULL && start->width == canvas->width &&
+      start->height == canvas->height) {
+    Bounds changed = simplifyStroke(history, stroke);
+    if (!boundsEmpty(changed)) {
+      // Dropping the snapshot first leaves the restored tiles to the canvas
+      copyArea(canvas, start, changed);
+      freeCanvas(start);
+      Bounds clip = canvas->clip;
+      setCanvasClip(canvas, intersectBounds(clip, changed));
+      renderStroke(canvas, stroke);
+      setCanvasClip(canvas, clip);
+    }
+  }
+  freeCanvas(start);
+  pushStroke(history, stroke, canvas);
+
+  // Reinitialize stroke for the next pass
+  initStroke(stroke);
+}
+
+// Commits a stroke read back from a file, copying its points into the arena
+// & painting it. Returns false if it can't be stored.
+bool replayStroke(UndoHistory *history, Stroke *stroke, Canvas *canvas) {
+  if (stroke->size == 0) {
+    stroke->data = NULL;
+  } else if (!appendStroke(history, stroke)) {
+    return false;
+  }
+  renderStroke(canvas, stroke);
+  pushStroke(history, stroke, canvas);
+  return true;
+}
+
+// Stroke committed last, NULL if there's none left to undo
+const Stroke *newestStroke(const UndoHistory *history) {
+  if (history->undo_count == 0) {
+    return NULL;
+  }
+  return &history->undos[history->current_undo_index];
+}
+
+// Records a canvas clear so replay stays in sync with what was on screen
+void addClearStep(UndoHistory *history, int color, Canvas *canvas) {
+  Stroke clear = {.data = NULL,
+                  .tool = TOOL_CLEAR,
+                  .color = color,
+                  .bounds = canvasBounds(canvas)};
+  pushStroke(history, &clear, canvas);
+}
+
+// Records a paint bucket fill seeded at x, y. filled is what floodFill
+// returned, the canvas must already show the fill. Returns false if it can't
+// be stored.
+bool addFillStep(UndoHistory *history, int x, int y, int color, Bounds filled,
+                 Canvas *canvas) {
+  Stroke fill;
+  initStroke(&fill);
+  if (!addToStroke(history, &fill, x, y, color, 0, TOOL_FILL, SHAPE_CIRCLE)) {
+    return false;
+  }
+  fill.bounds = filled;
+  pushStroke(history, &fill, canvas);
+  return true;
+}
+
+// Grows damage until it holds every fill replayed into it. A fill reads its
+// whole bounds, so replaying one from only part of them could spread it
+// differently.
+static Bounds fillDamage(UndoHistory *history, Bounds damage, int from,
+                         const Canvas *canvas) {
+  bool grown = true;
+  while (grown) {
+    grown = false;
+    const unsigned long long *mask = gridQuery(&history->grid, damage);
+    for (int s = from + 1; s <= history->sequence; s++) {
+      int index = strokeIndex(history, s);
+      const Stroke *stroke = &history->undos[index];
+      if (stroke->tool != TOOL_FILL ||
+          !(mask[index / 64] & (1ULL << (index % 64)))) {
+        continue;
+      }
+      Bounds bounds = intersectBounds(stroke->bounds, canvasBounds(canvas));
+      Bounds inside = intersectBounds(bounds, damage);
+      if (!boundsEmpty(inside) &&
+          (inside.x0 != bounds.x0 || inside.y0 != bounds.y0 ||
+           inside.x1 != bounds.x1 || inside.y1 != bounds.y1)) {
+        damage = unionBounds(damage, bounds);
+        grown = true;
+      }
+    }
+  }
+  return damage;
+}
+
+// Redraws damage from the nearest checkpoint, replaying only the strokes
+// after it that overlap. Returns the checkpoint's sequence number.
+static int redrawArea(UndoHistory *history, Canvas *canvas, Bounds damage) {
+  history->replayed_strokes = 0;
+  Checkpoint *checkpoint = findCheckpoint(history);
+  if (checkpoint == NULL) {
+    checkpoint = &history->base;
+  }
+  int from = checkpoint->sequence;
+  damage = intersectBounds(damage, canvasBounds(canvas));
+  if (boundsEmpty(damage)) {
+    history->damage = damage;
+    return from;
+  }
+  damage = fillDamage(history, damage, from, canvas);
+  history->damage = damage;
+
+  // Restore the damaged area from the checkpoint, whole tiles are shared
+  copyArea(canvas, &checkpoint->canvas, damage);
+  setCanvasClip(canvas, damage);
+
+  // Replay, in order, the later strokes whose bounds overlap the damage
+  const unsigned long long *mask = gridQuery(&history->grid, damage);
+  if (!growScratch(history, (size_t)(history->sequence - from) *
+                                sizeof(const Stroke *))) {
+    fprintf(stderr, "Failed to allocate memory for undo replay\n");
+    exit(1);
+  }
+  const Stroke **replay = (const Stroke **)history->scratch;
+  for (int s = from + 1; s <= history->sequence; s++) {
+    int index = strokeIndex(history, s);
+    if (mask[index / 64] & (1ULL << (index % 64))) {
+      replay[history->replayed_strokes++] = &history->undos[index];
+    }
+  }
+  replayStrokes(canvas, replay, history->replayed_strokes,
+                history->replay_threads);
+  resetCanvasClip(canvas);
+  return from;
+}
+
+// Removes the last stroke & redraws the area it covered from the nearest
+// checkpoint, replaying only the later strokes that overlap that area. The
+// stroke is kept for redo until a new one is started.
+bool undoStep(UndoHistory *history, Canvas *canvas) {
+  if (history->undo_count == 0) {
+    return false;
+  }
+
+  // Only the pixels the undone stroke could touch need redrawing
+  Bounds damage = history->undos[history->current_undo_index].bounds;
+
+  // Step back, the stroke's record, points & later snapshots stay for redo
+  history->undo_count--;
+  history->redo_count++;
+  history->sequence--;
+  history->current_undo_index =
+      (history->current_undo_index - 1 + history->capacity) %
+      history->capacity;
+
+  int from = redrawArea(history, canvas, damage);
+
+  // Keep the next undo from replaying further than the interval
+  history->strokes_since_checkpoint = history->sequence - from;
+  history->bytes_since_checkpoint = 0;
+  return true;
+}
+
+// Paints the last undone stroke again, returns false if there's none
+bool redoStep(UndoHistory *history, Canvas *canvas) {
+  if (history->redo_count == 0) {
+    return false;
+  }
+  history->current_undo_index =
+      (history->current_undo_index + 1) % history->capacity;
+  history->undo_count++;
+  history->redo_count--;
+  history->sequence++;
+
+  const Stroke *stroke = &history->undos[history->current_undo_index];
+  history->damage = intersectBounds(stroke->bounds, canvasBounds(canvas));
+  history->replayed_strokes = 1;
+  renderStroke(canvas, stroke);
+  history->strokes_since_checkpoint++;
+  return true;
+}
+
+// Bytes held by the arena, the stroke records & index, and the tiles only
+// the snapshots hold as of the last one taken
+size_t historyMemory(const UndoHistory *history) {
+  size_t total = sizeof(UndoHistory);
+  total += history->arena.capacity;
+  total += recordBytes(history, history->capacity);
+  total += history->max_checkpoints * sizeof(Checkpoint);
+  total += history->snapshot_bytes;
+  return total;
+}
+
+void printHistoryStats(FILE *out, const UndoHistory *history) {
+  int snapshots = 0;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    if (history->checkpoints[i].sequence >= 0) {
+      snapshots++;
+    }
+  }
+  fprintf(out,
+          "history: %d strokes, %d to redo, %d/%d checkpoints (every %d "
+          "strokes / %d bytes), last undo replayed %d strokes\n",
+          history->undo_count, history->redo_count, snapshots,
+          history->max_checkpoints, history->checkpoint_strokes,
+          history->checkpoint_bytes, history->replayed_strokes);
+  fprintf(out,
+          "history: %.2f MiB of a %.2f MiB budget, %d heap allocations over "
+          "%d commits, %d strokes folded into the base raster, %d snapshot "
+          "tiles packed\n",
+          historyMemory(history) / (1024.0 * 1024.0),
+          history->budget / (1024.0 * 1024.0), history->allocations,
+          history->commits, history->evictions, history->packed_tiles);
+
+  long long input = history->committed_points + history->repeated_points +
+                   history->simplified_points;
+  if (input > 0) {
+    fprintf(out,
+            "history: %lld of %lld input points kept, %lld repeats dropped, "
+            "%lld simplified away within %.2f px\n",
+            history->committed_points, input, history->repeated_points,
+            history->simplified_points, history->tolerance);
+  }
+
+  // Compare against the old layout: a 40 byte string tagged Stroke record
+  // holding an 8 byte float Vector2 for every input point
+  if (history->commits > 0 && history->committed_points > 0) {
+    double before = (input * 8.0 + history->commits * 40.0) / history->commits;
+    double after = (double)(history->committed_bytes +
+                            history->commits * (long long)sizeof(Stroke)) /
+                   history->commits;
+    fprintf(out,
+            "history: %.2f bytes/point (was 8), %.1f bytes/stroke with its "
+            "record (was %.1f), %.1fx smaller\n",
+            (double)history->committed_bytes / history->committed_points,
+            after, before, before / after);
+  }
+}
+
+// Free memory in undo history
+void freeUndoHistory(UndoHistory *history) {
+  free(history->arena.bytes);
+  history->arena.bytes = NULL;
+  for (int i = 0; i < history->max_checkpoints; i++) {
+    freeCanvas(&history->checkpoints[i].canvas);
+  }
+  free(history->checkpoints);
+  history->checkpoints = NULL;
+  history->max_checkpoints = 0;
+  freeCanvas(&history->base.canvas);
+  free(history->undos);
+  history->undos = NULL;
+  free(history->grid.cells);
+  history->grid.cells = NULL;
+  free(history->grid.mask);
+  history->grid.mask = NULL;
+  free(history->scratch);
+  history->scratch = NULL;
+  history->scratch_size = 0;
+  freeCanvas(&history->stroke_start);
+}
+//--------------------------------------------------------------------------------
+
+//-Project-files------------------------------------------------------------------
+// Base raster the stored strokes are replayed from, a project keeps it so its
+// strokes can still be undone after reopening
+Canvas *historyBase(UndoHistory *history) { return &history->base.canvas; }
+
+// Bytes writeHistoryLog needs for the strokes after sequence from
+size_t historyLogSize(const UndoHistory *history, int from) {
+  size_t size = 0;
+  for (int s = from + 1; s <= history->sequence; s++) {
+    size += STROKE_RECORD_BYTES + history->undos[strokeIndex(history, s)].size;
+  }
+  return size;
+}
+
+// Writes the strokes after sequence from as records, oldest first. Returns
+// how many were written.
+int writeHistoryLog(const UndoHistory *history, int from, unsigned char *out) {
+  int count = 0;
+  for (int s = from + 1; s <= history->sequence; s++) {
+    out += writeStrokeRecord(out, &history->undos[strokeIndex(history, s)]);
+    count++;
+  }
+  return count;
+}
+
+// Refills an empty history from count records, the canvas must already show
+// their result. base lazily decodes the raster they were painted on top of,
+// or is NULL if they start from a canvas cleared to base_color. Returns false
+// on a malformed record, keeping the strokes before it.
+bool restoreHistory(UndoHistory *history, const unsigned char *log,
+                    size_t size, int count, TileLoader base, void *base_data) {
+  history->base.sequence = history->sequence;
+  freeCanvas(&history->base.canvas);
+  if (base != NULL) {
+    initLazyCanvas(&history->base.canvas, history->width, history->height,
+                   base, base_data);
+  } else {
+    initCanvas(&history->base.canvas, history->width, history->height,
+               history->base_color);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    Stroke stroke;
+    int used = readStrokeRecord(log, size > INT_MAX ? INT_MAX : (int)size,
+                                &stroke);
+    if (used == 0 || stroke.color >= NUM_COLORS) {
+      ok = false;
+      break;
+    }
+    if (stroke.size == 0) {
+      stroke.data = NULL;
+    } else if (!appendStroke(history, &stroke)) {
+      ok = false;
+      break;
+    }
+    sealStroke(history, &stroke);
+    log += used;
+    size -= used;
+  }
+
+  // The first snapshot follows the usual interval
+  history->strokes_since_checkpoint = 0;
+  history->bytes_since_checkpoint = 0;
+  return ok;
+}
+//--------------------------------------------------------------------------------
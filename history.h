@@ -0,0 +1,147 @@
+/*  --- history ---
+ *
+ *  Stroke recording & undo/redo history. Every few strokes the history keeps
+ *  a snapshot of the canvas, so an undo restores the nearest snapshot and
+ *  only replays the strokes committed after it, and a redo paints a single
+ *  stroke again.
+ *
+ *  The history lives within a byte budget. All encoded points share one ring
+ *  shaped arena: the stroke being painted grows at the arena head,
+ *  committing it just seals that range. Once the arena, the stroke records
+ *  or the snapshots run out of room the oldest strokes are folded into a
+ *  base raster, so the canvas can still be rebuilt without them. Snapshots
+ *  share tiles with the canvas, so they only cost the tiles painted since,
+ *  and those are kept run-length encoded.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "raster.h"
+#include "stroke.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define HISTORY_BUDGET (256 << 20)    // Default bytes the history may use
+#define ARENA_SHARE 16                // Arena gets 1/ARENA_SHARE of the budget
+#define RECORD_SHARE 16               // Records get 1/RECORD_SHARE of it
+#define MIN_ARENA_BYTES (256 * 1024)  // Arena size whatever the budget
+#define MAX_ARENA_BYTES (1 << 30)     // Largest arena, offsets stay ints
+#define INITIAL_RECORDS 256           // Stroke records before the ring grows
+#define MAX_CHECKPOINTS 64            // Most canvas snapshots kept
+#define CHECKPOINT_STROKES 25         // Default strokes between snapshots
+#define CHECKPOINT_BYTES (512 * 1024) // Default point bytes between snapshots
+#define SIMPLIFY_TOLERANCE 0.5f       // Default pixels strokes may be simplified
+#define GRID_CELL_SIZE 128            // Smallest spatial index cell side
+#define MAX_GRID_CELLS 4096           // Most spatial index cells
+//--------------------------------------------------------------------------------
+
+// Struct to store a snapshot of the canvas
+typedef struct {
+  Canvas canvas; // Shares the canvas tiles it was taken from, tiles NULL if
+                 // unused
+  int sequence;  // Strokes applied at snapshot time, -1 if unused
+} Checkpoint;
+
+// Struct to store the encoded points of every stroke in one allocation
+typedef struct {
+  unsigned char *bytes; // Ring of capacity bytes, allocated once
+  int capacity;         // Bytes the arena holds
+  int head;             // Where the next stroke starts
+} PointArena;
+
+// Struct to store a uniform grid over the canvas, each cell holds a bitmask
+// of the record slots whose bounds overlap it
+typedef struct {
+  unsigned long long *cells; // One bitmask per cell, row major
+  unsigned long long *mask;  // Scratch bitmask for queries
+  int words;                 // Words in a bitmask of record slots
+  int cell_size;             // Side of a cell in pixels
+  int columns;               // Cells across
+  int rows;                  // Cells down
+} StrokeGrid;
+
+// Struct to store undo history
+//
+// Records form a ring: the undo_count committed strokes end at
+// current_undo_index, the redo_count undone ones follow it until a new
+// stroke starts.
+typedef struct {
+  Stroke *undos;          // Ring of stroke records, doubled while it fits
+  int capacity;           // Records the ring holds
+  PointArena arena;       // Backing store for every stroke's points
+  int current_undo_index; // Current position in undo history
+  int undo_count;         // Strokes that can be undone
+  int redo_count;         // Undone strokes that can be redone
+  int sequence;           // Strokes applied to the canvas, folded included
+  int width;              // Canvas width in pixels
+  int height;             // Canvas height in pixels
+  size_t budget;          // Bytes the history may use
+
+  Checkpoint base;              // Canvas before the oldest stored stroke
+  int base_color;               // Palette index base starts out cleared to
+  Checkpoint *checkpoints;      // Canvas snapshots
+  int max_checkpoints;          // Snapshot slots
+  size_t snapshot_bytes;        // Tile bytes only the snapshots & base hold
+  int mark;                     // Last stamp put on tiles counting them
+  int checkpoint_strokes;       // Strokes between snapshots
+  int checkpoint_bytes;         // Bytes of point data between snapshots
+  int strokes_since_checkpoint; // Strokes committed since the last snapshot
+  int bytes_since_checkpoint;   // Point bytes committed since the last snapshot
+  int replayed_strokes;         // Strokes replayed by the last undo or redo
+  int replay_threads;           // Threads undo replays on, 0 for one per core
+  float tolerance; // Pixels a committed stroke may stray from its points,
+                   // 0 keeps every point
+
+  // Scratch for simplifying strokes & listing the ones undo replays, grown
+  // as needed
+  unsigned char *scratch;
+  size_t scratch_size;
+  // Canvas as the stroke in progress found it, tiles NULL without one
+  Canvas stroke_start;
+
+  StrokeGrid grid; // Spatial index of the stored strokes
+  Bounds damage;   // Area redrawn by the last undo or redo
+
+  int allocations;  // Heap allocations made by the history so far
+  int evictions;    // Strokes folded into the base raster
+  int commits;      // Strokes committed so far
+  int packed_tiles; // Snapshot tiles run-length encoded so far
+
+  long long committed_points;  // Points in every committed stroke
+  long long committed_bytes;   // Encoded bytes of every committed stroke
+  long long repeated_points;   // Points addToStroke dropped as repeats
+  long long simplified_points; // Points simplification dropped at commit
+} UndoHistory;
+
+// Strokes
+void initStroke(Stroke *stroke);
+void beginStroke(UndoHistory *history, Canvas *canvas);
+bool addToStroke(UndoHistory *history, Stroke *stroke, int x, int y, int color,
+                 int radius, Tool stroke_tool, Shape shape);
+
+// History
+void initHistory(UndoHistory *history, int width, int height, size_t budget,
+                 int base_color);
+void addUndoStep(UndoHistory *history, Stroke *stroke, Canvas *canvas);
+void addClearStep(UndoHistory *history, int color, Canvas *canvas);
+bool addFillStep(UndoHistory *history, int x, int y, int color, Bounds filled,
+                 Canvas *canvas);
+bool replayStroke(UndoHistory *history, Stroke *stroke, Canvas *canvas);
+const Stroke *newestStroke(const UndoHistory *history);
+bool undoStep(UndoHistory *history, Canvas *canvas);
+bool redoStep(UndoHistory *history, Canvas *canvas);
+size_t historyMemory(const UndoHistory *history);
+void printHistoryStats(FILE *out, const UndoHistory *history);
+void freeUndoHistory(UndoHistory *history);
+
+// Project files
+Canvas *historyBase(UndoHistory *history);
+size_t historyLogSize(const UndoHistory *history, int from);
+int writeHistoryLog(const UndoHistory *history, int from, unsigned char *out);
+bool restoreHistory(UndoHistory *history, const unsigned char *log,
+                    size_t size, int count, TileLoader base, void *base_data);
+
+#endif
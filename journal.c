@@ -0,0 +1,529 @@
+/*  --- journal ---
+ *
+ *  Layout, every integer little endian:
+ *
+ *    header   0  "CPJOURNL"       8  u32 version
+ *            12  u32 width       16  u32 height
+ *            20  u32 clear color 24  u32 background
+ *            28  u32 source length, the path follows the header
+ *            32  u64 generation
+ *    entries u32 payload size, u32 crc32 of the payload, then the payload:
+ *            a JournalOp byte, followed by a stroke record for
+ *            JOURNAL_STROKE
+ *
+ *  A crash can leave a torn last entry, replay stops at the first entry
+ *  that is cut short or fails its crc & the journal is truncated there.
+ *
+ *  Compaction writes the snapshot under a temporary name, renames it over
+ *  JOURNAL_SNAPSHOT, then does the same for a fresh journal one generation
+ *  later. Crashing between the renames leaves a snapshot one generation
+ *  ahead of the journal, which already holds every entry the journal does.
+ */
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_BYTES 40
+#define JOURNAL_ENTRY_BYTES 8 // Size & crc in front of every payload
+
+static inline void put32(unsigned char *out, unsigned int value) {
+  out[0] = (unsigned char)value;
+  out[1] = (unsigned char)(value >> 8);
+  out[2] = (unsigned char)(value >> 16);
+  out[3] = (unsigned char)(value >> 24);
+}
+
+static inline unsigned int get32(const unsigned char *in) {
+  return in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 |
+         (unsigned int)in[3] << 24;
+}
+
+static bool writeAll(int fd, const unsigned char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Makes renames in the working directory durable
+static bool syncDirectory(void) {
+  int fd = open(".", O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+//-Recovery-----------------------------------------------------------------------
+// Parses a journal header, returns bytes used or 0 if it isn't one
+static size_t readHeader(const unsigned char *data, size_t size,
+                         JournalSession *session) {
+  if (size < JOURNAL_HEADER_BYTES || memcmp(data, "CPJOURNL", 8) != 0 ||
+      get32(data + 8) != JOURNAL_VERSION) {
+    return 0;
+  }
+  session->width = (int)get32(data + 12);
+  session->height = (int)get32(data + 16);
+  session->clear_color = (int)get32(data + 20);
+  session->background = (int)get32(data + 24);
+  unsigned int source_length = get32(data + 28);
+  session->generation =
+      get32(data + 32) | (unsigned long long)get32(data + 36) << 32;
+  if (session->width <= 0 || session->width > PROJECT_MAX_SIDE ||
+      session->height <= 0 || session->height > PROJECT_MAX_SIDE ||
+      session->clear_color < 0 || session->clear_color >= NUM_COLORS ||
+      session->background < 0 || session->background >= NUM_COLORS ||
+      source_length >= JOURNAL_MAX_SOURCE ||
+      source_length > size - JOURNAL_HEADER_BYTES) {
+    return 0;
+  }
+  memcpy(session->source, data + JOURNAL_HEADER_BYTES, source_length);
+  session->source[source_length] = '\0';
+  return JOURNAL_HEADER_BYTES + source_length;
+}
+
+// Reads the whole journal into memory, returns NULL if there's none
+static unsigned char *readJournal(size_t *size) {
+  FILE *file = fopen(JOURNAL_FILE, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  unsigned char *data = NULL;
+  struct stat info;
+  if (fstat(fileno(file), &info) == 0 && info.st_size > 0) {
+    *size = (size_t)info.st_size;
+    data = (unsigned char *)malloc(*size);
+    if (data != NULL && fread(data, 1, *size, file) != *size) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(file);
+  return data;
+}
+
+// True if a journal left behind by a session that didn't exit cleanly
+// exists & isn't in use by another cpaint
+bool findJournal(JournalSession *session) {
+  int fd = open(JOURNAL_FILE, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool in_use = flock(fd, LOCK_EX | LOCK_NB) != 0;
+  close(fd);
+  if (in_use) {
+    return false;
+  }
+
+  size_t size = 0;
+  unsigned char *data = readJournal(&size);
+  bool found = data != NULL && readHeader(data, size, session) > 0;
+  free(data);
+  return found;
+}
+
+// Opens what the journal continues from, then replays its entries on top.
+// On success the canvas & history hold the recovered session, project is
+// open if project_open is set, and session->valid_size marks where a
+// resumed journal should continue.
+bool recoverJournal(JournalSession *session, Project *project,
+                    bool *project_open, Canvas *canvas, UndoHistory *history) {
+  size_t size = 0;
+  unsigned char *data = readJournal(&size);
+  size_t offset = data != NULL ? readHeader(data, size, session) : 0;
+  if (offset == 0) {
+    free(data);
+    return false;
+  }
+
+  *project_open = false;
+  if (session->generation > 0 || session->source[0] != '\0') {
+    const char *filename =
+        session->generation > 0 ? JOURNAL_SNAPSHOT : session->source;
+    if (!openProject(project, filename) ||
+        (session->generation > 0 &&
+         project->generation != session->generation &&
+         project->generation != session->generation + 1) ||
+        project->width != session->width ||
+        project->height != session->height) {
+      closeProject(project);
+      free(data);
+      return false;
+    }
+    *project_open = true;
+    attachProject(project, canvas, history);
+
+    // A snapshot one generation ahead already holds every entry, a fresh
+    // journal continues from it
+    if (session->generation > 0 &&
+        project->generation == session->generation + 1) {
+      session->generation = project->generation;
+      session->valid_size = 0;
+      free(data);
+      fprintf(stderr, "Recovered session from %s\n", JOURNAL_SNAPSHOT);
+      return true;
+    }
+  } else {
+    initCanvas(canvas, session->width, session->height, session->clear_color);
+    history->base_color = session->clear_color;
+    restoreHistory(history, NULL, 0, 0, NULL, NULL);
+  }
+
+  int replayed = 0;
+  while (size - offset >= JOURNAL_ENTRY_BYTES) {
+    unsigned int length = get32(data + offset);
+    const unsigned char *payload = data + offset + JOURNAL_ENTRY_BYTES;
+    if (length == 0 || length > size - offset - JOURNAL_ENTRY_BYTES ||
+        crc32(0, payload, length) != get32(data + offset + 4)) {
+      break; // Torn by the crash
+    }
+
+    Stroke stroke;
+    if (payload[0] == JOURNAL_STROKE) {
+      if (readStrokeRecord(payload + 1, (int)length - 1, &stroke) == 0 ||
+          stroke.color >= NUM_COLORS ||
+          !replayStroke(history, &stroke, canvas)) {
+        break;
+      }
+    } else if (payload[0] == JOURNAL_UNDO || payload[0] == JOURNAL_REDO) {
+      // Strokes folded into the base raster at other times than in the
+      // session can leave an undo out of reach, stop before diverging
+      bool done = payload[0] == JOURNAL_UNDO ? undoStep(history, canvas)
+                                              : redoStep(history, canvas);
+      if (!done) {
+        break;
+      }
+    } else {
+      break;
+    }
+    offset += JOURNAL_ENTRY_BYTES + length;
+    replayed++;
+  }
+  session->valid_size = offset;
+  free(data);
+
+  fprintf(stderr, "Recovered session: %d operations replayed\n", replayed);
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-Writer-------------------------------------------------------------------------
+// Writes a journal header for session to an empty file & syncs it
+static bool writeHeader(int fd, const JournalSession *session) {
+  unsigned char header[JOURNAL_HEADER_BYTES];
+  size_t source_length = strlen(session->source);
+  memcpy(header, "CPJOURNL", 8);
+  put32(header + 8, JOURNAL_VERSION);
+  put32(header + 12, session->width);
+  put32(header + 16, session->height);
+  put32(header + 20, session->clear_color);
+  put32(header + 24, session->background);
+  put32(header + 28, (unsigned int)source_length);
+  put32(header + 32, (unsigned int)session->generation);
+  put32(header + 36, (unsigned int)(session->generation >> 32));
+  return writeAll(fd, header, sizeof(header)) &&
+         writeAll(fd, (const unsigned char *)session->source, source_length) &&
+         fsync(fd) == 0;
+}
+
+// Writes a journal header for session to a new file, returns its fd or -1
+static int createJournal(const char *filename,
+                         const JournalSession *session) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (!writeHeader(fd, session)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Replaces snapshot & journal with the next generation, see the layout notes
+static bool rotateJournal(Journal *journal, ProjectSnapshot *snapshot) {
+  JournalSession next = journal->session;
+  next.generation++;
+  next.source[0] = '\0';
+  snapshot->generation = next.generation;
+
+  if (!writeProjectFile(snapshot, JOURNAL_SNAPSHOT ".tmp", true, NULL) ||
+      rename(JOURNAL_SNAPSHOT ".tmp", JOURNAL_SNAPSHOT) != 0) {
+    return false;
+  }
+  int fd = createJournal(JOURNAL_FILE ".tmp", &next);
+  if (fd < 0) {
+    return false;
+  }
+  flock(fd, LOCK_EX | LOCK_NB);
+  if (rename(JOURNAL_FILE ".tmp", JOURNAL_FILE) != 0) {
+    close(fd);
+    return false;
+  }
+  syncDirectory();
+
+  close(journal->fd);
+  journal->fd = fd;
+  pthread_mutex_lock(&journal->lock);
+  journal->session = next;
+  pthread_mutex_unlock(&journal->lock);
+  return true;
+}
+
+static void *journalThread(void *arg) {
+  Journal *journal = (Journal *)arg;
+  unsigned char *batch = NULL;
+  size_t batch_capacity = 0;
+
+  pthread_mutex_lock(&journal->lock);
+  for (;;) {
+    while (journal->running && journal->pending_size == 0 &&
+           journal->compaction == NULL) {
+      pthread_cond_wait(&journal->wake, &journal->lock);
+    }
+    if (journal->pending_size == 0 && journal->compaction == NULL) {
+      break; // Stopped & drained
+    }
+
+    // Take everything queued so far in one go
+    ProjectSnapshot *compaction = journal->compaction;
+    journal->compaction = NULL;
+    unsigned char *swap = batch;
+    size_t swap_capacity = batch_capacity;
+    size_t size = journal->pending_size;
+    batch = journal->pending;
+    batch_capacity = journal->pending_capacity;
+    journal->pending = swap;
+    journal->pending_capacity = swap_capacity;
+    journal->pending_size = 0;
+    pthread_mutex_unlock(&journal->lock);
+
+    bool ok = true;
+    if (compaction != NULL) {
+      ok = rotateJournal(journal, compaction);
+      freeProjectSnapshot(compaction);
+    }
+    ok = ok && writeAll(journal->fd, batch, size) && fsync(journal->fd) == 0;
+    if (!ok && !atomic_exchange(&journal->failed, 1)) {
+      fprintf(stderr, "Failed to write %s, journaling stopped\n",
+              JOURNAL_FILE);
+    }
+
+    // Let the render loop queue more before the next fsync
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += JOURNAL_SYNC_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&journal->lock);
+    while (journal->running &&
+           pthread_cond_timedwait(&journal->wake, &journal->lock,
+                                  &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&journal->lock);
+  free(batch);
+  return NULL;
+}
+
+// Starts journaling session, either appending to the journal it was
+// recovered from (resume) or replacing any old one. A fresh generation 0
+// journal drops the old snapshot too.
+bool startJournal(Journal *journal, const JournalSession *session,
+                  bool resume) {
+  journal->enabled = false;
+  journal->session = *session;
+  journal->pending = NULL;
+  journal->pending_size = 0;
+  journal->pending_capacity = 0;
+  journal->compaction = NULL;
+  atomic_init(&journal->failed, 0);
+
+  // Nothing is truncated or removed before the lock is held, another
+  // cpaint journaling here keeps its journal & snapshot
+  journal->fd = open(JOURNAL_FILE, resume ? O_WRONLY : O_WRONLY | O_CREAT,
+                     0644);
+  if (journal->fd < 0) {
+    fprintf(stderr, "Failed to open %s, session won't be recoverable\n",
+            JOURNAL_FILE);
+    return false;
+  }
+  // A journal the other cpaint rotated away before the lock was taken
+  // isn't the one to write either
+  struct stat opened;
+  struct stat named;
+  if (flock(journal->fd, LOCK_EX | LOCK_NB) != 0 ||
+      fstat(journal->fd, &opened) != 0 || stat(JOURNAL_FILE, &named) != 0 ||
+      opened.st_ino != named.st_ino || opened.st_dev != named.st_dev) {
+    fprintf(stderr, "%s is in use by another cpaint, not journaling\n",
+            JOURNAL_FILE);
+    close(journal->fd);
+    return false;
+  }
+
+  bool ok;
+  if (resume) {
+    ok = ftruncate(journal->fd, (off_t)session->valid_size) == 0 &&
+         lseek(journal->fd, 0, SEEK_END) >= 0;
+    atomic_init(&journal->size, (long long)session->valid_size);
+  } else {
+    ok = ftruncate(journal->fd, 0) == 0 && writeHeader(journal->fd, session);
+    if (ok && session->generation == 0) {
+      remove(JOURNAL_SNAPSHOT);
+    }
+    atomic_init(&journal->size, JOURNAL_HEADER_BYTES +
+                                    (long long)strlen(session->source));
+  }
+  if (!ok) {
+    fprintf(stderr, "Failed to write %s, session won't be recoverable\n",
+            JOURNAL_FILE);
+    close(journal->fd);
+    return false;
+  }
+
+  journal->running = true;
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+  if (pthread_create(&journal->thread, NULL, journalThread, journal) != 0) {
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wake);
+    close(journal->fd);
+    return false;
+  }
+  journal->enabled = true;
+  return true;
+}
+
+// Queues one entry for the writer, the render loop never touches the disk
+static void appendEntry(Journal *journal, JournalOp op, const Stroke *stroke) {
+  if (!journal->enabled || atomic_load(&journal->failed)) {
+    return;
+  }
+  size_t payload = 1;
+  if (stroke != NULL) {
+    payload += STROKE_RECORD_BYTES + stroke->size;
+  }
+  size_t size = JOURNAL_ENTRY_BYTES + payload;
+
+  pthread_mutex_lock(&journal->lock);
+  if (journal->pending_size + size > journal->pending_capacity) {
+    size_t capacity = journal->pending_capacity;
+    if (capacity == 0) {
+      capacity = 4096;
+    }
+    while (capacity < journal->pending_size + size) {
+      capacity *= 2;
+    }
+    unsigned char *grown =
+        (unsigned char *)realloc(journal->pending, capacity);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&journal->lock);
+      atomic_store(&journal->failed, 1);
+      return;
+    }
+    journal->pending = grown;
+    journal->pending_capacity = capacity;
+  }
+
+  unsigned char *entry = journal->pending + journal->pending_size;
+  entry[JOURNAL_ENTRY_BYTES] = (unsigned char)op;
+  if (stroke != NULL) {
+    writeStrokeRecord(entry + JOURNAL_ENTRY_BYTES + 1, stroke);
+  }
+  put32(entry, (unsigned int)payload);
+  put32(entry + 4, (unsigned int)crc32(0, entry + JOURNAL_ENTRY_BYTES,
+                                       (uInt)payload));
+  journal->pending_size += size;
+  pthread_mutex_unlock(&journal->lock);
+
+  pthread_cond_signal(&journal->wake);
+  atomic_fetch_add(&journal->size, (long long)size);
+}
+
+// Journals a committed stroke or clear, call after committing it
+void journalStroke(Journal *journal, const Stroke *stroke) {
+  if (stroke != NULL) {
+    appendEntry(journal, JOURNAL_STROKE, stroke);
+  }
+}
+
+void journalUndo(Journal *journal) { appendEntry(journal, JOURNAL_UNDO, NULL); }
+
+void journalRedo(Journal *journal) { appendEntry(journal, JOURNAL_REDO, NULL); }
+
+bool journalNeedsCompaction(const Journal *journal) {
+  return journal->enabled &&
+         atomic_load(&journal->size) > JOURNAL_COMPACT_BYTES;
+}
+
+// Hands the writer a snapshot of the session to replace the journal with.
+// Queued entries are dropped, the snapshot already holds them. A snapshot
+// has no room for undone strokes, so this waits until they can't be redone.
+void compactJournal(Journal *journal, Canvas *canvas, UndoHistory *history) {
+  if (history->redo_count > 0) {
+    return;
+  }
+  ProjectSnapshot *snapshot = captureProject(canvas, history);
+  if (snapshot == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal->lock);
+  if (journal->compaction != NULL) {
+    freeProjectSnapshot(journal->compaction);
+  }
+  journal->compaction = snapshot;
+  journal->pending_size = 0;
+  pthread_mutex_unlock(&journal->lock);
+
+  pthread_cond_signal(&journal->wake);
+  atomic_store(&journal->size, JOURNAL_HEADER_BYTES);
+}
+
+// Flushes what's queued & stops the writer. discard removes the journal &
+// its snapshot, for a clean exit.
+void closeJournal(Journal *journal, bool discard) {
+  if (!journal->enabled) {
+    return;
+  }
+  pthread_mutex_lock(&journal->lock);
+  journal->running = false;
+  pthread_mutex_unlock(&journal->lock);
+  pthread_cond_signal(&journal->wake);
+  pthread_join(journal->thread, NULL);
+
+  if (journal->compaction != NULL) {
+    freeProjectSnapshot(journal->compaction);
+  }
+  free(journal->pending);
+  pthread_mutex_destroy(&journal->lock);
+  pthread_cond_destroy(&journal->wake);
+  if (discard) {
+    remove(JOURNAL_FILE);
+    remove(JOURNAL_SNAPSHOT);
+  }
+  close(journal->fd);
+  journal->enabled = false;
+}
+//--------------------------------------------------------------------------------
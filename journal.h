@@ -0,0 +1,82 @@
+/*  --- journal ---
+ *
+ *  Crash-safe session journal. Every committed stroke, undo & redo is
+ *  appended to JOURNAL_FILE by a background writer, which batches writes &
+ *  fsyncs so the render loop never waits on the disk. Once the journal outgrows
+ *  JOURNAL_COMPACT_BYTES it's folded into a project snapshot, JOURNAL_SNAPSHOT,
+ *  and restarted empty.
+ *
+ *  A journal left behind by a crash is found on the next start: the snapshot
+ *  (or project) it continues from is opened and its operations replayed.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "history.h"
+#include "project.h"
+#include "raster.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define JOURNAL_FILE "cpaint-session.journal"
+#define JOURNAL_SNAPSHOT "cpaint-session.cpaint"
+#define JOURNAL_SYNC_MS 250             // Longest a commit waits for its fsync
+#define JOURNAL_COMPACT_BYTES (8 << 20) // Journal size that triggers a snapshot
+#define JOURNAL_MAX_SOURCE 1024         // Longest project path a journal keeps
+//--------------------------------------------------------------------------------
+
+// Operations a journal entry records
+typedef enum {
+  JOURNAL_STROKE = 1, // A committed stroke or clear, followed by its record
+  JOURNAL_UNDO = 2,   // Undo of the newest stroke
+  JOURNAL_REDO = 3,   // Redo of the last undone stroke
+} JournalOp;
+
+// Struct to store what a journal's header says about its session
+typedef struct {
+  int width;                       // Canvas width in pixels
+  int height;                      // Canvas height in pixels
+  int clear_color;                 // Palette index a blank canvas starts as
+  int background;                  // Palette index the clear key uses
+  unsigned long long generation;   // Snapshot it continues from, 0 for none
+  char source[JOURNAL_MAX_SOURCE]; // Project opened at the start, or ""
+  size_t valid_size;               // Bytes to resume after, 0 to start anew
+} JournalSession;
+
+// Struct to store an open journal & its writer thread
+typedef struct {
+  bool enabled;           // False if the journal couldn't be started
+  int fd;                 // Journal being appended to
+  pthread_t thread;       // Background writer
+  pthread_mutex_t lock;   // Guards everything down to compaction
+  pthread_cond_t wake;    // Signalled when there's work or on shutdown
+  bool running;           // Cleared to stop the writer
+  unsigned char *pending; // Entries queued by the render loop
+  size_t pending_size;    // Bytes queued
+  size_t pending_capacity;       // Bytes allocated for pending
+  ProjectSnapshot *compaction;   // Snapshot waiting to replace the journal
+  JournalSession session;        // Header of the journal being written
+  atomic_llong size;             // Journal bytes, queued entries included
+  atomic_int failed;             // Set once a write fails
+} Journal;
+
+// Recovery
+bool findJournal(JournalSession *session);
+bool recoverJournal(JournalSession *session, Project *project,
+                    bool *project_open, Canvas *canvas, UndoHistory *history);
+
+// Writing
+bool startJournal(Journal *journal, const JournalSession *session,
+                  bool resume);
+void journalStroke(Journal *journal, const Stroke *stroke);
+void journalUndo(Journal *journal);
+void journalRedo(Journal *journal);
+bool journalNeedsCompaction(const Journal *journal);
+void compactJournal(Journal *journal, Canvas *canvas, UndoHistory *history);
+void closeJournal(Journal *journal, bool discard);
+
+#endif
@@ -9,22 +9,61 @@
  *  brush:                'b'
  *  cycle brush shapes:   'tab'
  *  pencil:               'p'
+ *  fill:                 'f'
  *  increase brush size:  'scroll+ || + (=)'
  *  decrease brush size:  'scroll- || -'
  *  next color:           'down arrow || right arrow'
  *  previous color:       'up arrow || left arrow'
  *  save:                 'ctrl-s'
+ *  save project:         'ctrl-shift-s'  (open with ./cpaint file.cpaint)
+ *  cycle save format:    'ctrl-f'  (QOI, PNG fast, PNG, PNG small)
  *  undo:                 'ctrl-z'
- *  TODO: redo: 'ctrl-shift-z'
+ *  redo:                 'ctrl-shift-z'
+ *  pan:                  'middle mouse button'
+ *  zoom:                 'ctrl+scroll'
+ *  reset view:           '0'
+ *  frame timings:        'F3'
+ *
+ *  Undo history is capped at CPAINT_HISTORY_BYTES (256 MiB by default), the
+ *  oldest strokes are folded into the canvas they started from past that.
+ *  Committed strokes drop points their line passes within CPAINT_SIMPLIFY
+ *  pixels of (0.5 by default, 0 keeps every point), what they painted is
+ *  redrawn from the simplified stroke. Undo replays on CPAINT_REPLAY_THREADS
+ *  threads (0 for one per core), one by default.
+ *
+ *  Every stroke is journaled to cpaint-session.journal, if cpaint doesn't
+ *  exit cleanly the next start recovers the session from it.
+ *
+ *  CPAINT_INDEXED=1 keeps the canvas as a palette index per pixel rather
+ *  than RGBA, a quarter of the memory, expanded only for display & export.
+ *
+ *  CPAINT_RECORD=file records every frame's input on a new document to a
+ *  trace, CPAINT_REPLAY=file plays one back in place of the mouse & keyboard.
+ *
+ *  Resizing the window scales the canvas with it.
+ *
+ *  The window sleeps until input arrives while nothing's being painted,
+ *  saved or loaded, & only recomposites what changed. CPAINT_EVENT_WAIT=0
+ *  draws 120 frames a second regardless. Frame counts & CPU use are printed
+ *  on exit.
+ *
+ *  CPAINT_PROFILE=file.json times every part of every frame & writes them
+ *  as a Chrome trace on exit, for chrome://tracing or Perfetto.
+ *
+ *  ./cpaint --render [options] file... renders traces & projects to images
+ *  with no window, several at once; ./cpaint --render lists the options.
  *
  *  --- compile & run --
- *  clang -o cpaint paint.c -lraylib && ./cpaint
+ *  clang -o cpaint paint.c raster.c stroke.c history.c export.c project.c \
+ *    journal.c view.c fill.c trace.c app.c profile.c replay.c render.c \
+ *    resample.c -lraylib -lz -lm -lpthread && ./cpaint [project.cpaint]
+ *
+ *  --- benchmarks ---
+ *  see bench.c
  */
 
 // TODO: Choose background color in settings
-// TODO: maybe paint bucket too
 // TODO: hold shift to draw a straight line in pencil mode
-// TODO: allow for resizable window & scale canvas accordingly
 
 // FIX: I think theres a bug with undos. needs testing
 // yeah its buggy
@@ -33,553 +72,637 @@
 // & redraw the canvas by looping from first to last in the array
 
 // NOTE: definitely would like to optimize the code a little bit.
-
+#include "app.h"
+#include "history.h"
+#include "journal.h"
+#include "profile.h"
+#include "project.h"
+#include "raster.h"
+#include "render.h"
+#include "trace.h"
+#include "view.h"
 #include <raylib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-//-Definitions-&-Constants--------------------------------------------------------
-#define MAX_UNDOS 250        // Max undo steps allowed
-#define INITIAL_CAPACITY 100 // Starting capacity for points in a stroke
-#define NUM_COLORS 24        // The amount of colors available for use
-//--------------------------------------------------------------------------------
+#include <time.h>
 
 //-Variables----------------------------------------------------------------------
 int window_width = 1280;
 int window_height = 720;
-int cursor_radius = 64;
-int prev_radius;
-Vector2 mouse;
-Vector2 prev_mouse;
-Vector2 mouse_wheel;
-char *tool = "brush";
-char *brush_shape = "circle";
+int document_width = 1230;
+int document_height = 720;
 Color colors[NUM_COLORS] = {
     WHITE, RAYWHITE,  YELLOW,    GOLD,   ORANGE,     PINK,
     RED,   MAROON,    GREEN,     LIME,   DARKGREEN,  SKYBLUE,
     BLUE,  DARKBLUE,  PURPLE,    VIOLET, DARKPURPLE, BEIGE,
     BROWN, DARKBROWN, LIGHTGRAY, GRAY,   DARKGRAY,   BLACK};
 int background_color = 0;
-int selected_color;
-Rectangle color_rectangles[NUM_COLORS] = {};
-bool is_saving = false;
-int save_message_counter = 0;
 //--------------------------------------------------------------------------------
 
-// Struct to store a Point as a (Vector2){int x, y}
-typedef struct Vector2 Point;
-
-// Struct to store brush strokes
-typedef struct {
-  Point *points;   // Dynamic array of points in this stroke
-  int point_count; // Number of points currently stored
-  int max_points;  // Max capacity of *points array
-  char *tool;      // Tool being used 'pencil' or 'brush'
-  char *shape;     // Brush shape
-  int color;       // Color used
-  int radius;      // Radius used
-} Stroke;
-
-// Struct to store undo history
-typedef struct {
-  Stroke undos[MAX_UNDOS]; // Array to store undo steps up to defined max
-  int current_undo_index;  // Current position in undo history
-  int undo_count;          // Total amount of undo steps
-} UndoHistory;
-
-// Init a new Stroke with intiial capacity
-void initStroke(Stroke *stroke) {
-  stroke->points = (Point *)malloc(sizeof(Point) * INITIAL_CAPACITY);
-  stroke->point_count = 0;
-  stroke->max_points = INITIAL_CAPACITY;
-  stroke->color = selected_color;
-  stroke->radius = cursor_radius;
-  stroke->tool = tool;
-  stroke->shape = brush_shape;
+// raylib keys behind each InputKey, modifiers on either side
+static const int input_keys[NUM_INPUT_KEYS][2] = {
+    [INPUT_KEY_B] = {KEY_B, KEY_B},
+    [INPUT_KEY_C] = {KEY_C, KEY_C},
+    [INPUT_KEY_F] = {KEY_F, KEY_F},
+    [INPUT_KEY_P] = {KEY_P, KEY_P},
+    [INPUT_KEY_S] = {KEY_S, KEY_S},
+    [INPUT_KEY_Z] = {KEY_Z, KEY_Z},
+    [INPUT_KEY_ZERO] = {KEY_ZERO, KEY_ZERO},
+    [INPUT_KEY_EQUAL] = {KEY_EQUAL, KEY_EQUAL},
+    [INPUT_KEY_MINUS] = {KEY_MINUS, KEY_MINUS},
+    [INPUT_KEY_TAB] = {KEY_TAB, KEY_TAB},
+    [INPUT_KEY_UP] = {KEY_UP, KEY_UP},
+    [INPUT_KEY_DOWN] = {KEY_DOWN, KEY_DOWN},
+    [INPUT_KEY_LEFT] = {KEY_LEFT, KEY_LEFT},
+    [INPUT_KEY_RIGHT] = {KEY_RIGHT, KEY_RIGHT},
+    [INPUT_KEY_CTRL] = {KEY_LEFT_CONTROL, KEY_RIGHT_CONTROL},
+    [INPUT_KEY_SHIFT] = {KEY_LEFT_SHIFT, KEY_RIGHT_SHIFT},
+    [INPUT_KEY_ALT] = {KEY_LEFT_ALT, KEY_RIGHT_ALT},
+};
+
+// Samples the mouse & keyboard once for this frame
+static void readInput(InputFrame *input) {
+  Vector2 mouse = GetMousePosition();
+  Vector2 wheel = GetMouseWheelMoveV();
+  *input = (InputFrame){.mouse = {mouse.x, mouse.y},
+                        .wheel = {wheel.x, wheel.y}};
+  for (int key = 0; key < NUM_INPUT_KEYS; key++) {
+    if (IsKeyDown(input_keys[key][0]) || IsKeyDown(input_keys[key][1])) {
+      input->keys_down |= 1u << key;
+    }
+    if (IsKeyPressed(input_keys[key][0]) || IsKeyPressed(input_keys[key][1])) {
+      input->keys_pressed |= 1u << key;
+    }
+  }
+  if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+    input->buttons_down |= 1 << INPUT_BUTTON_LEFT;
+  }
+  if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
+    input->buttons_pressed |= 1 << INPUT_BUTTON_LEFT;
+  }
+  if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE)) {
+    input->buttons_down |= 1 << INPUT_BUTTON_MIDDLE;
+  }
+  if (IsMouseButtonPressed(MOUSE_BUTTON_MIDDLE)) {
+    input->buttons_pressed |= 1 << INPUT_BUTTON_MIDDLE;
+  }
 }
 
-// Init undo history
-void initHistory(UndoHistory *history) {
-  history->current_undo_index = -1;
-  history->undo_count = 0;
-  for (int i = 0; i < MAX_UNDOS; i++) {
-    history->undos[i].points = NULL;
-    history->undos[i].point_count = 0;
-    history->undos[i].max_points = 0;
-  }
+// Sends the part of the view that changed to the canvas texture
+static void uploadView(void *context, Bounds area, const Pixel *pixels) {
+  UpdateTextureRec(*(Texture2D *)context,
+                   (Rectangle){area.x0, area.y0, area.x1 - area.x0,
+                               area.y1 - area.y0},
+                   pixels);
 }
 
-// Adds a point to the current stroke, resizing if necessary
-void addToStroke(Stroke *stroke, int x, int y, int color, int radius,
-                 char *stroke_tool, char *shape) {
-  // Check if we need to resize points array
-  if (stroke->point_count >= stroke->max_points) {
-    stroke->max_points *= 2;
-    stroke->points =
-        (Point *)realloc(stroke->points, stroke->max_points * sizeof(Point));
-  }
-  // Add point to the stroke
-  stroke->points[stroke->point_count].x = x;
-  stroke->points[stroke->point_count].y = y;
-  stroke->point_count++;
-  stroke->color = color;
-  stroke->radius = radius;
-  stroke->tool = stroke_tool;
-  stroke->shape = shape;
+// Texture holding the whole view, stretched smoothly while a resize is
+// resampled
+static Texture2D loadViewTexture(const App *app) {
+  Image image = {.data = app->view_pixels,
+                 .width = app->view.width,
+                 .height = app->view.height,
+                 .mipmaps = 1,
+                 .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+  Texture2D texture = LoadTextureFromImage(image);
+  SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+  return texture;
 }
 
-void addUndoStep(UndoHistory *history, Stroke *stroke) {
-  // Advance to next undo step
-  history->current_undo_index = (history->current_undo_index + 1) % MAX_UNDOS;
-  if (history->undo_count < MAX_UNDOS) {
-    history->undo_count++;
-  }
+static Rectangle toRectangle(Rect rect) {
+  return (Rectangle){rect.x, rect.y, rect.width, rect.height};
+}
 
-  // Free any existing stroke points in the current undo slot
-  free(history->undos[history->current_undo_index].points);
+// Window pixels the frame timing overlay covers
+static Bounds profileOverlayBounds(void) {
+  return (Bounds){window_width - 208, 8, window_width - 8,
+                  36 + 18 * NUM_PHASES};
+}
 
-  // Allocate new memory for points in the undo history
-  history->undos[history->current_undo_index].points =
-      (Point *)malloc(stroke->point_count * sizeof(Point));
-  if (history->undos[history->current_undo_index].points == NULL) {
-    fprintf(stderr, "Failed to allocate memory for undo history\n");
-    exit(1);
+// Draws rolling p50 & p99 of every frame phase in the window's top right
+static void drawProfileOverlay(void) {
+  int x = window_width - 208;
+  DrawRectangle(x, 8, 200, 28 + 18 * NUM_PHASES, Fade(BLACK, 0.75f));
+  DrawText("phase", x + 8, 14, 10, LIGHTGRAY);
+  DrawText("p50 ms", x + 80, 14, 10, LIGHTGRAY);
+  DrawText("p99 ms", x + 140, 14, 10, LIGHTGRAY);
+  for (int phase = 0; phase < NUM_PHASES; phase++) {
+    double p50, p99;
+    phaseStats((Phase)phase, &p50, &p99);
+    // Anything past a 120 FPS frame stands out
+    Color color = p99 > 1000.0 / 120 ? ORANGE : RAYWHITE;
+    int y = 32 + 18 * phase;
+    char value[16];
+    DrawText(phase_names[phase], x + 8, y, 10, color);
+    snprintf(value, sizeof(value), "%.3f", p50);
+    DrawText(value, x + 80, y, 10, color);
+    snprintf(value, sizeof(value), "%.3f", p99);
+    DrawText(value, x + 140, y, 10, color);
   }
+}
 
-  // Copy the stroke data into the undo history
-  history->undos[history->current_undo_index].point_count = stroke->point_count;
-  history->undos[history->current_undo_index].max_points = stroke->point_count;
-  history->undos[history->current_undo_index].color = stroke->color;
-  history->undos[history->current_undo_index].radius = stroke->radius;
-  history->undos[history->current_undo_index].tool = stroke->tool;
-  history->undos[history->current_undo_index].shape = stroke->shape;
+// Draws the whole window bottom up, the caller clips it to what changed
+static void drawWindow(const App *app, const Texture2D *canvas_texture,
+                       bool show_profile) {
+  ClearBackground(RAYWHITE);
 
-  // Copy the points
-  memcpy(history->undos[history->current_undo_index].points, stroke->points,
-         stroke->point_count * sizeof(Point));
+  // Draw the canvas, the texture only differs from the view in size while
+  // a resize is resampled
+  DrawTexturePro(*canvas_texture,
+                 (Rectangle){0, 0, canvas_texture->width,
+                             canvas_texture->height},
+                 (Rectangle){SIDEBAR_WIDTH, 0, app->view.width,
+                             app->view.height},
+                 (Vector2){0, 0}, 0, WHITE);
+
+  //-Draw-mouse-guide---------------------------------------------------------------
+  Vector2 mouse = {app->mouse.x, app->mouse.y};
+  int cursor_radius = app->cursor_radius;
+  int selected_color = app->selected_color;
+  if (!boundsEmpty(app->guide)) {
+    // As painted at this zoom
+    float guide_radius = cursor_radius * app->view.zoom;
+
+    // Check tool in use
+    if (app->tool == TOOL_BRUSH) {
+
+      // Case circle vvv
+      if (app->brush_shape == SHAPE_CIRCLE) {
+        DrawCircleV(mouse, guide_radius, colors[selected_color]);
+        if (selected_color == NUM_COLORS - 1) {
+          DrawCircleLinesV(mouse, guide_radius + 1, LIGHTGRAY);
+        } else {
+          DrawCircleLinesV(mouse, guide_radius + 1, BLACK);
+        }
 
-  // Reinitialize stroke for the next pass
-  free(stroke->points);
-  initStroke(stroke);
-}
+        // Case square vvv
+      } else if (app->brush_shape == SHAPE_SQUARE) {
+        DrawRectangleV(
+            (Vector2){mouse.x - guide_radius, mouse.y - guide_radius},
+            (Vector2){guide_radius * 2, guide_radius * 2},
+            colors[selected_color]);
+        if (selected_color == NUM_COLORS - 1) {
+          DrawRectangleLines(mouse.x - guide_radius, mouse.y - guide_radius,
+                             guide_radius * 2 + 1, guide_radius * 2 + 1,
+                             LIGHTGRAY);
+        } else {
+          DrawRectangleLines(mouse.x - guide_radius, mouse.y - guide_radius,
+                             guide_radius * 2 + 1, guide_radius * 2 + 1,
+                             BLACK);
+        }
+
+        // Case triangle vvv
+      } else if (app->brush_shape == SHAPE_TRIANGLE) {
+        Vector2 v1 = (Vector2){mouse.x, mouse.y - guide_radius};
+        Vector2 v2 =
+            (Vector2){mouse.x - guide_radius * 1.3, mouse.y + guide_radius};
+        Vector2 v3 =
+            (Vector2){mouse.x + guide_radius * 1.3, mouse.y + guide_radius};
+
+        DrawTriangle(v1, v2, v3, colors[selected_color]);
+        if (selected_color == NUM_COLORS - 1) {
+          DrawTriangleLines((Vector2){v1.x, v1.y - 1},
+                            (Vector2){v2.x - 1, v2.y},
+                            (Vector2){v3.x + 1, v3.y}, LIGHTGRAY);
+        } else {
+          DrawTriangleLines((Vector2){v1.x, v1.y - 1},
+                            (Vector2){v2.x + 1, v2.y},
+                            (Vector2){v3.x - 1, v3.y}, BLACK);
+        }
+      }
 
-// Free memory in undo history
-void freeUndoHistory(UndoHistory *history) {
-  for (int i = 0; i < history->undo_count; i++) {
-    free(history->undos[i].points);
+    } else if (app->tool == TOOL_PENCIL) {
+      DrawRectangleV((Vector2){mouse.x - guide_radius / 2.0,
+                               mouse.y - guide_radius / 2.0},
+                     (Vector2){guide_radius, guide_radius},
+                     colors[selected_color]);
+
+      // Fill marks the seed pixel, it doesn't change with zoom
+    } else if (app->tool == TOOL_FILL) {
+      DrawRectangle(mouse.x - 4, mouse.y - 4, 9, 9, colors[selected_color]);
+      DrawRectangleLines(mouse.x - 5, mouse.y - 5, 11, 11,
+                         selected_color == NUM_COLORS - 1 ? LIGHTGRAY
+                                                          : BLACK);
+    }
   }
-}
-//--------------------------------------------------------------------------------
+  //--------------------------------------------------------------------------------
 
-//-MAIN-PROGRAM-ENTRY-POINT-------------------------------------------------------
-int main(void) {
+  //-Draw-the-sidebar---------------------------------------------------------------
+  DrawRectangle(0, 0, SIDEBAR_WIDTH - 2, window_height, LIGHTGRAY);
+  DrawRectangle(SIDEBAR_WIDTH - 2, 0, 2, window_height, GRAY);
 
-  char *filename = (char *)malloc(16 * sizeof(char));
+  // Draw the color selection rectangles
+  for (int i = 0; i < NUM_COLORS; i++) {
+    DrawRectangleRec(toRectangle(app->color_rectangles[i]), colors[i]);
+  }
+  if (app->color_hovered >= 0) {
+    DrawRectangleRec(toRectangle(app->color_rectangles[app->color_hovered]),
+                     Fade(WHITE, 0.6f));
+  }
 
-  //-Settings-----------------------------------------------------------------------
-  InitWindow(400, 300, "cpaint settings");
-  SetExitKey(KEY_ENTER);
+  // Draw save dialog if we are saving
+  if (app->is_saving) {
+    char saved_as[sizeof(app->save_message)];
+    int in_flight = savesInFlight(&app->saves);
+    if (in_flight > 0) {
+      snprintf(saved_as, sizeof(saved_as), "Saving %d image%s... %d%%",
+               in_flight, in_flight == 1 ? "" : "s",
+               saveProgress(&app->saves));
+    } else {
+      snprintf(saved_as, sizeof(saved_as), "%s", app->save_message);
+    }
 
-  char *window_height_string = (char *)malloc(24 * sizeof(char));
-  char *window_width_string = (char *)malloc(24 * sizeof(char));
+    DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(),
+                  Fade(RAYWHITE, 0.8f));
+    DrawRectangle(0, 150, GetScreenWidth(), 80, BLACK);
+    DrawText(saved_as, (window_width / 2) - MeasureText(saved_as, 20) / 2,
+             180, 20, RAYWHITE);
+  }
 
-  while (!WindowShouldClose()) {
-    BeginDrawing();
-    ClearBackground(RAYWHITE);
+  if (show_profile) {
+    drawProfileOverlay();
+  }
+}
 
-    int monitor = GetCurrentMonitor();
+//-MAIN-PROGRAM-ENTRY-POINT-------------------------------------------------------
+int main(int argc, char **argv) {
 
-    sprintf(window_width_string, "document width: %d", window_width);
-    if (IsKeyDown(KEY_RIGHT) &&
-        window_width <= GetMonitorWidth(monitor) * 0.9) {
-      window_width++;
-    } else if (IsKeyDown(KEY_LEFT) && window_width >= 401) {
-      window_width--;
-    }
+  // Batch rendering opens no window at all
+  if (argc > 1 && strcmp(argv[1], "--render") == 0) {
+    return renderCommand(argc - 2, argv + 2);
+  }
 
-    sprintf(window_height_string, "document height: %d", window_height);
-    if (IsKeyDown(KEY_UP) && window_height <= GetMonitorHeight(monitor) * 0.8) {
-      window_height++;
-    } else if (IsKeyDown(KEY_DOWN) && window_height >= 301) {
-      window_height--;
+  //-Settings-----------------------------------------------------------------------
+  // A replayed trace brings its own window & blank document, and leaves the
+  // session journal alone
+  Trace replay;
+  bool replaying = getenv("CPAINT_REPLAY") != NULL;
+  if (replaying) {
+    if (!openTrace(&replay, getenv("CPAINT_REPLAY"))) {
+      fprintf(stderr, "Failed to open trace %s\n", getenv("CPAINT_REPLAY"));
+      return 1;
     }
+    window_width = replay.window_width;
+    window_height = replay.window_height;
+    document_width = replay.document_width;
+    document_height = replay.document_height;
+  }
 
-    // Escape key cancels program and frees malloc
-    if (IsKeyPressed(KEY_ESCAPE)) {
-      CloseWindow();
-      free(window_height_string);
-      free(window_width_string);
-      return 0;
+  Project project;
+  JournalSession session;
+  bool recovering = !replaying && findJournal(&session);
+  bool project_open = !replaying && !recovering && argc > 1;
+  if (replaying) {
+    // Sizes come from the trace
+  } else if (recovering) {
+    // A crashed session takes priority, its journal would be lost otherwise
+    if (argc > 1) {
+      fprintf(stderr, "Recovering the last session, not opening %s\n",
+              argv[1]);
     }
+    document_width = session.width;
+    document_height = session.height;
+    background_color = session.background;
+  } else if (project_open) {
+    // Opening a project maps it, the tiles are decoded once drawn
+    if (!openProject(&project, argv[1])) {
+      fprintf(stderr, "Failed to open project %s\n", argv[1]);
+      return 1;
+    }
+    document_width = project.width;
+    document_height = project.height;
+  } else {
+    InitWindow(400, 300, "cpaint settings");
+    SetExitKey(KEY_ENTER);
+
+    char *window_height_string = (char *)malloc(24 * sizeof(char));
+    char *window_width_string = (char *)malloc(24 * sizeof(char));
+
+    while (!WindowShouldClose()) {
+      BeginDrawing();
+      ClearBackground(RAYWHITE);
+
+      // Documents may outgrow the screen, the window pans over them. Shift
+      // steps a tile at a time.
+      int step =
+          IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT) ? TILE_SIZE
+                                                                  : 1;
+
+      sprintf(window_width_string, "document width: %d", document_width);
+      if (IsKeyDown(KEY_RIGHT) && document_width + step <= CANVAS_MAX_SIDE) {
+        document_width += step;
+      } else if (IsKeyDown(KEY_LEFT) && document_width - step >= 350) {
+        document_width -= step;
+      }
+
+      sprintf(window_height_string, "document height: %d", document_height);
+      if (IsKeyDown(KEY_UP) && document_height + step <= CANVAS_MAX_SIDE) {
+        document_height += step;
+      } else if (IsKeyDown(KEY_DOWN) && document_height - step >= 300) {
+        document_height -= step;
+      }
 
-    // Draw window dimensions selection
-    DrawText(window_width_string, 4, 4, 20, GRAY);
-    DrawText(window_height_string, 4, 28, 20, GRAY);
+      // Escape key cancels program and frees malloc
+      if (IsKeyPressed(KEY_ESCAPE)) {
+        CloseWindow();
+        free(window_height_string);
+        free(window_width_string);
+        return 0;
+      }
 
-    // TODO: draw the background color squares
-    /*DrawText("Select background color", 4, 56, 20, GRAY);*/
-    /*for (int i = 0; i < NUM_COLORS - 1; i++) {*/
-    /**/
-    /*}*/
+      // Draw window dimensions selection
+      DrawText(window_width_string, 4, 4, 20, GRAY);
+      DrawText(window_height_string, 4, 28, 20, GRAY);
+      DrawText("hold 'shift' for bigger steps", 4, 52, 20, GRAY);
 
-    DrawText("press 'enter' to accept", 4, 256 - 4, 20, GRAY);
-    DrawText("press 'esc' to cancel", 4, 280 - 4, 20, GRAY);
+      // TODO: draw the background color squares
+      /*DrawText("Select background color", 4, 56, 20, GRAY);*/
+      /*for (int i = 0; i < NUM_COLORS - 1; i++) {*/
+      /**/
+      /*}*/
 
-    EndDrawing();
-  }
-  CloseWindow();
+      DrawText("press 'enter' to accept", 4, 256 - 4, 20, GRAY);
+      DrawText("press 'esc' to cancel", 4, 280 - 4, 20, GRAY);
 
-  free(window_height_string);
-  free(window_width_string);
+      EndDrawing();
+    }
+    CloseWindow();
+
+    free(window_height_string);
+    free(window_width_string);
+  }
   //--------------------------------------------------------------------------------
 
   //-Initialization-----------------------------------------------------------------
-  SetConfigFlags(FLAG_WINDOW_UNDECORATED);
-  /*SetConfigFlags(FLAG_WINDOW_RESIZABLE);*/
+  // Traces don't record resizes, so a window recording or replaying one
+  // keeps its size. Resizable windows get a frame to drag.
+  bool resizable = !replaying && getenv("CPAINT_RECORD") == NULL;
+  SetConfigFlags(resizable ? FLAG_WINDOW_RESIZABLE : FLAG_WINDOW_UNDECORATED);
   InitWindow(window_width, window_height, "cpaint");
 
-  RenderTexture2D canvas = LoadRenderTexture(window_width - 50, window_height);
-
-  // Init background color
-  BeginTextureMode(canvas);
-  ClearBackground(RAYWHITE);
-  EndTextureMode();
-  SetTargetFPS(120);
+  // The window fits the document up to most of the screen, beyond that the
+  // view pans & zooms over it. A replay keeps the window it was recorded in.
+  int monitor = GetCurrentMonitor();
+  if (!replaying) {
+    window_width = document_width + SIDEBAR_WIDTH;
+    window_height = document_height;
+    if (GetMonitorWidth(monitor) > 0 &&
+        window_width > GetMonitorWidth(monitor) * 0.9) {
+      window_width = GetMonitorWidth(monitor) * 0.9;
+    }
+    if (GetMonitorHeight(monitor) > 0 &&
+        window_height > GetMonitorHeight(monitor) * 0.8) {
+      window_height = GetMonitorHeight(monitor) * 0.8;
+    }
+  }
+  SetWindowSize(window_width, window_height);
+  if (resizable) {
+    SetWindowMinSize(SIDEBAR_WIDTH + 128, 300); // Room for every swatch
+  }
 
-  for (int i = 0; i < NUM_COLORS; i++) {
-    color_rectangles[i].x = 4;
-    color_rectangles[i].y = 4 + (window_height / 30.0) * i + 2 * i;
-    color_rectangles[i].width = 40;
-    color_rectangles[i].height = window_height / 30.0;
+  // Strokes are rasterized on the CPU & uploaded to canvas_texture
+  App app;
+  size_t history_budget = HISTORY_BUDGET;
+  if (getenv("CPAINT_HISTORY_BYTES")) {
+    history_budget = strtoull(getenv("CPAINT_HISTORY_BYTES"), NULL, 10);
+  }
+  initHistory(&app.history, document_width, document_height, history_budget,
+              recovering ? session.clear_color : 1); // RAYWHITE for new ones
+  bool recovered = recovering && recoverJournal(&session, &project,
+                                                &project_open, &app.canvas,
+                                                &app.history);
+  if (recovering && !recovered) {
+    fprintf(stderr, "Failed to recover the last session\n");
+  }
+  if (recovered) {
+    // Canvas & history come from the journal
+  } else if (!project_open) {
+    initCanvas(&app.canvas, document_width, document_height, 1); // RAYWHITE
+  } else if (!attachProject(&project, &app.canvas, &app.history)) {
+    // Tiles still load, only the strokes past the damage are lost
+    fprintf(stderr, "Project %s is damaged, some strokes can't be undone\n",
+            argv[1]);
   }
 
-  selected_color = 23; // BLACK by default
-  int color_hovered = -1;
+  // Checkpoint interval can be tuned without a rebuild
+  if (getenv("CPAINT_CHECKPOINT_STROKES")) {
+    app.history.checkpoint_strokes = atoi(getenv("CPAINT_CHECKPOINT_STROKES"));
+  }
+  if (getenv("CPAINT_CHECKPOINT_BYTES")) {
+    app.history.checkpoint_bytes = atoi(getenv("CPAINT_CHECKPOINT_BYTES"));
+  }
+  if (getenv("CPAINT_SIMPLIFY")) {
+    app.history.tolerance = strtof(getenv("CPAINT_SIMPLIFY"), NULL);
+  }
+  if (getenv("CPAINT_REPLAY_THREADS")) {
+    app.history.replay_threads = atoi(getenv("CPAINT_REPLAY_THREADS"));
+  }
+  if (getenv("CPAINT_INDEXED") && atoi(getenv("CPAINT_INDEXED"))) {
+    convertCanvas(&app.canvas, true);
+    convertCanvas(historyBase(&app.history), true);
+  }
 
-  UndoHistory history;
-  Stroke stroke;
-  initStroke(&stroke);
-  initHistory(&history);
-  //--------------------------------------------------------------------------------
+  // The texture only holds what the view shows, whatever the document size
+  initApp(&app, window_width, window_height, background_color);
+  Texture2D canvas_texture = loadViewTexture(&app);
+  app.upload = uploadView;
+  app.upload_context = &canvas_texture;
+  SetTargetFPS(120);
 
-  //-Main-Loop----------------------------------------------------------------------
-  while (!WindowShouldClose()) {
-    //-Update-------------------------------------------------------------------------
-    mouse = GetMousePosition();
-    mouse_wheel = GetMouseWheelMoveV();
-
-    // Select tool with B (brush) or P (pencil) (default B brush)
-    if (IsKeyPressed(KEY_P) && strcmp(tool, "pencil") != 0) {
-      tool = "pencil";
-      prev_radius = cursor_radius;
-      cursor_radius = 4;
-    } else if (IsKeyPressed(KEY_B) && strcmp(tool, "brush") != 0) {
-      tool = "brush";
-      if (prev_radius) {
-        cursor_radius = prev_radius;
+  // The window is composited into frame, only what changed is drawn again
+  RenderTexture2D frame = LoadRenderTexture(window_width, window_height);
+
+  // An idle window waits on input rather than drawing 120 frames a second,
+  // unless CPAINT_EVENT_WAIT=0. A replay has no input to wait on.
+  bool event_waiting = !replaying && !(getenv("CPAINT_EVENT_WAIT") &&
+                                       !atoi(getenv("CPAINT_EVENT_WAIT")));
+  bool waiting = false;
+  long drawn_frames = 0;
+  long recomposited_frames = 0;
+  long long recomposited_pixels = 0;
+  clock_t cpu_start = clock();
+
+  // Journal every commit, a crash loses at most JOURNAL_SYNC_MS of work
+  Journal journal;
+  if (!replaying) {
+    if (!recovered) {
+      session = (JournalSession){.width = app.canvas.width,
+                                 .height = app.canvas.height,
+                                 .clear_color = 1,
+                                 .background = background_color};
+      if (project_open) {
+        snprintf(session.source, sizeof(session.source), "%s", argv[1]);
       }
     }
+    startJournal(&journal, &session, recovered && session.valid_size > 0);
+    app.journal = &journal;
+  }
 
-    // Clear canvas with C
-    if (IsKeyPressed(KEY_C)) {
-      BeginTextureMode(canvas);
-      ClearBackground(colors[0]);
-      EndTextureMode();
-    }
+  // Time every frame for a Chrome trace, the overlay only times them while
+  // it's shown
+  const char *profile_file = getenv("CPAINT_PROFILE");
+  bool show_profile = false;
+  if (profile_file != NULL) {
+    startProfile(true);
+  }
 
-    // Update cursor size on scroll for brush
-    if (strcmp(tool, "brush") == 0) {
-      if ((mouse_wheel.y > 0 || IsKeyPressed(KEY_EQUAL)) &&
-          cursor_radius <= 256) {
-        cursor_radius += 8;
-      } else if ((mouse_wheel.y < 0 || IsKeyPressed(KEY_MINUS)) &&
-                 cursor_radius > 8) {
-        cursor_radius -= 8;
-      } else if ((mouse_wheel.y < 0 || IsKeyPressed(KEY_MINUS)) &&
-                 cursor_radius <= 8) {
-        cursor_radius = 4;
-      }
-    }
-    // Update cursor size on scroll for pencil
-    if (strcmp(tool, "pencil") == 0) {
-      if ((mouse_wheel.y > 0 || IsKeyPressed(KEY_EQUAL)) &&
-          cursor_radius <= 6) {
-        cursor_radius += 2;
-      } else if ((mouse_wheel.y < 0 || IsKeyPressed(KEY_MINUS)) &&
-                 cursor_radius > 2) {
-        cursor_radius -= 2;
-      } else if ((mouse_wheel.y < 0 || IsKeyPressed(KEY_MINUS)) &&
-                 cursor_radius <= 2) {
-        cursor_radius = 2;
-      }
+  // Record every frame's input with CPAINT_RECORD=file, traces replay onto
+  // a blank document so sessions that open one aren't recorded
+  Trace record;
+  bool recording = false;
+  if (getenv("CPAINT_RECORD") && (recovered || project_open)) {
+    fprintf(stderr, "Not recording, traces start from a blank document\n");
+  } else if (getenv("CPAINT_RECORD")) {
+    recording = createTrace(&record, getenv("CPAINT_RECORD"), window_width,
+                            window_height, document_width, document_height);
+    if (!recording) {
+      fprintf(stderr, "Failed to create trace %s\n", getenv("CPAINT_RECORD"));
     }
+  }
+  //--------------------------------------------------------------------------------
 
-    // Cycle through colors with arrow keys
-    if (IsKeyPressed(KEY_DOWN) || IsKeyPressed(KEY_RIGHT)) {
-      if (selected_color == NUM_COLORS - 1) {
-        selected_color = 0;
-      } else
-        selected_color++;
-    }
-    if (IsKeyPressed(KEY_UP) || IsKeyPressed(KEY_LEFT)) {
-      if (selected_color == 0) {
-        selected_color = NUM_COLORS - 1;
-      } else
-        selected_color--;
+  //-Main-Loop----------------------------------------------------------------------
+  while (!WindowShouldClose()) {
+    //-Update-------------------------------------------------------------------------
+    // Input comes from the trace being replayed, or the mouse & keyboard
+    double frame_start = beginPhase();
+
+    // The layout follows a resized window at once, the canvas catches up
+    // once its view is resampled
+    if (IsWindowResized()) {
+      resizeApp(&app, GetScreenWidth(), GetScreenHeight());
+      window_width = app.window_width;
+      window_height = app.window_height;
+      UnloadRenderTexture(frame);
+      frame = LoadRenderTexture(window_width, window_height);
     }
 
-    // Select colors with mouse
-    for (int i = 0; i < NUM_COLORS; i++) {
-      if (CheckCollisionPointRec(mouse, color_rectangles[i])) {
-        color_hovered = i;
-
-        if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
-          selected_color = i;
-        }
+    InputFrame input;
+    if (replaying) {
+      if (!readTraceFrame(&replay, &input)) {
+        break;
       }
+    } else {
+      readInput(&input);
     }
-    if (!CheckCollisionPointRec(mouse, color_rectangles[color_hovered])) {
-      color_hovered = -1;
+    if (recording && !writeTraceFrame(&record, &input)) {
+      fprintf(stderr, "Failed to write trace, recording stopped\n");
+      closeTrace(&record);
+      recording = false;
     }
+    updateApp(&app, &input);
 
-    // Cycle through shapes with tab
-    if (IsKeyPressed(KEY_TAB) && strcmp(tool, "brush") == 0) {
-      if (strcmp(brush_shape, "circle") == 0) {
-        brush_shape = "square";
-      } else if (strcmp(brush_shape, "square") == 0) {
-        brush_shape = "triangle";
-      } else if (strcmp(brush_shape, "triangle") == 0) {
-        brush_shape = "circle";
-      }
+    // A resampled view comes whole, at the view's new size
+    if (app.view_resized) {
+      UnloadTexture(canvas_texture);
+      canvas_texture = loadViewTexture(&app);
+      app.view_resized = false;
     }
 
-    //-Update-canvas------------------------------------------------------------------
-    // update canvas on mouse click
-    Vector2 canvas_mouse = (Vector2){mouse.x - 50, mouse.y};
-    Vector2 canvas_prev_mouse = (Vector2){prev_mouse.x - 50, prev_mouse.y};
-
-    // If mouse && prev mouse are on the canvas
-    if (canvas_mouse.x > 0 && canvas_prev_mouse.x &&
-        IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
-      BeginTextureMode(canvas);
-      addToStroke(&stroke, canvas_mouse.x, canvas_mouse.y, selected_color,
-                  cursor_radius, tool, brush_shape);
-
-      // Check if tool is pencil
-      if (strcmp(tool, "pencil") == 0) {
-        DrawLineEx(canvas_prev_mouse, canvas_mouse, cursor_radius,
-                   colors[selected_color]);
-      } else if (strcmp(tool, "brush") == 0) { // Check if tool is brush
-
-        // Check brush shape for circle square or triangle
-        if (strcmp(brush_shape, "circle") == 0) {
-          DrawCircleV(canvas_mouse, cursor_radius, colors[selected_color]);
-        } else if (strcmp(brush_shape, "square") == 0) {
-          DrawRectangleV((Vector2){canvas_mouse.x - cursor_radius,
-                                   canvas_mouse.y - cursor_radius},
-                         (Vector2){cursor_radius * 2, cursor_radius * 2},
-                         colors[selected_color]);
-        } else if (strcmp(brush_shape, "triangle") == 0) {
-          Vector2 v1 =
-              (Vector2){canvas_mouse.x, canvas_mouse.y - cursor_radius};
-          Vector2 v2 = (Vector2){canvas_mouse.x - cursor_radius * 1.3,
-                                 canvas_mouse.y + cursor_radius};
-          Vector2 v3 = (Vector2){canvas_mouse.x + cursor_radius * 1.3,
-                                 canvas_mouse.y + cursor_radius};
-
-          DrawTriangle(v1, v2, v3, colors[selected_color]);
-        }
+    // Toggle the frame timing overlay with 'F3'
+    bool profile_toggled = IsKeyPressed(KEY_F3);
+    if (profile_toggled) {
+      show_profile = !show_profile;
+      if (show_profile && !profiling) {
+        startProfile(false);
+      } else if (!show_profile && profile_file == NULL) {
+        stopProfile();
       }
-
-      EndTextureMode();
-    } else if (stroke.point_count > 0) {
-      addUndoStep(&history, &stroke);
     }
-    prev_mouse = GetMousePosition();
-    //--------------------------------------------------------------------------------
-
-    // Save file with 'ctrl-s'
-    if (!is_saving &&
-        (IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL)) &&
-        IsKeyPressed(KEY_S)) {
-      int r = rand();
-      sprintf(filename, "%d.png", r);
-
-      Image canvas_image = LoadImageFromTexture(canvas.texture);
-      ImageFlipVertical(&canvas_image);
-      ExportImage(canvas_image, filename);
 
-      is_saving = true;
-    }
-    if (is_saving) {
-      save_message_counter++;
-      if (save_message_counter >= 240) {
-        is_saving = false;
-        save_message_counter = 0;
+    // Sleep in EndDrawing until input arrives once nothing's under way, the
+    // overlay keeps timing frames at full rate while it's up
+    bool idle = event_waiting && !app.active && !show_profile;
+    if (idle != waiting) {
+      if (idle) {
+        EnableEventWaiting();
+      } else {
+        DisableEventWaiting();
       }
+      waiting = idle;
     }
-
-    // Handle undo with 'ctrl-z'
-    if ((IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL)) &&
-        IsKeyPressed(KEY_Z)) {
-      if (history.undo_count > 0) {
-        // Remove the last stroke
-        history.undo_count--;
-        history.current_undo_index =
-            (history.current_undo_index - 1 + MAX_UNDOS) % MAX_UNDOS;
-
-        // Redraw the canvas
-        BeginTextureMode(canvas);
-        ClearBackground(colors[0]);
-        for (int i = 0; i < history.undo_count; i++) {
-          int index = (history.current_undo_index - i + MAX_UNDOS) % MAX_UNDOS;
-          Stroke *s = &history.undos[index];
-
-          // Check for brush tool
-          if (strcmp(s->tool, "brush") == 0) {
-            for (int j = 1; j < s->point_count; j++) {
-              if (strcmp(s->shape, "circle") == 0) {
-                DrawCircleV((Vector2){s->points[j - 1].x, s->points[j - 1].y},
-                            s->radius, colors[s->color]);
-              } else if (strcmp(s->shape, "square") == 0) {
-                DrawRectangleV((Vector2){s->points[j - 1].x - s->radius,
-                                         s->points[j - 1].y - s->radius},
-                               (Vector2){s->radius * 2, s->radius * 2},
-                               colors[s->color]);
-              } else if (strcmp(s->shape, "triangle") == 0) {
-                Vector2 v1 = (Vector2){s->points[j - 1].x,
-                                       s->points[j - 1].y - cursor_radius};
-                Vector2 v2 = (Vector2){s->points[j - 1].x - cursor_radius * 1.3,
-                                       s->points[j - 1].y + cursor_radius};
-                Vector2 v3 = (Vector2){s->points[j - 1].x + cursor_radius * 1.3,
-                                       s->points[j - 1].y + cursor_radius};
-                DrawTriangle(v1, v2, v3, colors[s->color]);
-              }
-            }
-
-            // Check for pencil tool
-          } else if (strcmp(s->tool, "pencil") == 0) {
-            for (int j = 1; j < s->point_count; j++) {
-              DrawLineEx(s->points[j - 1], s->points[j], s->radius,
-                         colors[s->color]);
-            }
-          }
-        }
-        EndTextureMode();
-      }
-    }
-
     //--------------------------------------------------------------------------------
 
     //-Draw---------------------------------------------------------------------------
-    BeginDrawing();
-    ClearBackground(RAYWHITE);
-
-    // Draw the canvas
-    DrawTextureRec(canvas.texture,
-                   (Rectangle){0, 0, (float)canvas.texture.width,
-                               (float)-canvas.texture.height},
-                   (Vector2){50, 0}, WHITE);
-
-    //-Draw-mouse-guide---------------------------------------------------------------
-    if (mouse.x > 50 &&
-        (!IsKeyDown(KEY_LEFT_ALT) && !IsKeyDown(KEY_RIGHT_ALT))) {
-      HideCursor();
-
-      // Check tool in use
-      if (strcmp(tool, "brush") == 0) {
-
-        // Case circle vvv
-        if (strcmp(brush_shape, "circle") == 0) {
-          DrawCircleV(mouse, cursor_radius, colors[selected_color]);
-          if (selected_color == NUM_COLORS - 1) {
-            DrawCircleLinesV(mouse, cursor_radius + 1, LIGHTGRAY);
-          } else {
-            DrawCircleLinesV(mouse, cursor_radius + 1, BLACK);
-          }
-
-          // Case square vvv
-        } else if (strcmp(brush_shape, "square") == 0) {
-          DrawRectangleV(
-              (Vector2){mouse.x - cursor_radius, mouse.y - cursor_radius},
-              (Vector2){cursor_radius * 2, cursor_radius * 2},
-              colors[selected_color]);
-          if (selected_color == NUM_COLORS - 1) {
-            DrawRectangleLines(mouse.x - cursor_radius, mouse.y - cursor_radius,
-                               cursor_radius * 2 + 1, cursor_radius * 2 + 1,
-                               LIGHTGRAY);
-          } else {
-            DrawRectangleLines(mouse.x - cursor_radius, mouse.y - cursor_radius,
-                               cursor_radius * 2 + 1, cursor_radius * 2 + 1,
-                               BLACK);
-          }
-
-          // Case triangle vvv
-        } else if (strcmp(brush_shape, "triangle") == 0) {
-          Vector2 v1 = (Vector2){mouse.x, mouse.y - cursor_radius};
-          Vector2 v2 =
-              (Vector2){mouse.x - cursor_radius * 1.3, mouse.y + cursor_radius};
-          Vector2 v3 =
-              (Vector2){mouse.x + cursor_radius * 1.3, mouse.y + cursor_radius};
-
-          DrawTriangle(v1, v2, v3, colors[selected_color]);
-          if (selected_color == NUM_COLORS - 1) {
-            DrawTriangleLines((Vector2){v1.x, v1.y - 1},
-                              (Vector2){v2.x - 1, v2.y},
-                              (Vector2){v3.x + 1, v3.y}, LIGHTGRAY);
-          } else {
-            DrawTriangleLines((Vector2){v1.x, v1.y - 1},
-                              (Vector2){v2.x + 1, v2.y},
-                              (Vector2){v3.x - 1, v3.y}, BLACK);
-          }
-        }
-
-      } else if (strcmp(tool, "pencil") == 0) {
-        DrawRectangleV((Vector2){mouse.x - cursor_radius / 2.0,
-                                 mouse.y - cursor_radius / 2.0},
-                       (Vector2){cursor_radius, cursor_radius},
-                       colors[selected_color]);
-      }
-    } else
-      ShowCursor();
-    //--------------------------------------------------------------------------------
-
-    //-Draw-the-sidebar---------------------------------------------------------------
-    DrawRectangle(0, 0, 48, window_height, LIGHTGRAY);
-    DrawRectangle(48, 0, 2, window_height, GRAY);
-
-    // Draw the color selection rectangles
-    for (int i = 0; i < NUM_COLORS; i++) {
-      DrawRectangleRec(color_rectangles[i], colors[i]);
+    // Only what changed is composited again, into a texture that keeps the
+    // rest from earlier frames. The damage is redrawn bottom up, so overlays
+    // blend over the same pixels they did the first time.
+    double draw_start = beginPhase();
+    Bounds damage = app.damage;
+    if (show_profile || profile_toggled) {
+      damage = unionBounds(damage, profileOverlayBounds());
     }
-    if (color_hovered >= 0) {
-      DrawRectangleRec(color_rectangles[color_hovered], Fade(WHITE, 0.6f));
+    if (!boundsEmpty(damage)) {
+      BeginTextureMode(frame);
+      BeginScissorMode(damage.x0, damage.y0, damage.x1 - damage.x0,
+                       damage.y1 - damage.y0);
+      drawWindow(&app, &canvas_texture, show_profile);
+      EndScissorMode();
+      EndTextureMode();
+      app.damage = emptyBounds();
+      recomposited_frames++;
+      recomposited_pixels +=
+          (long long)(damage.x1 - damage.x0) * (damage.y1 - damage.y0);
     }
-
-    // Draw save dialog if we are saving
-    if (is_saving) {
-
-      char *saved_as = malloc(24 * sizeof(char));
-      strcat(saved_as, "Image saved: ");
-      strcat(saved_as, filename);
-
-      DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(),
-                    Fade(RAYWHITE, 0.8f));
-      DrawRectangle(0, 150, GetScreenWidth(), 80, BLACK);
-      DrawText(saved_as, (window_width / 2) - MeasureText(saved_as, 20) / 2,
-               180, 20, RAYWHITE);
+    if (boundsEmpty(app.guide)) {
+      ShowCursor();
+    } else {
+      HideCursor();
     }
 
+    // Frame colors are final already, the copy mustn't blend them again.
+    // Render textures are stored bottom up.
+    BeginDrawing();
+    ClearBackground(BLACK);
+    BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+    DrawTextureRec(frame.texture,
+                   (Rectangle){0, 0, window_width, -window_height},
+                   (Vector2){0, 0}, WHITE);
+    EndBlendMode();
+    drawn_frames++;
+
+    // Waiting on the next frame isn't part of it
+    endPhase(PHASE_DRAW, draw_start);
+    endPhase(PHASE_FRAME, frame_start);
     EndDrawing();
     //--------------------------------------------------------------------------------
   }
 
   //-De-Initialization--------------------------------------------------------------
-  free(filename);
-  free(stroke.points);
-  freeUndoHistory(&history);
-  UnloadRenderTexture(canvas);
+  if (replaying) {
+    printf("Replayed %ld frames\n", replay.frames);
+    closeTrace(&replay);
+  }
+  if (recording) {
+    closeTrace(&record);
+  }
+  printHistoryStats(stdout, &app.history);
+
+  // What the window cost, idle or not
+  double seconds = GetTime();
+  double cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+  printf("Frames: %ld drawn, %ld recomposited, %.1f%% of the window each\n",
+         drawn_frames, recomposited_frames,
+         recomposited_frames > 0
+             ? 100.0 * recomposited_pixels / recomposited_frames /
+                   ((double)window_width * window_height)
+             : 0.0);
+  printf("CPU: %.2f s over %.2f s (%.1f%%)\n", cpu_seconds, seconds,
+         seconds > 0 ? 100.0 * cpu_seconds / seconds : 0.0);
+  if (profile_file != NULL && !writeProfile(profile_file)) {
+    fprintf(stderr, "Failed to write profile %s\n", profile_file);
+  }
+  freeProfile();
+  if (app.journal != NULL) {
+    closeJournal(&journal, true); // Clean exit, nothing to recover
+  }
+  UnloadRenderTexture(frame);
+  UnloadTexture(canvas_texture);
+  freeApp(&app);
+  if (project_open) {
+    closeProject(&project);
+  }
   CloseWindow();
   //--------------------------------------------------------------------------------
 
@@ -0,0 +1,145 @@
+/*  --- profile ---
+ *
+ *  Phase timers & their Chrome trace_event export. Trace files are a JSON
+ *  object holding a "traceEvents" array of complete ("X") events, times in
+ *  microseconds from when profiling started.
+ */
+
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *phase_names[NUM_PHASES] = {"frame", "update", "canvas", "undo",
+                                       "save",  "view",   "draw"};
+bool profiling = false;
+
+// Struct to store one timed phase for the trace
+typedef struct {
+  double start;        // Milliseconds since the profile started
+  float duration;      // Milliseconds
+  unsigned char phase; // A Phase
+} PhaseEvent;
+
+// Everything timed so far
+static struct {
+  double origin;                             // When the profile started
+  double recent[NUM_PHASES][PROFILE_WINDOW]; // Last durations, a ring
+  int recent_count[NUM_PHASES];              // Durations in the ring
+  int recent_next[NUM_PHASES];               // Where the next one goes
+  bool keep_events;                          // Trace events are kept
+  PhaseEvent *events;                        // Every phase timed, in order
+  int event_count;                           // Events kept
+  int event_capacity;                        // Events allocated
+  long long dropped;                         // Events past the cap
+} profile;
+
+// Monotonic time in milliseconds
+double profileNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Starts timing phases from a clean slate, keeping every phase run for
+// writeProfile if keep_events is set
+void startProfile(bool keep_events) {
+  free(profile.events);
+  memset(&profile, 0, sizeof(profile));
+  profile.origin = profileNow();
+  profile.keep_events = keep_events;
+  profiling = true;
+}
+
+// Stops timing, what was timed stays around for phaseStats & writeProfile
+void stopProfile(void) { profiling = false; }
+
+void freeProfile(void) {
+  profiling = false;
+  free(profile.events);
+  profile.events = NULL;
+  profile.event_count = 0;
+  profile.event_capacity = 0;
+}
+
+// Records a phase that began at start & ends now. Phases begun before
+// profiling started aren't recorded.
+void recordPhase(Phase phase, double start) {
+  if (start == 0) {
+    return;
+  }
+  double end = profileNow();
+  profile.recent[phase][profile.recent_next[phase]] = end - start;
+  profile.recent_next[phase] = (profile.recent_next[phase] + 1) %
+                               PROFILE_WINDOW;
+  if (profile.recent_count[phase] < PROFILE_WINDOW) {
+    profile.recent_count[phase]++;
+  }
+
+  if (!profile.keep_events) {
+    return;
+  }
+  if (profile.event_count == profile.event_capacity) {
+    if (profile.event_capacity == PROFILE_MAX_EVENTS) {
+      profile.dropped++;
+      return;
+    }
+    int capacity = profile.event_capacity ? profile.event_capacity * 2 : 4096;
+    PhaseEvent *events = (PhaseEvent *)realloc(
+        profile.events, (size_t)capacity * sizeof(PhaseEvent));
+    if (events == NULL) {
+      profile.dropped++;
+      return;
+    }
+    profile.events = events;
+    profile.event_capacity = capacity;
+  }
+  profile.events[profile.event_count++] =
+      (PhaseEvent){start - profile.origin, (float)(end - start),
+                   (unsigned char)phase};
+}
+
+static int compareDurations(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Median & 99th percentile of the phase's last PROFILE_WINDOW runs in
+// milliseconds, 0 if it hasn't run
+void phaseStats(Phase phase, double *p50, double *p99) {
+  int count = profile.recent_count[phase];
+  if (count == 0) {
+    *p50 = 0;
+    *p99 = 0;
+    return;
+  }
+  double sorted[PROFILE_WINDOW];
+  memcpy(sorted, profile.recent[phase], count * sizeof(double));
+  qsort(sorted, count, sizeof(double), compareDurations);
+  *p50 = sorted[count / 2];
+  *p99 = sorted[count * 99 / 100];
+}
+
+// Writes every kept event as a Chrome trace, returns false on failure
+bool writeProfile(const char *filename) {
+  FILE *file = fopen(filename, "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+                "\"args\":{\"name\":\"render\"}}");
+  for (int i = 0; i < profile.event_count; i++) {
+    const PhaseEvent *event = &profile.events[i];
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"cat\":\"cpaint\",\"ph\":\"X\",\"pid\":1,"
+            "\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+            phase_names[event->phase], event->start * 1000.0,
+            event->duration * 1000.0);
+  }
+  fprintf(file, "\n],\"otherData\":{\"dropped_events\":%lld}}\n",
+          profile.dropped);
+  return fclose(file) == 0;
+}
@@ -0,0 +1,61 @@
+/*  --- profile ---
+ *
+ *  Frame phase timers. Each phase of the main loop is bracketed by
+ *  beginPhase/endPhase; while profiling is off that's a load & a branch,
+ *  so the timers stay compiled in. Once started, the last PROFILE_WINDOW
+ *  frames of every phase are kept for rolling percentiles, and optionally
+ *  every phase run as a Chrome trace_event for chrome://tracing or
+ *  Perfetto.
+ *
+ *  Phases are timed on the render thread only.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define PROFILE_WINDOW 240           // Frames percentiles are taken over
+#define PROFILE_MAX_EVENTS (1 << 20) // Trace events kept, later ones dropped
+//--------------------------------------------------------------------------------
+
+// Parts of a frame that are timed
+typedef enum {
+  PHASE_FRAME,  // Update & draw, without waiting for the next frame
+  PHASE_UPDATE, // Input handling, tools, colors & view movement
+  PHASE_CANVAS, // Painting strokes & fills onto the canvas
+  PHASE_UNDO,   // Undo & redo replay
+  PHASE_SAVE,   // Starting & polling saves
+  PHASE_VIEW,   // Decoding tiles & redrawing the view
+  PHASE_DRAW,   // Sidebar, cursor guide & overlays
+  NUM_PHASES,
+} Phase;
+
+extern const char *phase_names[NUM_PHASES];
+extern bool profiling; // Set while phases are being timed
+
+// Control
+void startProfile(bool keep_events);
+void stopProfile(void);
+void freeProfile(void);
+
+// Results
+void phaseStats(Phase phase, double *p50, double *p99);
+bool writeProfile(const char *filename);
+
+// Timing
+double profileNow(void);
+void recordPhase(Phase phase, double start);
+
+// Returns the time a phase starts at, 0 while profiling is off
+static inline double beginPhase(void) { return profiling ? profileNow() : 0; }
+
+static inline void endPhase(Phase phase, double start) {
+  if (profiling) {
+    recordPhase(phase, start);
+  }
+}
+
+#endif
@@ -0,0 +1,491 @@
+/*  --- project ---
+ *
+ *  .cpaint layout, every integer little endian:
+ *
+ *    header      64 bytes, see below
+ *    stroke log  stroke_count records as written by writeStrokeRecord
+ *    tile data   deflated RGBA tiles, current raster then base raster,
+ *                indexed canvases are expanded to RGBA first
+ *    tile index  16 byte entries, every current tile row major, then every
+ *                base tile: u64 offset, u32 size, then an RGBA color used
+ *                instead of the data when size is 0
+ *
+ *    header:  0  "CPAINT"        6  u16 version
+ *             8  u32 width      12  u32 height
+ *            16  u32 tile size  20  u32 background
+ *            24  u32 strokes    28  u32 flags (PROJECT_BLANK_BASE, older files)
+ *            32  u64 log offset 40  u64 log size
+ *            48  u64 index offset
+ *            56  u64 generation, the session journal it belongs to, 0 if none
+ *
+ *  The base raster is the canvas before the first logged stroke, so the
+ *  whole log can still be undone after reopening. Base tiles equal to the
+ *  current ones share their data.
+ *
+ *  Saving a project that was opened lazily doesn't decode the tiles nobody
+ *  looked at: the writer copies their index entries & deflated bytes
+ *  straight from the mapped file they would have been decoded from.
+ */
+
+#include "project.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define PROJECT_VERSION 1
+#define PROJECT_HEADER_BYTES 64
+#define PROJECT_BLANK_BASE 1 // Header flag: strokes start from a cleared canvas
+#define TILE_ENTRY_BYTES 16
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE * sizeof(Pixel))
+
+static inline void put32(unsigned char *out, unsigned int value) {
+  out[0] = (unsigned char)value;
+  out[1] = (unsigned char)(value >> 8);
+  out[2] = (unsigned char)(value >> 16);
+  out[3] = (unsigned char)(value >> 24);
+}
+
+static inline void put64(unsigned char *out, unsigned long long value) {
+  put32(out, (unsigned int)value);
+  put32(out + 4, (unsigned int)(value >> 32));
+}
+
+static inline unsigned int get32(const unsigned char *in) {
+  return in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 |
+         (unsigned int)in[3] << 24;
+}
+
+static inline unsigned long long get64(const unsigned char *in) {
+  return get32(in) | (unsigned long long)get32(in + 4) << 32;
+}
+
+static int tileCount(int width, int height) {
+  return ((width + TILE_SIZE - 1) / TILE_SIZE) *
+         ((height + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+static void loadProjectTile(void *data, Canvas *canvas, int column, int row);
+static void loadProjectBase(void *data, Canvas *canvas, int column, int row);
+
+// True if raster's pending tiles decode from a mapped project, so a save can
+// copy them from the file instead
+static bool mappedRaster(const Canvas *raster) {
+  return raster->loader == loadProjectTile ||
+         raster->loader == loadProjectBase;
+}
+
+// Index entry a pending tile of a mapped raster would be decoded from
+static const unsigned char *mappedEntry(const Canvas *raster, int index) {
+  const Project *project = (const Project *)raster->loader_data;
+  int layer = raster->loader == loadProjectBase ? 1 : 0;
+  return project->map + project->tiles_offset +
+         ((size_t)layer * tileCount(project->width, project->height) +
+          index) *
+             TILE_ENTRY_BYTES;
+}
+
+//-Saving-------------------------------------------------------------------------
+void freeProjectSnapshot(ProjectSnapshot *snapshot) {
+  freeCanvas(&snapshot->current);
+  freeCanvas(&snapshot->base);
+  free(snapshot->log);
+  free(snapshot);
+}
+
+// Shares the canvas & the history's base raster, copies its stroke log.
+// Tiles still pending in a mapped project stay pending, the writer copies
+// them from the file, so nothing is decoded here. Returns NULL if out of
+// memory.
+ProjectSnapshot *captureProject(Canvas *canvas, UndoHistory *history) {
+  ProjectSnapshot *snapshot =
+      (ProjectSnapshot *)calloc(1, sizeof(ProjectSnapshot));
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  snapshot->background = history->base_color;
+
+  // Any other loader has to run here, the writer can't call it
+  Canvas *base = historyBase(history);
+  if (!mappedRaster(canvas)) {
+    loadAllTiles(canvas);
+  }
+  if (!mappedRaster(base)) {
+    loadAllTiles(base);
+  }
+  shareCanvas(&snapshot->current, canvas);
+  shareCanvas(&snapshot->base, base);
+
+  int from = history->sequence - history->undo_count;
+  snapshot->log_size = historyLogSize(history, from);
+  snapshot->log = (unsigned char *)malloc(snapshot->log_size + 1);
+  if (snapshot->log == NULL) {
+    freeProjectSnapshot(snapshot);
+    return NULL;
+  }
+  snapshot->stroke_count = writeHistoryLog(history, from, snapshot->log);
+  return snapshot;
+}
+
+// Shares the canvas & the history's base raster, then saves them on a
+// background thread
+bool startProjectSave(SaveQueue *queue, Canvas *canvas, UndoHistory *history) {
+  ProjectSnapshot *snapshot = captureProject(canvas, history);
+  if (snapshot == NULL) {
+    return false;
+  }
+  if (!startSaveTask(queue, writeProject, snapshot, PROJECT_EXTENSION)) {
+    freeProjectSnapshot(snapshot);
+    return false;
+  }
+  return true;
+}
+
+// Packs the part of a tile inside the canvas into packed, returns true if
+// every pixel has the same color
+static bool packTile(const Pixel *pixels, Bounds tile, Pixel *packed) {
+  int tile_width = tile.x1 - tile.x0;
+  bool solid = true;
+  Pixel *out = packed;
+  for (int y = 0; y < tile.y1 - tile.y0; y++) {
+    memcpy(out, pixels + y * TILE_SIZE, tile_width * sizeof(Pixel));
+    for (int x = 0; x < tile_width && solid; x++) {
+      solid = memcmp(&out[x], &packed[0], sizeof(Pixel)) == 0;
+    }
+    out += tile_width;
+  }
+  return solid;
+}
+
+// Copies a pending tile's index entry & deflated bytes from the mapped
+// project it would be decoded from, the mapping is only read
+static bool copyMappedTile(FILE *file, const Canvas *raster, int index,
+                           unsigned char *entry, unsigned long long *offset) {
+  const Project *project = (const Project *)raster->loader_data;
+  const unsigned char *from = mappedEntry(raster, index);
+  unsigned long long start = get64(from);
+  unsigned int size = get32(from + 8);
+  memcpy(entry, from, TILE_ENTRY_BYTES);
+  if (size == 0) {
+    return true;
+  }
+  if (start > project->map_size || size > project->map_size - start ||
+      fwrite(project->map + start, 1, size, file) != size) {
+    return false;
+  }
+  put64(entry, *offset);
+  *offset += size;
+  return true;
+}
+
+// Writes one tile of raster at *offset & fills its index entry. expanded
+// holds the tile as RGBA when it isn't stored that way.
+static bool writeTile(FILE *file, const Canvas *raster, int index,
+                      Bounds bounds, unsigned char *entry,
+                      unsigned long long *offset, Pixel *expanded,
+                      Pixel *packed, unsigned char *compressed,
+                      uLong capacity) {
+  const Tile *tile = &raster->tiles[index];
+  if (tile->flags & TILE_PENDING) {
+    return copyMappedTile(file, raster, index, entry, offset);
+  }
+  memset(entry, 0, TILE_ENTRY_BYTES);
+  if (tile->data == NULL) {
+    memcpy(entry + 12, &tile->color, sizeof(Pixel));
+    return true;
+  }
+  const Pixel *pixels = tile->data->pixels;
+  if (raster->indexed || tile->data->packed) {
+    expandTile(raster, tile->data, expanded);
+    pixels = expanded;
+  }
+  if (packTile(pixels, bounds, packed)) {
+    memcpy(entry + 12, &packed[0], sizeof(Pixel));
+    return true;
+  }
+
+  uLong size = capacity;
+  uLong raw =
+      (uLong)(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0) * sizeof(Pixel);
+  if (compress2(compressed, &size, (const Bytef *)packed, raw, 1) != Z_OK ||
+      fwrite(compressed, 1, size, file) != size) {
+    return false;
+  }
+  put64(entry, *offset);
+  put32(entry + 8, (unsigned int)size);
+  *offset += size;
+  return true;
+}
+
+// True if tile index holds the same pixels in both rasters, which is only
+// checked for tiles that are still shared, a single color, or pending on
+// the same bytes of a mapped project
+static bool sameTile(const Canvas *a, const Canvas *b, int index) {
+  const Tile *x = &a->tiles[index];
+  const Tile *y = &b->tiles[index];
+  bool x_pending = x->flags & TILE_PENDING;
+  bool y_pending = y->flags & TILE_PENDING;
+  if (x_pending || y_pending) {
+    return x_pending && y_pending && a->loader_data == b->loader_data &&
+           memcmp(mappedEntry(a, index), mappedEntry(b, index),
+                  TILE_ENTRY_BYTES) == 0;
+  }
+  return x->data == y->data &&
+         (x->data != NULL || memcmp(&x->color, &y->color, sizeof(Pixel)) == 0);
+}
+
+// SaveTask writing the ProjectSnapshot in job->context
+bool writeProject(SaveJob *job) {
+  ProjectSnapshot *snapshot = (ProjectSnapshot *)job->context;
+  bool ok = writeProjectFile(snapshot, job->filename, false, &job->progress);
+  freeProjectSnapshot(snapshot);
+  return ok;
+}
+
+// Writes a snapshot, sync flushes the file to disk before returning
+bool writeProjectFile(const ProjectSnapshot *snapshot, const char *filename,
+                      bool sync, atomic_int *progress) {
+  const Canvas *current = &snapshot->current;
+  int width = current->width;
+  int height = current->height;
+  int count = tileCount(width, height);
+
+  FILE *file = fopen(filename, "wb");
+  unsigned char *index =
+      (unsigned char *)calloc((size_t)count * 2, TILE_ENTRY_BYTES);
+  Pixel *expanded = (Pixel *)malloc(TILE_BYTES);
+  Pixel *packed = (Pixel *)malloc(TILE_BYTES);
+  uLong capacity = compressBound(TILE_BYTES);
+  unsigned char *compressed = (unsigned char *)malloc(capacity);
+  bool ok = file != NULL && index != NULL && expanded != NULL &&
+            packed != NULL && compressed != NULL;
+
+  // Header is filled in last, once every offset is known
+  unsigned char header[PROJECT_HEADER_BYTES] = {0};
+  unsigned long long offset = PROJECT_HEADER_BYTES + snapshot->log_size;
+  ok = ok && fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+       fwrite(snapshot->log, 1, snapshot->log_size, file) ==
+           snapshot->log_size;
+
+  // Current raster, then the base one
+  for (int layer = 0; layer < 2 && ok; layer++) {
+    const Canvas *raster = layer == 0 ? current : &snapshot->base;
+    for (int i = 0; i < count && ok; i++) {
+      unsigned char *entry =
+          index + ((size_t)layer * count + i) * TILE_ENTRY_BYTES;
+      Bounds tile = tileBounds(raster, i % raster->tile_columns,
+                               i / raster->tile_columns);
+      if (layer == 1 && sameTile(current, raster, i)) {
+        memcpy(entry, index + (size_t)i * TILE_ENTRY_BYTES, TILE_ENTRY_BYTES);
+      } else {
+        ok = writeTile(file, raster, i, tile, entry, &offset, expanded,
+                       packed, compressed, capacity);
+      }
+      if (progress != NULL) {
+        atomic_store(progress, (layer * count + i) * 100 / (count * 2));
+      }
+    }
+  }
+
+  ok = ok && fwrite(index, TILE_ENTRY_BYTES, (size_t)count * 2, file) ==
+                 (size_t)count * 2;
+
+  memcpy(header, "CPAINT", 6);
+  header[6] = PROJECT_VERSION;
+  put32(header + 8, width);
+  put32(header + 12, height);
+  put32(header + 16, TILE_SIZE);
+  put32(header + 20, snapshot->background);
+  put32(header + 24, snapshot->stroke_count);
+  put32(header + 28, 0);
+  put64(header + 32, PROJECT_HEADER_BYTES);
+  put64(header + 40, snapshot->log_size);
+  put64(header + 48, offset);
+  put64(header + 56, snapshot->generation);
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  if (sync) {
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  }
+
+  if (file != NULL && fclose(file) != 0) {
+    ok = false;
+  }
+  free(compressed);
+  free(packed);
+  free(expanded);
+  free(index);
+  return ok;
+}
+//--------------------------------------------------------------------------------
+
+//-Loading------------------------------------------------------------------------
+// Maps a project & checks its header, no tiles are decoded yet
+bool openProject(Project *project, const char *filename) {
+  memset(project, 0, sizeof(Project));
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < PROJECT_HEADER_BYTES) {
+    close(fd);
+    return false;
+  }
+  project->map_size = (size_t)info.st_size;
+  project->map = (unsigned char *)mmap(NULL, project->map_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0);
+  close(fd); // The mapping keeps the file alive
+  if (project->map == MAP_FAILED) {
+    project->map = NULL;
+    return false;
+  }
+
+  const unsigned char *header = project->map;
+  project->width = (int)get32(header + 8);
+  project->height = (int)get32(header + 12);
+  project->background = (int)get32(header + 20);
+  project->stroke_count = (int)get32(header + 24);
+  project->blank_base = get32(header + 28) & PROJECT_BLANK_BASE;
+  unsigned long long log_offset = get64(header + 32);
+  unsigned long long log_size = get64(header + 40);
+  unsigned long long tiles_offset = get64(header + 48);
+  project->generation = get64(header + 56);
+
+  bool ok = memcmp(header, "CPAINT", 6) == 0 &&
+            (header[6] | header[7] << 8) == PROJECT_VERSION &&
+            get32(header + 16) == TILE_SIZE &&
+            project->width > 0 && project->width <= PROJECT_MAX_SIDE &&
+            project->height > 0 && project->height <= PROJECT_MAX_SIDE &&
+            project->background >= 0 && project->background < NUM_COLORS &&
+            project->stroke_count >= 0 &&
+            (unsigned long long)project->stroke_count <=
+                log_size / STROKE_RECORD_BYTES;
+  size_t index_size =
+      ok ? (size_t)tileCount(project->width, project->height) * 2 *
+               TILE_ENTRY_BYTES
+         : 0;
+  ok = ok && log_offset <= project->map_size &&
+       log_size <= project->map_size - log_offset &&
+       tiles_offset <= project->map_size &&
+       index_size <= project->map_size - tiles_offset;
+
+  project->log_offset = (size_t)log_offset;
+  project->log_size = (size_t)log_size;
+  project->tiles_offset = (size_t)tiles_offset;
+  project->scratch = ok ? (Pixel *)malloc(TILE_BYTES) : NULL;
+  if (project->scratch == NULL) {
+    closeProject(project);
+    return false;
+  }
+  pthread_mutex_init(&project->lock, NULL);
+  return true;
+}
+
+// Decodes a tile of a layer into the same tile of canvas. Solid tiles stay
+// a single color, so they take no memory.
+static bool decodeTile(Project *project, int layer, Canvas *canvas,
+                       int column, int row) {
+  Bounds tile = tileBounds(canvas, column, row);
+  int tile_width = tile.x1 - tile.x0;
+  int tile_height = tile.y1 - tile.y0;
+  const unsigned char *entry =
+      project->map + project->tiles_offset +
+      ((size_t)layer * tileCount(project->width, project->height) +
+       row * canvas->tile_columns + column) *
+          TILE_ENTRY_BYTES;
+  unsigned long long offset = get64(entry);
+  unsigned int size = get32(entry + 8);
+
+  // Solid tiles are just their color
+  if (size == 0) {
+    Pixel color;
+    memcpy(&color, entry + 12, sizeof(Pixel));
+    fillTile(canvas, column, row, color);
+    return true;
+  }
+
+  // Full width RGBA tiles have the packed layout already & decode in place,
+  // indexed canvases take the palette index of every pixel
+  unsigned char *samples = tilePixels(canvas, column, row);
+  Pixel *pixels = (Pixel *)samples;
+  Pixel *out = tile_width == TILE_SIZE && !canvas->indexed ? pixels
+                                                           : project->scratch;
+  uLong raw = (uLong)tile_width * tile_height * sizeof(Pixel);
+  uLong decoded = raw;
+  if (offset > project->map_size || size > project->map_size - offset ||
+      uncompress((Bytef *)out, &decoded, project->map + offset, size) !=
+          Z_OK ||
+      decoded != raw) {
+    return false;
+  }
+  if (canvas->indexed) {
+    for (int y = 0; y < tile_height; y++) {
+      indexPixels(out + (size_t)y * tile_width, tile_width,
+                  samples + y * TILE_SIZE);
+    }
+  } else if (out != pixels) {
+    for (int y = 0; y < tile_height; y++) {
+      memcpy(pixels + y * TILE_SIZE, out + (size_t)y * tile_width,
+             tile_width * sizeof(Pixel));
+    }
+  }
+  return true;
+}
+
+// Decodes under the project's lock, image saves decode the tiles of their
+// snapshots on their own threads
+static bool decodeLocked(Project *project, int layer, Canvas *canvas,
+                         int column, int row) {
+  pthread_mutex_lock(&project->lock);
+  bool ok = decodeTile(project, layer, canvas, column, row);
+  pthread_mutex_unlock(&project->lock);
+  return ok;
+}
+
+// TileLoader for the current raster
+static void loadProjectTile(void *data, Canvas *canvas, int column, int row) {
+  if (!decodeLocked((Project *)data, 0, canvas, column, row)) {
+    fprintf(stderr, "Failed to decode project tile %d,%d\n", column, row);
+  }
+}
+
+// TileLoader for the base raster
+static void loadProjectBase(void *data, Canvas *canvas, int column, int row) {
+  if (!decodeLocked((Project *)data, 1, canvas, column, row)) {
+    fprintf(stderr, "Failed to decode project base tile %d,%d\n", column,
+            row);
+  }
+}
+
+// Inits canvas with the project's tiles, all pending, & hands its stroke log
+// to a fresh history inited with the project's size. The project has to stay
+// open as long as either, or a snapshot of them being saved, may still read
+// from it. Returns false if the log is damaged, the strokes before the
+// damage are kept.
+bool attachProject(Project *project, Canvas *canvas, UndoHistory *history) {
+  initLazyCanvas(canvas, project->width, project->height, loadProjectTile,
+                 project);
+  history->base_color = project->background;
+  return restoreHistory(history, project->map + project->log_offset,
+                        project->log_size, project->stroke_count,
+                        project->blank_base ? NULL : loadProjectBase, project);
+}
+
+void closeProject(Project *project) {
+  if (project->map != NULL) {
+    munmap(project->map, project->map_size);
+    project->map = NULL;
+  }
+  if (project->scratch != NULL) {
+    pthread_mutex_destroy(&project->lock);
+    free(project->scratch);
+    project->scratch = NULL;
+  }
+}
+//--------------------------------------------------------------------------------
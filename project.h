@@ -0,0 +1,70 @@
+/*  --- project ---
+ *
+ *  Native .cpaint project files. A project keeps what a flattened image
+ *  loses: the compact stroke log of the undo history, the raster those
+ *  strokes were painted on, and the current raster, both cut into tiles.
+ *
+ *  Opening a project only maps the file. Tiles are decoded the first time
+ *  they are shown or painted on, so startup cost follows what's on screen
+ *  instead of the document size.
+ */
+
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include "export.h"
+#include "history.h"
+#include "raster.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define PROJECT_EXTENSION "cpaint"       // Extension project saves use
+#define PROJECT_MAX_SIDE CANVAS_MAX_SIDE // Largest width or height of a project
+//--------------------------------------------------------------------------------
+
+// Struct to store everything a project file holds, shared off the live
+// canvas & history so it can be written from another thread
+typedef struct {
+  Canvas current;      // Shares the canvas tiles, pending ones stay mapped
+  Canvas base;         // Shares the tiles of the raster the log starts from
+  unsigned char *log;  // Stroke records
+  size_t log_size;     // Bytes of stroke records
+  int stroke_count;    // Records in log
+  int background;      // Palette index the base started out cleared to
+  unsigned long long generation; // Session journal it belongs to, 0 if none
+} ProjectSnapshot;
+
+// Struct to store an opened project, the file stays mapped while it's in use
+typedef struct {
+  unsigned char *map;  // Whole file, mapped read only
+  size_t map_size;     // Bytes mapped
+  int width;           // Canvas width in pixels
+  int height;          // Canvas height in pixels
+  int background;      // Palette index a blank base is cleared to
+  int stroke_count;    // Records in the stroke log
+  size_t log_offset;   // Where the stroke log starts
+  size_t log_size;     // Bytes of stroke log
+  size_t tiles_offset; // Where the tile index starts
+  bool blank_base;     // Strokes start from a canvas cleared to background,
+                       // only older files store no base tiles
+  unsigned long long generation; // Session journal it belongs to, 0 if none
+  Pixel *scratch;      // One decoded tile
+  pthread_mutex_t lock; // Held while decoding into scratch
+} Project;
+
+// Saving
+ProjectSnapshot *captureProject(Canvas *canvas, UndoHistory *history);
+bool writeProjectFile(const ProjectSnapshot *snapshot, const char *filename,
+                      bool sync, atomic_int *progress);
+void freeProjectSnapshot(ProjectSnapshot *snapshot);
+bool startProjectSave(SaveQueue *queue, Canvas *canvas, UndoHistory *history);
+bool writeProject(SaveJob *job);
+
+// Loading
+bool openProject(Project *project, const char *filename);
+bool attachProject(Project *project, Canvas *canvas, UndoHistory *history);
+void closeProject(Project *project);
+
+#endif
@@ -0,0 +1,1511 @@
+/*  --- raster ---
+ *
+ *  Span based fill kernels for cpaint's stamps and lines. Every shape is
+ *  broken down into horizontal spans which are written straight into the
+ *  canvas tiles, so replaying strokes needs no raylib calls at all.
+ */
+
+#include "raster.h"
+#include "fill.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPAN_X86 1 // SSE2 & AVX2 kernels are built, used if the CPU has them
+#endif
+
+#define SWEEP_MIN_SKIP 4 // Narrowest already painted span a sweep skips
+
+// Same values as the raylib colors in paint.c's colors[]
+const Pixel palette[NUM_COLORS] = {
+    {255, 255, 255, 255}, // WHITE
+    {245, 245, 245, 255}, // RAYWHITE
+    {253, 249, 0, 255},   // YELLOW
+    {255, 203, 0, 255},   // GOLD
+    {255, 161, 0, 255},   // ORANGE
+    {255, 109, 194, 255}, // PINK
+    {230, 41, 55, 255},   // RED
+    {190, 33, 55, 255},   // MAROON
+    {0, 228, 48, 255},    // GREEN
+    {0, 158, 47, 255},    // LIME
+    {0, 117, 44, 255},    // DARKGREEN
+    {102, 191, 255, 255}, // SKYBLUE
+    {0, 121, 241, 255},   // BLUE
+    {0, 82, 172, 255},    // DARKBLUE
+    {200, 122, 255, 255}, // PURPLE
+    {135, 60, 190, 255},  // VIOLET
+    {112, 31, 126, 255},  // DARKPURPLE
+    {211, 176, 131, 255}, // BEIGE
+    {127, 106, 79, 255},  // BROWN
+    {76, 63, 47, 255},    // DARKBROWN
+    {200, 200, 200, 255}, // LIGHTGRAY
+    {130, 130, 130, 255}, // GRAY
+    {80, 80, 80, 255},    // DARKGRAY
+    {0, 0, 0, 255},       // BLACK
+};
+
+// First pixel whose center is at or past edge
+static inline int pixelEdge(float edge) { return (int)ceilf(edge - 0.5f); }
+
+//-Canvas-------------------------------------------------------------------------
+static void loadTile(Canvas *canvas, int column, int row);
+static void decodeRuns(const TileData *data, int sample, unsigned char *out);
+
+// Bytes one pixel takes in a canvas's tiles
+static inline int sampleBytes(const Canvas *canvas) {
+  return canvas->indexed ? 1 : (int)sizeof(Pixel);
+}
+
+// Bytes of a tile's raw samples
+static inline int tileBytes(const Canvas *canvas) {
+  return TILE_SIZE * TILE_SIZE * sampleBytes(canvas);
+}
+
+static void allocCanvas(Canvas *canvas, int width, int height) {
+  canvas->width = width;
+  canvas->height = height;
+  canvas->clip = canvasBounds(canvas);
+  canvas->indexed = false;
+  canvas->tile_columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->tile_rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  canvas->tiles = (Tile *)calloc(
+      (size_t)canvas->tile_columns * canvas->tile_rows, sizeof(Tile));
+  canvas->pending_tiles = 0;
+  canvas->dirty_tiles = 0;
+  canvas->loader = NULL;
+  canvas->loader_data = NULL;
+  if (canvas->tiles == NULL) {
+    fprintf(stderr, "Failed to allocate memory for canvas\n");
+    exit(1);
+  }
+}
+
+// Tile data with room for size bytes of samples or runs
+static TileData *newTileData(int size) {
+  TileData *data = (TileData *)malloc(offsetof(TileData, bytes) + size);
+  if (data == NULL) {
+    fprintf(stderr, "Failed to allocate memory for canvas tile\n");
+    exit(1);
+  }
+  atomic_init(&data->refs, 1);
+  data->mark = 0;
+  data->mips = NULL;
+  data->stamp = 0;
+  data->size = size;
+  data->packed = false;
+  return data;
+}
+
+// Drops one reference, the last one frees the pixels. Safe to call from the
+// save thread while the main thread keeps painting.
+static void releaseTileData(TileData *data) {
+  if (data != NULL && atomic_fetch_sub(&data->refs, 1) == 1) {
+    free(data->mips);
+    free(data);
+  }
+}
+
+static inline bool samePixel(Pixel a, Pixel b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+static void expandIndices(const unsigned char *indices, int count, Pixel *out) {
+  for (int i = 0; i < count; i++) {
+    out[i] = palette[indices[i]];
+  }
+}
+
+static inline bool coversTile(const Canvas *canvas, int column, int row,
+                              Bounds area) {
+  Bounds tile = tileBounds(canvas, column, row);
+  return area.x0 <= tile.x0 && area.y0 <= tile.y0 && area.x1 >= tile.x1 &&
+         area.y1 >= tile.y1;
+}
+
+// Every tile starts out as a single color, nothing is allocated per pixel
+void initCanvas(Canvas *canvas, int width, int height, int color) {
+  allocCanvas(canvas, width, height);
+  int count = canvas->tile_columns * canvas->tile_rows;
+  for (int i = 0; i < count; i++) {
+    canvas->tiles[i].color = palette[color];
+  }
+}
+
+// Init a canvas whose tiles all start pending, loader decodes each one on
+// first use. Until then they read as transparent black.
+void initLazyCanvas(Canvas *canvas, int width, int height, TileLoader loader,
+                    void *data) {
+  allocCanvas(canvas, width, height);
+  canvas->loader = loader;
+  canvas->loader_data = data;
+  canvas->pending_tiles = canvas->tile_columns * canvas->tile_rows;
+  for (int i = 0; i < canvas->pending_tiles; i++) {
+    canvas->tiles[i].flags = TILE_PENDING;
+  }
+}
+
+void freeCanvas(Canvas *canvas) {
+  if (canvas->tiles != NULL) {
+    int count = canvas->tile_columns * canvas->tile_rows;
+    for (int i = 0; i < count; i++) {
+      releaseTileData(canvas->tiles[i].data);
+    }
+  }
+  free(canvas->tiles);
+  canvas->tiles = NULL;
+}
+
+// Switches a canvas between RGBA & palette indices, re-encoding the tiles
+// that have pixels. Pending tiles decode straight into the new format. RGBA
+// colors the palette lacks become the closest entry.
+void convertCanvas(Canvas *canvas, bool indexed) {
+  if (canvas->indexed == indexed) {
+    return;
+  }
+  int count = canvas->tile_columns * canvas->tile_rows;
+  int sample = sampleBytes(canvas);
+  unsigned char *unpacked = NULL;
+  for (int i = 0; i < count; i++) {
+    Tile *tile = &canvas->tiles[i];
+    if (indexed) {
+      tile->color = palette[paletteIndex(tile->color)];
+    }
+    if (tile->data == NULL) {
+      continue;
+    }
+    const unsigned char *samples = tile->data->bytes;
+    if (tile->data->packed) {
+      if (unpacked == NULL) {
+        unpacked = (unsigned char *)malloc(TILE_SIZE * TILE_SIZE * sample);
+        if (unpacked == NULL) {
+          fprintf(stderr, "Failed to allocate memory for canvas tile\n");
+          exit(1);
+        }
+      }
+      decodeRuns(tile->data, sample, unpacked);
+      samples = unpacked;
+    }
+    TileData *data = newTileData(TILE_SIZE * TILE_SIZE *
+                                 (indexed ? 1 : (int)sizeof(Pixel)));
+    if (indexed) {
+      indexPixels((const Pixel *)samples, TILE_SIZE * TILE_SIZE,
+                  data->indices);
+    } else {
+      expandIndices(samples, TILE_SIZE * TILE_SIZE, data->pixels);
+    }
+    releaseTileData(tile->data);
+    tile->data = data;
+  }
+  canvas->indexed = indexed;
+  free(unpacked);
+}
+
+// Makes copy a snapshot of canvas. Tile pixels are shared until either
+// canvas writes them, pending tiles stay pending in both. copy must be a
+// canvas or zeroed.
+void shareCanvas(Canvas *copy, Canvas *canvas) {
+  int count = canvas->tile_columns * canvas->tile_rows;
+  if (copy->tiles != NULL && copy->tile_columns == canvas->tile_columns &&
+      copy->tile_rows == canvas->tile_rows) {
+    for (int i = 0; i < count; i++) {
+      releaseTileData(copy->tiles[i].data);
+    }
+    copy->width = canvas->width;
+    copy->height = canvas->height;
+  } else {
+    freeCanvas(copy);
+    allocCanvas(copy, canvas->width, canvas->height);
+  }
+  copy->clip = canvasBounds(copy);
+  copy->indexed = canvas->indexed;
+  copy->pending_tiles = canvas->pending_tiles;
+  copy->dirty_tiles = 0;
+  copy->loader = canvas->loader;
+  copy->loader_data = canvas->loader_data;
+  for (int i = 0; i < count; i++) {
+    copy->tiles[i] = canvas->tiles[i];
+    copy->tiles[i].flags &= TILE_PENDING;
+    if (copy->tiles[i].data != NULL) {
+      atomic_fetch_add(&copy->tiles[i].data->refs, 1);
+    }
+  }
+}
+
+// Copies area of source into canvas, both the same size. Tiles the area
+// covers completely are shared rather than copied, unless they're packed.
+// A source in the other format, a snapshot taken before the canvas was
+// converted, is converted first.
+void copyArea(Canvas *canvas, Canvas *source, Bounds area) {
+  area = intersectBounds(area, canvasBounds(canvas));
+  if (boundsEmpty(area)) {
+    return;
+  }
+  convertCanvas(source, canvas->indexed);
+  markDirty(canvas, area);
+  int sample = sampleBytes(canvas);
+  unsigned char *unpacked = NULL; // A packed source tile's samples
+  for (int r = area.y0 / TILE_SIZE; r <= (area.y1 - 1) / TILE_SIZE; r++) {
+    for (int c = area.x0 / TILE_SIZE; c <= (area.x1 - 1) / TILE_SIZE; c++) {
+      int index = r * canvas->tile_columns + c;
+      Tile *from = &source->tiles[index];
+      Tile *to = &canvas->tiles[index];
+      if (from->flags & TILE_PENDING) {
+        loadTile(source, c, r);
+      }
+
+      // Packed data stays with the snapshots, the canvas gets it unpacked
+      bool packed = from->data != NULL && from->data->packed;
+      if (coversTile(canvas, c, r, area)) {
+        if (to->flags & TILE_PENDING) {
+          to->flags &= ~TILE_PENDING;
+          canvas->pending_tiles--;
+        }
+        TileData *data = from->data;
+        if (packed) {
+          data = newTileData(tileBytes(canvas));
+          decodeRuns(from->data, sample, data->bytes);
+        } else if (data != NULL) {
+          atomic_fetch_add(&data->refs, 1);
+        }
+        releaseTileData(to->data);
+        to->data = data;
+        to->color = from->color;
+        continue;
+      }
+
+      const unsigned char *samples = from->data ? from->data->bytes : NULL;
+      if (packed) {
+        if (unpacked == NULL) {
+          unpacked = (unsigned char *)malloc(tileBytes(canvas));
+          if (unpacked == NULL) {
+            fprintf(stderr, "Failed to allocate memory for canvas tile\n");
+            exit(1);
+          }
+        }
+        decodeRuns(from->data, sample, unpacked);
+        samples = unpacked;
+      }
+      Bounds part = intersectBounds(tileBounds(canvas, c, r), area);
+      int x0 = part.x0 - c * TILE_SIZE;
+      int width = part.x1 - part.x0;
+      unsigned char *pixels = tilePixels(canvas, c, r);
+      for (int y = part.y0 - r * TILE_SIZE; y < part.y1 - r * TILE_SIZE; y++) {
+        size_t at = (size_t)(y * TILE_SIZE + x0) * sample;
+        if (samples != NULL) {
+          memcpy(pixels + at, samples + at, (size_t)width * sample);
+        } else if (canvas->indexed) {
+          memset(pixels + at, paletteIndex(from->color), width);
+        } else {
+          writeSpan((Pixel *)(pixels + at), width, from->color);
+        }
+      }
+    }
+  }
+  free(unpacked);
+}
+
+// Clears everything inside the clip rectangle. Tiles the clip covers
+// completely turn back into a single color and give up their pixels.
+void clearCanvas(Canvas *canvas, int color) {
+  Bounds clip = canvas->clip;
+  if (boundsEmpty(clip)) {
+    return;
+  }
+  for (int r = clip.y0 / TILE_SIZE; r <= (clip.y1 - 1) / TILE_SIZE; r++) {
+    for (int c = clip.x0 / TILE_SIZE; c <= (clip.x1 - 1) / TILE_SIZE; c++) {
+      if (coversTile(canvas, c, r, clip)) {
+        fillTile(canvas, c, r, palette[color]);
+        markDirty(canvas, tileBounds(canvas, c, r));
+        continue;
+      }
+      Bounds part = intersectBounds(tileBounds(canvas, c, r), clip);
+      for (int y = part.y0; y < part.y1; y++) {
+        fillSpan(canvas, y, part.x0, part.x1, color);
+      }
+    }
+  }
+}
+
+void setCanvasClip(Canvas *canvas, Bounds clip) {
+  canvas->clip = intersectBounds(clip, canvasBounds(canvas));
+}
+
+void resetCanvasClip(Canvas *canvas) { canvas->clip = canvasBounds(canvas); }
+
+Bounds canvasBounds(const Canvas *canvas) {
+  return (Bounds){0, 0, canvas->width, canvas->height};
+}
+
+// Pixels a single stamp (or pencil joint) at center can touch
+Bounds stampBounds(Tool tool, Shape shape, Point center, float radius) {
+  float extent_x = radius;
+  float extent_y = radius;
+  if (tool == TOOL_PENCIL) {
+    extent_x = extent_y = radius / 2.0f;
+  } else if (shape == SHAPE_TRIANGLE) {
+    extent_x = radius * 1.3f;
+  }
+  return (Bounds){(int)floorf(center.x - extent_x) - 1,
+                  (int)floorf(center.y - extent_y) - 1,
+                  (int)ceilf(center.x + extent_x) + 1,
+                  (int)ceilf(center.y + extent_y) + 1};
+}
+
+// Bytes the canvas holds, shared tile pixels counted in full
+size_t canvasMemory(const Canvas *canvas) {
+  int count = canvas->tile_columns * canvas->tile_rows;
+  size_t bytes = (size_t)count * sizeof(Tile);
+  for (int i = 0; i < count; i++) {
+    if (canvas->tiles[i].data != NULL) {
+      bytes += tileDataBytes(canvas->tiles[i].data);
+    }
+  }
+  return bytes;
+}
+
+// Palette entry closest to color, the exact one if it's in the palette
+int paletteIndex(Pixel color) {
+  int best = 0;
+  int best_distance = INT_MAX;
+  for (int i = 0; i < NUM_COLORS && best_distance > 0; i++) {
+    int dr = color.r - palette[i].r;
+    int dg = color.g - palette[i].g;
+    int db = color.b - palette[i].b;
+    int da = color.a - palette[i].a;
+    int distance = dr * dr + dg * dg + db * db + da * da;
+    if (distance < best_distance) {
+      best = i;
+      best_distance = distance;
+    }
+  }
+  return best;
+}
+
+// Palette indices of count pixels, each run of one color looked up once
+void indexPixels(const Pixel *pixels, int count, unsigned char *out) {
+  Pixel last = {0};
+  int index = paletteIndex(last);
+  for (int i = 0; i < count; i++) {
+    if (!samePixel(pixels[i], last)) {
+      last = pixels[i];
+      index = paletteIndex(last);
+    }
+    out[i] = (unsigned char)index;
+  }
+}
+
+// Clamps a row range to the clip rectangle
+static inline void clipRows(const Canvas *canvas, int *y_start, int *y_end) {
+  if (*y_start < canvas->clip.y0) {
+    *y_start = canvas->clip.y0;
+  }
+  if (*y_end > canvas->clip.y1) {
+    *y_end = canvas->clip.y1;
+  }
+}
+
+// True when nothing in [x0, x1) can land inside the clip rectangle
+static inline bool outsideColumns(const Canvas *canvas, float x0, float x1) {
+  return x1 < canvas->clip.x0 - 1 || x0 > canvas->clip.x1 + 1;
+}
+//--------------------------------------------------------------------------------
+
+//-Tiles--------------------------------------------------------------------------
+// Pixels covered by a tile, edge tiles are cut short by the canvas size
+Bounds tileBounds(const Canvas *canvas, int column, int row) {
+  Bounds tile = {column * TILE_SIZE, row * TILE_SIZE, (column + 1) * TILE_SIZE,
+                 (row + 1) * TILE_SIZE};
+  return intersectBounds(tile, canvasBounds(canvas));
+}
+
+static inline void markTileDirty(Canvas *canvas, Tile *tile) {
+  if (!(tile->flags & TILE_DIRTY)) {
+    tile->flags |= TILE_DIRTY;
+    canvas->dirty_tiles++;
+  }
+}
+
+static void loadTile(Canvas *canvas, int column, int row) {
+  Tile *tile = &canvas->tiles[row * canvas->tile_columns + column];
+  if (tile->flags & TILE_PENDING) {
+    tile->flags &= ~TILE_PENDING;
+    canvas->pending_tiles--;
+    canvas->loader(canvas->loader_data, canvas, column, row);
+    markTileDirty(canvas, tile);
+  }
+}
+
+// Decodes the pending tiles overlapping area
+void loadTiles(Canvas *canvas, Bounds area) {
+  area = intersectBounds(area, canvasBounds(canvas));
+  if (canvas->pending_tiles == 0 || boundsEmpty(area)) {
+    return;
+  }
+  for (int r = area.y0 / TILE_SIZE; r <= (area.y1 - 1) / TILE_SIZE; r++) {
+    for (int c = area.x0 / TILE_SIZE; c <= (area.x1 - 1) / TILE_SIZE; c++) {
+      loadTile(canvas, c, r);
+    }
+  }
+}
+
+void loadAllTiles(Canvas *canvas) { loadTiles(canvas, canvasBounds(canvas)); }
+
+// Decodes the first pending tile, returns false once none are left
+bool loadNextTile(Canvas *canvas, int *column, int *row) {
+  int count = canvas->tile_columns * canvas->tile_rows;
+  for (int i = 0; i < count && canvas->pending_tiles > 0; i++) {
+    if (canvas->tiles[i].flags & TILE_PENDING) {
+      *column = i % canvas->tile_columns;
+      *row = i / canvas->tile_columns;
+      loadTile(canvas, *column, *row);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Copies area into out as RGBA, packed row after row. Decodes pending
+// tiles first.
+void readPixels(Canvas *canvas, Bounds area, Pixel *out) {
+  loadTiles(canvas, area);
+  int stride = area.x1 - area.x0;
+  for (int r = area.y0 / TILE_SIZE; r <= (area.y1 - 1) / TILE_SIZE; r++) {
+    for (int c = area.x0 / TILE_SIZE; c <= (area.x1 - 1) / TILE_SIZE; c++) {
+      const Tile *tile = &canvas->tiles[r * canvas->tile_columns + c];
+      if (tile->data != NULL && tile->data->packed) {
+        tilePixels(canvas, c, r);
+      }
+      Bounds part = intersectBounds(tileBounds(canvas, c, r), area);
+      int width = part.x1 - part.x0;
+      for (int y = part.y0; y < part.y1; y++) {
+        Pixel *row = out + (size_t)(y - area.y0) * stride + part.x0 - area.x0;
+        int at = (y - r * TILE_SIZE) * TILE_SIZE + part.x0 - c * TILE_SIZE;
+        if (tile->data != NULL && canvas->indexed) {
+          expandIndices(tile->data->indices + at, width, row);
+        } else if (tile->data != NULL) {
+          memcpy(row, tile->data->pixels + at, width * sizeof(Pixel));
+        } else {
+          for (int x = 0; x < width; x++) {
+            row[x] = tile->color;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Flags the tiles overlapping area as changed
+void markDirty(Canvas *canvas, Bounds area) {
+  area = intersectBounds(area, canvasBounds(canvas));
+  if (boundsEmpty(area)) {
+    return;
+  }
+  for (int r = area.y0 / TILE_SIZE; r <= (area.y1 - 1) / TILE_SIZE; r++) {
+    for (int c = area.x0 / TILE_SIZE; c <= (area.x1 - 1) / TILE_SIZE; c++) {
+      markTileDirty(canvas, &canvas->tiles[r * canvas->tile_columns + c]);
+    }
+  }
+}
+
+// Takes the first run of dirty tiles along a tile row, clearing their flag.
+// Returns false once nothing is dirty, else area holds the pixels to show.
+bool nextDirtyRun(Canvas *canvas, Bounds *area) {
+  int count = canvas->tile_columns * canvas->tile_rows;
+  for (int i = 0; i < count && canvas->dirty_tiles > 0; i++) {
+    if (canvas->tiles[i].flags & TILE_DIRTY) {
+      int row = i / canvas->tile_columns;
+      int first = i % canvas->tile_columns;
+      int last = first;
+      while (last < canvas->tile_columns &&
+             (canvas->tiles[row * canvas->tile_columns + last].flags &
+              TILE_DIRTY)) {
+        canvas->tiles[row * canvas->tile_columns + last].flags &= ~TILE_DIRTY;
+        canvas->dirty_tiles--;
+        last++;
+      }
+      *area = unionBounds(tileBounds(canvas, first, row),
+                          tileBounds(canvas, last - 1, row));
+      return true;
+    }
+  }
+  return false;
+}
+
+// Samples of a tile that are safe to write, TILE_SIZE apart: decoded,
+// unpacked, owned by this canvas alone and no longer a single color. Pixels
+// or palette indices, whichever the canvas holds. Used by kernels &
+// loaders, the caller flags what it writes as dirty.
+void *tilePixels(Canvas *canvas, int column, int row) {
+  loadTile(canvas, column, row);
+  Tile *tile = &canvas->tiles[row * canvas->tile_columns + column];
+  if (tile->data == NULL) {
+    tile->data = newTileData(tileBytes(canvas));
+    if (canvas->indexed) {
+      memset(tile->data->indices, paletteIndex(tile->color),
+             TILE_SIZE * TILE_SIZE);
+    } else {
+      writeSpan(tile->data->pixels, TILE_SIZE * TILE_SIZE, tile->color);
+    }
+  } else if (tile->data->packed || atomic_load(&tile->data->refs) > 1) {
+    TileData *copy = newTileData(tileBytes(canvas));
+    if (tile->data->packed) {
+      decodeRuns(tile->data, sampleBytes(canvas), copy->bytes);
+    } else {
+      memcpy(copy->bytes, tile->data->bytes, tileBytes(canvas));
+    }
+    releaseTileData(tile->data);
+    tile->data = copy;
+  } else {
+    tile->data->stamp = 0; // About to be written
+    if (tile->data->mips != NULL) {
+      free(tile->data->mips); // About to go stale
+      tile->data->mips = NULL;
+    }
+  }
+  return tile->data->bytes;
+}
+
+// Stamp no other samples ever get, kept until the tile is next written, so
+// caches of what a tile held can tell when they go stale without pinning
+// its data. 0 while the tile is a single color or still pending.
+unsigned long long tileStamp(Canvas *canvas, int column, int row) {
+  static atomic_ullong next_stamp = 1;
+  TileData *data = canvas->tiles[row * canvas->tile_columns + column].data;
+  if (data == NULL) {
+    return 0;
+  }
+  if (data->stamp == 0) {
+    data->stamp = atomic_fetch_add(&next_stamp, 1);
+  }
+  return data->stamp;
+}
+
+// Turns a whole tile into a single color, dropping its pixels. Like
+// tilePixels the caller flags the tile as dirty.
+void fillTile(Canvas *canvas, int column, int row, Pixel color) {
+  Tile *tile = &canvas->tiles[row * canvas->tile_columns + column];
+  if (tile->flags & TILE_PENDING) {
+    tile->flags &= ~TILE_PENDING;
+    canvas->pending_tiles--;
+  }
+  releaseTileData(tile->data);
+  tile->data = NULL;
+  tile->color = canvas->indexed ? palette[paletteIndex(color)] : color;
+}
+
+// Pixels before mip level in a tile's mips
+int mipOffset(int level) {
+  int offset = 0;
+  for (int l = 1; l < level; l++) {
+    offset += (TILE_SIZE >> l) * (TILE_SIZE >> l);
+  }
+  return offset;
+}
+
+static inline Pixel averagePixels(Pixel a, Pixel b, Pixel c, Pixel d) {
+  return (Pixel){(unsigned char)((a.r + b.r + c.r + d.r + 2) / 4),
+                 (unsigned char)((a.g + b.g + c.g + d.g + 2) / 4),
+                 (unsigned char)((a.b + b.b + c.b + d.b + 2) / 4),
+                 (unsigned char)((a.a + b.a + c.a + d.a + 2) / 4)};
+}
+
+// Box filters every level from the one above it, mips are RGBA whatever
+// the canvas holds
+static void buildMips(TileData *data, bool indexed) {
+  data->mips = (Pixel *)malloc(mipOffset(TILE_LEVELS) * sizeof(Pixel));
+  if (data->mips == NULL) {
+    fprintf(stderr, "Failed to allocate memory for tile mips\n");
+    exit(1);
+  }
+  const Pixel *above = data->pixels;
+  for (int level = 1; level < TILE_LEVELS; level++) {
+    int side = TILE_SIZE >> level;
+    Pixel *out = data->mips + mipOffset(level);
+    for (int y = 0; y < side; y++) {
+      for (int x = 0; x < side; x++) {
+        int at = (2 * y) * (2 * side) + 2 * x;
+        if (indexed && level == 1) {
+          const unsigned char *a = data->indices + at;
+          const unsigned char *b = a + 2 * side;
+          out[y * side + x] = averagePixels(palette[a[0]], palette[a[1]],
+                                            palette[b[0]], palette[b[1]]);
+        } else {
+          const Pixel *a = above + at;
+          const Pixel *b = a + 2 * side;
+          out[y * side + x] = averagePixels(a[0], a[1], b[0], b[1]);
+        }
+      }
+    }
+    above = out;
+  }
+}
+
+// Mip level of a tile, TILE_SIZE >> level pixels on a side. Returns NULL and
+// sets color when the tile is a single color. Levels are cached until the
+// tile is next written. Level 0 of an indexed canvas is read with
+// tileIndices instead.
+const Pixel *tileLevel(Canvas *canvas, int column, int row, int level,
+                       Pixel *color) {
+  loadTile(canvas, column, row);
+  Tile *tile = &canvas->tiles[row * canvas->tile_columns + column];
+  if (tile->data == NULL) {
+    *color = tile->color;
+    return NULL;
+  }
+  if (tile->data->packed) {
+    tilePixels(canvas, column, row);
+  }
+  if (level == 0) {
+    return tile->data->pixels;
+  }
+  if (tile->data->mips == NULL) {
+    buildMips(tile->data, canvas->indexed);
+  }
+  return tile->data->mips + mipOffset(level);
+}
+
+// Palette indices of a tile in an indexed canvas. Returns NULL and sets
+// color when the tile is a single color.
+const unsigned char *tileIndices(Canvas *canvas, int column, int row,
+                                 Pixel *color) {
+  loadTile(canvas, column, row);
+  Tile *tile = &canvas->tiles[row * canvas->tile_columns + column];
+  if (tile->data == NULL) {
+    *color = tile->color;
+    return NULL;
+  }
+  if (tile->data->packed) {
+    tilePixels(canvas, column, row);
+  }
+  return tile->data->indices;
+}
+
+// Bytes a tile's data takes, mips aside
+size_t tileDataBytes(const TileData *data) {
+  return offsetof(TileData, bytes) + data->size;
+}
+
+// Every pixel of a tile's data as RGBA, whatever the canvas holds or how
+// it's packed. Only reads the data, so the save thread can call it on tiles
+// it shares with the canvas being painted.
+void expandTile(const Canvas *canvas, const TileData *data, Pixel *out) {
+  int count = TILE_SIZE * TILE_SIZE;
+  if (!canvas->indexed) {
+    if (data->packed) {
+      decodeRuns(data, sizeof(Pixel), (unsigned char *)out);
+    } else {
+      memcpy(out, data->pixels, count * sizeof(Pixel));
+    }
+    return;
+  }
+  const unsigned char *indices = data->indices;
+  if (data->packed) {
+    // Unpacked into the last quarter of out, expanding front to back only
+    // overwrites indices already read
+    unsigned char *unpacked = (unsigned char *)(out + count) - count;
+    decodeRuns(data, 1, unpacked);
+    indices = unpacked;
+  }
+  expandIndices(indices, count, out);
+}
+//--------------------------------------------------------------------------------
+
+//-Packing------------------------------------------------------------------------
+// Runs are a length then one sample. Lengths up to 128 take a byte, longer
+// ones set its top bit & spill into a second.
+static inline bool sameSample(const unsigned char *a, const unsigned char *b,
+                              int sample) {
+  return sample == 1 ? *a == *b : memcmp(a, b, sizeof(Pixel)) == 0;
+}
+
+// Encodes a tile's raw samples into runs, returns the bytes used or 0 if
+// they wouldn't be smaller than the samples
+static int encodeRuns(const unsigned char *samples, int sample,
+                      unsigned char *runs) {
+  int count = TILE_SIZE * TILE_SIZE;
+  int limit = count * sample;
+  int size = 0;
+  for (int i = 0; i < count;) {
+    const unsigned char *value = samples + (size_t)i * sample;
+    int end = i + 1;
+    while (end < count &&
+           sameSample(samples + (size_t)end * sample, value, sample)) {
+      end++;
+    }
+    if (size + 2 + sample >= limit) {
+      return 0;
+    }
+    int length = end - i - 1;
+    if (length < 128) {
+      runs[size++] = (unsigned char)length;
+    } else {
+      runs[size++] = (unsigned char)(0x80 | length >> 8);
+      runs[size++] = (unsigned char)length;
+    }
+    memcpy(runs + size, value, sample);
+    size += sample;
+    i = end;
+  }
+  return size;
+}
+
+// Decodes runs back into a tile's raw samples
+static void decodeRuns(const TileData *data, int sample, unsigned char *out) {
+  const unsigned char *in = data->bytes;
+  const unsigned char *end = in + data->size;
+  while (in < end) {
+    int length = *in & 0x7F;
+    if (*in++ & 0x80) {
+      length = length << 8 | *in++;
+    }
+    length++;
+    if (sample == 1) {
+      memset(out, *in, length);
+    } else {
+      Pixel value;
+      memcpy(&value, in, sizeof(Pixel));
+      writeSpan((Pixel *)out, length, value);
+    }
+    in += sample;
+    out += (size_t)length * sample;
+  }
+}
+
+// Packs the tile data only snapshots hold: what canvas doesn't hold in the
+// same tile. Every snapshot sharing the data gets the packed copy, anyone
+// else, like a project being saved, keeps the raw data until done with it.
+// The snapshots must all be canvas's size. Returns the tiles packed.
+int packSnapshots(Canvas *const *snapshots, int count, const Canvas *canvas) {
+  int packed = 0;
+  unsigned char *runs = NULL;
+  int tiles = canvas->tile_columns * canvas->tile_rows;
+  for (int i = 0; i < tiles; i++) {
+    for (int s = 0; s < count; s++) {
+      TileData *data = snapshots[s]->tiles[i].data;
+      if (data == NULL || data->packed || data == canvas->tiles[i].data) {
+        continue;
+      }
+      if (runs == NULL) {
+        runs = (unsigned char *)malloc(TILE_SIZE * TILE_SIZE * sizeof(Pixel));
+        if (runs == NULL) {
+          return packed; // Snapshots just stay unpacked
+        }
+      }
+      int size = encodeRuns(data->bytes, sampleBytes(snapshots[s]), runs);
+      if (size == 0) {
+        continue;
+      }
+      TileData *copy = newTileData(size);
+      copy->packed = true;
+      memcpy(copy->bytes, runs, size);
+
+      // Snapshots before this one would have swapped it already
+      int holders = 0;
+      for (int t = s; t < count; t++) {
+        if (snapshots[t]->tiles[i].data == data) {
+          snapshots[t]->tiles[i].data = copy;
+          holders++;
+        }
+      }
+      atomic_store(&copy->refs, holders);
+      for (int h = 0; h < holders; h++) {
+        releaseTileData(data);
+      }
+      packed++;
+    }
+  }
+  free(runs);
+  return packed;
+}
+//--------------------------------------------------------------------------------
+
+//-Span-writers-------------------------------------------------------------------
+// Every kernel ends up writing runs of one color into tile rows, so that one
+// loop is written per instruction set & picked by what the CPU supports.
+typedef void (*SpanWriter)(Pixel *out, int count, Pixel value);
+
+const char *const span_kernel_names[NUM_SPAN_KERNELS] = {"scalar", "sse2",
+                                                         "avx2"};
+
+static void writeSpanScalar(Pixel *out, int count, Pixel value) {
+  for (int i = 0; i < count; i++) {
+    out[i] = value;
+  }
+}
+
+#ifdef SPAN_X86
+__attribute__((target("sse2"))) static void
+writeSpanSSE2(Pixel *out, int count, Pixel value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  __m128i wide = _mm_set1_epi32((int)bits);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i *)(out + i), wide);
+  }
+  for (; i < count; i++) {
+    out[i] = value;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+writeSpanAVX2(Pixel *out, int count, Pixel value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  __m256i wide = _mm256_set1_epi32((int)bits);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_si256((__m256i *)(out + i), wide);
+  }
+
+  // Lanes below the pixels left get a mask bit, the rest aren't touched
+  if (i < count) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - i), lanes);
+    _mm256_maskstore_epi32((int *)(out + i), mask, wide);
+  }
+}
+#endif
+
+static const SpanWriter span_writers[NUM_SPAN_KERNELS] = {
+    writeSpanScalar,
+#ifdef SPAN_X86
+    writeSpanSSE2,
+    writeSpanAVX2,
+#else
+    NULL,
+    NULL,
+#endif
+};
+
+static void writeSpanFirst(Pixel *out, int count, Pixel value);
+
+// Writer in use, starts out picking the best one on the first call. Atomic
+// since fill threads write spans too.
+static _Atomic(SpanWriter) span_writer = writeSpanFirst;
+
+static void writeSpanFirst(Pixel *out, int count, Pixel value) {
+  SpanWriter best = span_writers[bestSpanKernel()];
+  atomic_store_explicit(&span_writer, best, memory_order_relaxed);
+  best(out, count, value);
+}
+
+// Writes count copies of value
+void writeSpan(Pixel *out, int count, Pixel value) {
+  atomic_load_explicit(&span_writer, memory_order_relaxed)(out, count, value);
+}
+
+// Fastest kernel this CPU runs
+SpanKernel bestSpanKernel(void) {
+#ifdef SPAN_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return SPAN_AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SPAN_SSE2;
+  }
+#endif
+  return SPAN_SCALAR;
+}
+
+// Switches kernels, for benchmarks. Returns false if the CPU can't run it.
+bool setSpanKernel(SpanKernel kernel) {
+  if (kernel > bestSpanKernel()) {
+    return false;
+  }
+  atomic_store_explicit(&span_writer, span_writers[kernel],
+                        memory_order_relaxed);
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-Kernels------------------------------------------------------------------------
+// Fills pixels [x0, x1) of row y, clipped to the clip rectangle
+void fillSpan(Canvas *canvas, int y, int x0, int x1, int color) {
+  if (y < canvas->clip.y0 || y >= canvas->clip.y1) {
+    return;
+  }
+  if (x0 < canvas->clip.x0) {
+    x0 = canvas->clip.x0;
+  }
+  if (x1 > canvas->clip.x1) {
+    x1 = canvas->clip.x1;
+  }
+  if (x0 >= x1) {
+    return;
+  }
+
+  Pixel value = palette[color];
+  int r = y / TILE_SIZE;
+  int offset = (y - r * TILE_SIZE) * TILE_SIZE;
+  for (int c = x0 / TILE_SIZE; c <= (x1 - 1) / TILE_SIZE; c++) {
+    Tile *tile = &canvas->tiles[r * canvas->tile_columns + c];
+    if (tile->flags & TILE_PENDING) {
+      loadTile(canvas, c, r);
+    }
+    // Painting a flat tile its own color changes nothing
+    if (tile->data == NULL && samePixel(tile->color, value)) {
+      continue;
+    }
+    int start = x0 > c * TILE_SIZE ? x0 : c * TILE_SIZE;
+    int end = x1 < (c + 1) * TILE_SIZE ? x1 : (c + 1) * TILE_SIZE;
+    // Tiles this canvas already owns outright, with nothing cached from
+    // their pixels, skip tilePixels' checks
+    TileData *data = tile->data;
+    unsigned char *samples =
+        data != NULL && !data->packed && data->mips == NULL &&
+                data->stamp == 0 &&
+                atomic_load_explicit(&data->refs, memory_order_relaxed) == 1
+            ? data->bytes
+            : tilePixels(canvas, c, r);
+    int at = offset + start - c * TILE_SIZE;
+    if (canvas->indexed) {
+      memset(samples + at, color, end - start);
+    } else {
+      writeSpan((Pixel *)samples + at, end - start, value);
+    }
+    markTileDirty(canvas, tile);
+  }
+}
+
+// Span of a convex polygon at a row center, false if the row misses it
+static bool convexRow(const Point *vertices, int count, float center,
+                      int *x0, int *x1) {
+  float left = INFINITY;
+  float right = -INFINITY;
+
+  // Intersect the row center with every edge crossing it
+  for (int i = 0; i < count; i++) {
+    Point a = vertices[i];
+    Point b = vertices[(i + 1) % count];
+    if ((a.y <= center && center < b.y) || (b.y <= center && center < a.y)) {
+      float x = a.x + (center - a.y) * (b.x - a.x) / (b.y - a.y);
+      if (x < left) {
+        left = x;
+      }
+      if (x > right) {
+        right = x;
+      }
+    }
+  }
+  if (!(left < right)) {
+    return false;
+  }
+  *x0 = pixelEdge(left);
+  *x1 = pixelEdge(right);
+  return true;
+}
+
+// Span of a circle at a row center, false if the row misses it
+static bool circleRow(Point center, float radius, float row, int *x0,
+                      int *x1) {
+  float dy = row - center.y;
+  float half = sqrtf(radius * radius - dy * dy);
+  if (!(half > 0)) {
+    return false;
+  }
+  *x0 = pixelEdge(center.x - half);
+  *x1 = pixelEdge(center.x + half);
+  return true;
+}
+
+// Struct to store the tile a shape's rows last wrote, so following rows
+// landing in it again write its pixels directly
+typedef struct {
+  int column;             // Tile column, -1 until a row writes one
+  int row;                // Tile row
+  unsigned char *samples; // Its pixels, owned & flagged dirty by fillSpan
+} SpanCursor;
+
+// fillSpan for the rows of one shape, nothing else may write the canvas
+// until the shape is done
+static void fillSpanAt(Canvas *canvas, SpanCursor *cursor, int y, int x0,
+                       int x1, int color) {
+  if (y < canvas->clip.y0 || y >= canvas->clip.y1) {
+    return;
+  }
+  if (x0 < canvas->clip.x0) {
+    x0 = canvas->clip.x0;
+  }
+  if (x1 > canvas->clip.x1) {
+    x1 = canvas->clip.x1;
+  }
+  if (x0 >= x1) {
+    return;
+  }
+
+  int c = x0 / TILE_SIZE;
+  int r = y / TILE_SIZE;
+  if (c == cursor->column && r == cursor->row &&
+      (x1 - 1) / TILE_SIZE == c) {
+    int at = (y - r * TILE_SIZE) * TILE_SIZE + x0 - c * TILE_SIZE;
+    if (canvas->indexed) {
+      memset(cursor->samples + at, color, x1 - x0);
+    } else {
+      writeSpan((Pixel *)cursor->samples + at, x1 - x0, palette[color]);
+    }
+    return;
+  }
+
+  fillSpan(canvas, y, x0, x1, color);
+  // Pixels there now mean fillSpan wrote them, a flat tile it left alone
+  // already is the color
+  TileData *data = canvas->tiles[r * canvas->tile_columns + c].data;
+  cursor->column = data != NULL ? c : -1;
+  cursor->row = r;
+  cursor->samples = data != NULL ? data->bytes : NULL;
+}
+
+// Fills [x0, x1) of row y except what [skip0, skip1) already covers. Short
+// skips aren't worth splitting the write in two for.
+static void fillSpanExcept(Canvas *canvas, SpanCursor *cursor, int y, int x0,
+                           int x1, int skip0, int skip1, int color) {
+  if (skip1 - skip0 < SWEEP_MIN_SKIP || skip1 <= x0 || skip0 >= x1) {
+    fillSpanAt(canvas, cursor, y, x0, x1, color);
+    return;
+  }
+  if (x0 < skip0) {
+    fillSpanAt(canvas, cursor, y, x0, skip0, color);
+  }
+  if (skip1 < x1) {
+    fillSpanAt(canvas, cursor, y, skip1, x1, color);
+  }
+}
+
+// Fills a convex polygon, vertices may be in either winding order
+void fillConvex(Canvas *canvas, const Point *vertices, int count, int color) {
+  float min_x = vertices[0].x;
+  float max_x = vertices[0].x;
+  float min_y = vertices[0].y;
+  float max_y = vertices[0].y;
+  for (int i = 1; i < count; i++) {
+    min_x = fminf(min_x, vertices[i].x);
+    max_x = fmaxf(max_x, vertices[i].x);
+    min_y = fminf(min_y, vertices[i].y);
+    max_y = fmaxf(max_y, vertices[i].y);
+  }
+  if (outsideColumns(canvas, min_x, max_x)) {
+    return;
+  }
+
+  int y_start = pixelEdge(min_y);
+  int y_end = pixelEdge(max_y);
+  clipRows(canvas, &y_start, &y_end);
+
+  for (int y = y_start; y < y_end; y++) {
+    int x0, x1;
+    if (convexRow(vertices, count, y + 0.5f, &x0, &x1)) {
+      fillSpan(canvas, y, x0, x1, color);
+    }
+  }
+}
+
+void stampCircle(Canvas *canvas, Point center, float radius, int color) {
+  if (outsideColumns(canvas, center.x - radius, center.x + radius)) {
+    return;
+  }
+  int y_start = pixelEdge(center.y - radius);
+  int y_end = pixelEdge(center.y + radius);
+  clipRows(canvas, &y_start, &y_end);
+
+  for (int y = y_start; y < y_end; y++) {
+    int x0, x1;
+    if (circleRow(center, radius, y + 0.5f, &x0, &x1)) {
+      fillSpan(canvas, y, x0, x1, color);
+    }
+  }
+}
+
+void stampSquare(Canvas *canvas, Point center, float radius, int color) {
+  int x0 = pixelEdge(center.x - radius);
+  int x1 = pixelEdge(center.x + radius);
+  if (outsideColumns(canvas, x0, x1)) {
+    return;
+  }
+  int y_start = pixelEdge(center.y - radius);
+  int y_end = pixelEdge(center.y + radius);
+  clipRows(canvas, &y_start, &y_end);
+
+  for (int y = y_start; y < y_end; y++) {
+    fillSpan(canvas, y, x0, x1, color);
+  }
+}
+
+// Same proportions as the triangle cursor guide
+void stampTriangle(Canvas *canvas, Point center, float radius, int color) {
+  Point vertices[3] = {
+      {center.x, center.y - radius},
+      {center.x - radius * 1.3f, center.y + radius},
+      {center.x + radius * 1.3f, center.y + radius},
+  };
+  fillConvex(canvas, vertices, 3, color);
+}
+
+// Matches raylib's DrawLineEx: a quad of width thick with no end caps
+void drawThickLine(Canvas *canvas, Point start, Point end, float thick,
+                   int color) {
+  float dx = end.x - start.x;
+  float dy = end.y - start.y;
+  float length = sqrtf(dx * dx + dy * dy);
+  if (length == 0) {
+    return;
+  }
+
+  float nx = -dy / length * thick / 2;
+  float ny = dx / length * thick / 2;
+  Point vertices[4] = {
+      {start.x + nx, start.y + ny},
+      {end.x + nx, end.y + ny},
+      {end.x - nx, end.y - ny},
+      {start.x - nx, start.y - ny},
+  };
+  fillConvex(canvas, vertices, 4, color);
+}
+
+typedef void (*StampKernel)(Canvas *, Point, float, int);
+
+static StampKernel stampKernel(Shape shape) {
+  switch (shape) {
+  case SHAPE_SQUARE:
+    return stampSquare;
+  case SHAPE_TRIANGLE:
+    return stampTriangle;
+  default:
+    return stampCircle;
+  }
+}
+
+// Corners of a square or triangle stamp, same as the stamp kernels use
+static int shapeVertices(Shape shape, Point center, float radius, Point *out) {
+  if (shape == SHAPE_TRIANGLE) {
+    out[0] = (Point){center.x, center.y - radius};
+    out[1] = (Point){center.x - radius * 1.3f, center.y + radius};
+    out[2] = (Point){center.x + radius * 1.3f, center.y + radius};
+    return 3;
+  }
+  out[0] = (Point){center.x - radius, center.y - radius};
+  out[1] = (Point){center.x + radius, center.y - radius};
+  out[2] = (Point){center.x + radius, center.y + radius};
+  out[3] = (Point){center.x - radius, center.y + radius};
+  return 4;
+}
+
+static void initStampRows(StampRows *stamp, Shape shape, float radius) {
+  Point origin = {0, 0};
+  Point vertices[4];
+  int vertex_count = shape == SHAPE_CIRCLE
+                         ? 0
+                         : shapeVertices(shape, origin, radius, vertices);
+  stamp->shape = shape;
+  stamp->radius = radius;
+  stamp->top = pixelEdge(-radius);
+  stamp->count = pixelEdge(radius) - stamp->top;
+  // A row spare so a zero radius still gets an allocation
+  stamp->spans = (int *)malloc(2 * sizeof(int) * (stamp->count + 1));
+  if (stamp->spans == NULL) {
+    fprintf(stderr, "Failed to allocate memory for stamp rows\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < stamp->count; i++) {
+    float center = stamp->top + i + 0.5f;
+    int *span = stamp->spans + 2 * i;
+    bool hit = shape == SHAPE_CIRCLE
+                   ? circleRow(origin, radius, center, &span[0], &span[1])
+                   : convexRow(vertices, vertex_count, center, &span[0],
+                               &span[1]);
+    // Far enough out that moving it by any position still leaves it empty
+    if (!hit || span[0] >= span[1]) {
+      span[0] = INT_MAX / 2;
+      span[1] = INT_MIN / 2;
+    }
+  }
+}
+
+static void freeStampRows(StampRows *stamp) { free(stamp->spans); }
+
+// Stamps the rows at a point, what sweeps from it then skip exactly
+static void paintStamp(Canvas *canvas, const StampRows *stamp, Point center,
+                       int color) {
+  float reach = stamp->radius * 1.3f;
+  if (outsideColumns(canvas, center.x - reach, center.x + reach)) {
+    return;
+  }
+  int y_start = (int)center.y + stamp->top;
+  int y_end = y_start + stamp->count;
+  clipRows(canvas, &y_start, &y_end);
+  SpanCursor cursor = {-1, 0, NULL};
+  for (int y = y_start; y < y_end; y++) {
+    int *span = stamp->spans + 2 * (y - (int)center.y - stamp->top);
+    if (span[0] < span[1]) {
+      fillSpanAt(canvas, &cursor, y, (int)center.x + span[0],
+                 (int)center.x + span[1], color);
+    }
+  }
+}
+
+// Struct to store a line crossing rows [y0, y1)
+typedef struct {
+  float y0;    // Top end
+  float y1;    // Bottom end
+  float x;     // X at y0
+  float slope; // X step per row
+} Edge;
+
+// Edge along a move from a + offset to b + offset, crossing no rows when
+// the move is flat
+static Edge moveEdge(Point a, Point b, Point offset) {
+  if (a.y == b.y) {
+    return (Edge){0, 0, 0, 0};
+  }
+  if (a.y > b.y) {
+    Point swap = a;
+    a = b;
+    b = swap;
+  }
+  return (Edge){a.y + offset.y, b.y + offset.y, a.x + offset.x,
+                (b.x - a.x) / (b.y - a.y)};
+}
+
+// Paints what moving a stamp from one point to the next adds, every pixel
+// between them once instead of a stamp per point.
+//
+// The stamp moved along a line covers a convex area bounded by the stamps
+// at both ends and the two lines their outermost corners trace, so each row
+// is a single span from the leftmost to the rightmost of those. Only what
+// lies outside the stamp at from is new.
+static void sweepStamp(Canvas *canvas, const StampRows *stamp, Point from,
+                       Point to, int color) {
+  if (from.x == to.x && from.y == to.y) {
+    return; // Already covered by the stamp at from
+  }
+  // Cheap enough to run before any of the setup below, replay clipped to a
+  // small area skips most sweeps here. Triangles reach 1.3 radii across.
+  float radius = stamp->radius;
+  float reach = radius * 1.3f;
+  if (outsideColumns(canvas, fminf(from.x, to.x) - reach,
+                     fmaxf(from.x, to.x) + reach) ||
+      fmaxf(from.y, to.y) + radius < canvas->clip.y0 - 1 ||
+      fminf(from.y, to.y) - radius > canvas->clip.y1 + 1) {
+    return;
+  }
+
+  // Outermost corners either side of the move, for a circle the ends of
+  // the diameter across it
+  float nx = from.y - to.y;
+  float ny = to.x - from.x;
+  Point sides[2];
+  if (stamp->shape == SHAPE_CIRCLE) {
+    float scale = radius / sqrtf(nx * nx + ny * ny);
+    sides[0] = (Point){nx * scale, ny * scale};
+    sides[1] = (Point){-nx * scale, -ny * scale};
+  } else {
+    Point vertices[4];
+    int count = shapeVertices(stamp->shape, (Point){0, 0}, radius, vertices);
+    sides[0] = sides[1] = vertices[0];
+    for (int i = 1; i < count; i++) {
+      float along = vertices[i].x * nx + vertices[i].y * ny;
+      if (along > sides[0].x * nx + sides[0].y * ny) {
+        sides[0] = vertices[i];
+      }
+      if (along < sides[1].x * nx + sides[1].y * ny) {
+        sides[1] = vertices[i];
+      }
+    }
+  }
+  Edge edges[2] = {moveEdge(from, to, sides[0]), moveEdge(from, to, sides[1])};
+  int edge_start[2];
+  int edge_end[2];
+  for (int i = 0; i < 2; i++) { // Rows whose centers the edge crosses
+    edge_start[i] = pixelEdge(edges[i].y0);
+    edge_end[i] = pixelEdge(edges[i].y1);
+  }
+
+  int from_x = (int)from.x;
+  int to_x = (int)to.x;
+  int from_top = (int)from.y + stamp->top;
+  int to_top = (int)to.y + stamp->top;
+  int y_start = from_top < to_top ? from_top : to_top;
+  int y_end = (from_top > to_top ? from_top : to_top) + stamp->count;
+  clipRows(canvas, &y_start, &y_end);
+
+  SpanCursor cursor = {-1, 0, NULL};
+  for (int y = y_start; y < y_end; y++) {
+    // Spans past either end of the table stay empty, start above end
+    int skip0 = INT_MAX / 2;
+    int skip1 = INT_MIN / 2;
+    int x0 = INT_MAX / 2;
+    int x1 = INT_MIN / 2;
+    unsigned int row = (unsigned int)(y - from_top);
+    if (row < (unsigned int)stamp->count) {
+      skip0 = x0 = from_x + stamp->spans[2 * row];
+      skip1 = x1 = from_x + stamp->spans[2 * row + 1];
+    }
+    row = (unsigned int)(y - to_top);
+    if (row < (unsigned int)stamp->count) {
+      int a = to_x + stamp->spans[2 * row];
+      int b = to_x + stamp->spans[2 * row + 1];
+      x0 = a < x0 ? a : x0;
+      x1 = b > x1 ? b : x1;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (edge_start[i] <= y && y < edge_end[i]) {
+        int x = pixelEdge(edges[i].x +
+                          (y + 0.5f - edges[i].y0) * edges[i].slope);
+        x0 = x < x0 ? x : x0;
+        x1 = x > x1 ? x : x1;
+      }
+    }
+    if (x0 < x1) {
+      fillSpanExcept(canvas, &cursor, y, x0, x1, skip0, skip1, color);
+    }
+  }
+}
+//--------------------------------------------------------------------------------
+
+//-Strokes------------------------------------------------------------------------
+// Renders a stroke's point at index i, after previous: pencil draws a line
+// into it, brushes stamp their shape on it or sweep it there
+static void renderPoint(Canvas *canvas, const Stroke *stroke,
+                        const StampRows *stamp, Point previous, Point point,
+                        int i) {
+  if (stroke->tool == TOOL_PENCIL) {
+    if (i > 0) {
+      drawThickLine(canvas, previous, point, stroke->radius, stroke->color);
+    }
+  } else if (!(stroke->flags & STROKE_SWEPT)) {
+    stampKernel(stroke->shape)(canvas, point, stroke->radius, stroke->color);
+  } else if (i > 0) {
+    sweepStamp(canvas, stamp, previous, point, stroke->color);
+  } else {
+    paintStamp(canvas, stamp, point, stroke->color);
+  }
+}
+
+static bool sweptBrush(const Stroke *stroke) {
+  return stroke->tool != TOOL_PENCIL && (stroke->flags & STROKE_SWEPT);
+}
+
+// Replays a whole stroke, decoding its points as it goes
+void renderStroke(Canvas *canvas, const Stroke *stroke) {
+  StrokeReader reader;
+  initStrokeReader(&reader, stroke);
+  Point previous = {0, 0};
+  Point point;
+
+  switch (stroke->tool) {
+  case TOOL_CLEAR: // Clears are stored as strokes without points
+    clearCanvas(canvas, stroke->color);
+    break;
+
+  case TOOL_FILL: { // Fills are stored with their seed as the only point
+    // Kept inside the area the fill first covered, so undoing a stroke it
+    // was bounded by can't let it spread further on replay
+    Bounds clip = canvas->clip;
+    canvas->clip = intersectBounds(clip, stroke->bounds);
+    if (nextPoint(&reader, &point)) {
+      floodFill(canvas, (int)point.x, (int)point.y, stroke->color);
+    }
+    canvas->clip = clip;
+  } break;
+
+  default: { // Pencils & brushes, point by point
+    StampRows stamp = {0};
+    if (sweptBrush(stroke)) {
+      initStampRows(&stamp, stroke->shape, stroke->radius);
+    }
+    for (int i = 0; nextPoint(&reader, &point); i++) {
+      renderPoint(canvas, stroke, &stamp, previous, point, i);
+      previous = point;
+    }
+    freeStampRows(&stamp);
+  } break;
+  }
+}
+
+// Decodes a stroke's points up front, with the area every chunk of them can
+// paint. Clears & fills aren't decoded, renderDecodedStroke replays them as
+// renderStroke does.
+void decodeStroke(DecodedStroke *decoded, const Stroke *stroke) {
+  *decoded = (DecodedStroke){.stroke = stroke};
+  if (stroke->tool == TOOL_CLEAR || stroke->tool == TOOL_FILL) {
+    return;
+  }
+  int chunks = (stroke->point_count + CHUNK_POINTS - 1) / CHUNK_POINTS;
+  decoded->points = (Point *)malloc((stroke->point_count + 1) * sizeof(Point));
+  decoded->chunks = (Bounds *)malloc((chunks + 1) * sizeof(Bounds));
+  if (decoded->points == NULL || decoded->chunks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for decoded stroke\n");
+    exit(1);
+  }
+
+  StrokeReader reader;
+  initStrokeReader(&reader, stroke);
+  Point point;
+  Bounds area = emptyBounds();
+  while (decoded->count < stroke->point_count && nextPoint(&reader, &point)) {
+    // A chunk starts with the point before it, the move into its first
+    // point paints from there
+    Bounds next = stampBounds(stroke->tool, stroke->shape, point,
+                              stroke->radius);
+    int i = decoded->count;
+    if (i % CHUNK_POINTS == 0) {
+      decoded->chunks[i / CHUNK_POINTS] = area;
+    }
+    decoded->chunks[i / CHUNK_POINTS] =
+        unionBounds(decoded->chunks[i / CHUNK_POINTS], next);
+    decoded->points[decoded->count++] = point;
+    area = next;
+  }
+  if (sweptBrush(stroke)) {
+    initStampRows(&decoded->stamp, stroke->shape, stroke->radius);
+  }
+}
+
+void freeDecodedStroke(DecodedStroke *decoded) {
+  free(decoded->points);
+  free(decoded->chunks);
+  freeStampRows(&decoded->stamp);
+}
+
+// Renders a decoded stroke as renderStroke would, skipping the chunks of
+// points that can't reach the clip
+void renderDecodedStroke(Canvas *canvas, const DecodedStroke *decoded) {
+  if (decoded->points == NULL) {
+    renderStroke(canvas, decoded->stroke);
+    return;
+  }
+  for (int first = 0; first < decoded->count; first += CHUNK_POINTS) {
+    if (boundsEmpty(intersectBounds(decoded->chunks[first / CHUNK_POINTS],
+                                    canvas->clip))) {
+      continue;
+    }
+    int end = first + CHUNK_POINTS < decoded->count ? first + CHUNK_POINTS
+                                                    : decoded->count;
+    for (int i = first; i < end; i++) {
+      renderPoint(canvas, decoded->stroke, &decoded->stamp,
+                  decoded->points[i > 0 ? i - 1 : 0], decoded->points[i], i);
+    }
+  }
+}
+
+// Renders only what the newest point adds, used while painting
+void renderStrokeTip(Canvas *canvas, const Stroke *stroke) {
+  if (stroke->point_count == 0) {
+    return;
+  }
+  StampRows stamp = {0}; // Same rows renderStroke uses
+  if (sweptBrush(stroke)) {
+    initStampRows(&stamp, stroke->shape, stroke->radius);
+  }
+  renderPoint(canvas, stroke, &stamp, stroke->previous, stroke->last,
+              stroke->point_count - 1);
+  freeStampRows(&stamp);
+}
+//--------------------------------------------------------------------------------
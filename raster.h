@@ -0,0 +1,188 @@
+/*  --- raster ---
+ *
+ *  Headless CPU rasterizer. Renders brush stamps, pencil lines and whole
+ *  Strokes into an in-memory canvas, without a window or GL context. The
+ *  canvas holds RGBA pixels, or in indexed mode a palette index per pixel,
+ *  expanded only when read.
+ *
+ *  Coverage rule: a pixel is painted when its center lies inside the shape.
+ */
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "stroke.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define NUM_COLORS 24 // The amount of colors available for use
+#define TILE_SIZE 128  // Side of a canvas tile in pixels
+#define TILE_PENDING 1 // Tile flag: pixels not decoded from the project yet
+#define TILE_DIRTY 2   // Tile flag: pixels changed since they were last shown
+#define TILE_LEVELS 8  // Mip levels per tile, TILE_SIZE pixels down to 1
+#define CANVAS_MAX_SIDE 32767 // Largest side stroke points can address
+#define CHUNK_POINTS 8        // Points of a decoded stroke per bounds kept
+//--------------------------------------------------------------------------------
+
+// Struct to store a single RGBA8 pixel, same layout as raylib's Color
+typedef struct {
+  unsigned char r;
+  unsigned char g;
+  unsigned char b;
+  unsigned char a;
+} Pixel;
+
+typedef struct Canvas Canvas;
+
+// Decodes one pending tile's pixels into the canvas
+typedef void (*TileLoader)(void *data, Canvas *canvas, int column, int row);
+
+// Struct to store the pixels of one tile, shared copy-on-write between a
+// canvas and its snapshots. Only allocated as large as the samples it holds.
+//
+// Tiles only snapshots hold are packed: run-length encoded, since painted
+// areas are mostly long runs of one color. Packed data is never written,
+// reading it through a canvas unpacks that canvas's tile first.
+typedef struct {
+  atomic_int refs;          // Tiles pointing at this data
+  int mark;                 // Scratch for walks that count shared data once
+  Pixel *mips;              // Levels 1 and up, built on first use
+  unsigned long long stamp; // Tells these samples apart, 0 until asked for
+  int size;                 // Bytes of samples or runs held
+  bool packed;              // Holds runs rather than samples
+  union {                   // Row major, edge tiles too
+    Pixel pixels[TILE_SIZE * TILE_SIZE];          // RGBA canvases
+    unsigned char indices[TILE_SIZE * TILE_SIZE]; // Indexed canvases
+    // Either as bytes, or the runs while packed
+    unsigned char bytes[TILE_SIZE * TILE_SIZE * sizeof(Pixel)];
+  };
+} TileData;
+
+// Struct to store one tile of a canvas
+typedef struct {
+  TileData *data;      // Pixels, NULL while the whole tile is color
+  Pixel color;         // Every pixel's color while data is NULL
+  unsigned char flags; // TILE_* flags
+} Tile;
+
+// Struct to store a CPU side canvas
+//
+// The canvas is split into TILE_SIZE tiles. A tile only gets pixels once
+// something paints part of it, until then it's a single color, so memory
+// grows with the painted area rather than the canvas size. Snapshots share
+// tile pixels until either side writes them.
+//
+// Tiles of an opened project start out pending and are only decoded by the
+// loader once something reads or writes them. Every kernel flags the tiles
+// it writes as dirty, so only those have to be copied to the screen.
+struct Canvas {
+  int width;    // Width in pixels
+  int height;   // Height in pixels
+  Bounds clip;  // Kernels only write inside this rectangle
+  bool indexed; // Tiles hold palette indices rather than RGBA
+
+  int tile_columns;  // Tiles across
+  int tile_rows;     // Tiles down
+  Tile *tiles;       // Row major
+  int pending_tiles; // Tiles still flagged TILE_PENDING
+  int dirty_tiles;   // Tiles flagged TILE_DIRTY
+  TileLoader loader; // Decodes pending tiles
+  void *loader_data; // Passed to loader
+};
+
+// Instruction sets the span writer can use, later ones are faster
+typedef enum {
+  SPAN_SCALAR, // Plain C, always available
+  SPAN_SSE2,   // 4 pixels a store
+  SPAN_AVX2,   // 8 pixels a store, masked tails
+  NUM_SPAN_KERNELS,
+} SpanKernel;
+
+// Struct to store the row spans of a brush stamp, relative to its center
+//
+// Stroke points are whole pixels, so every stamp along a stroke covers the
+// same spans moved by whole pixels. Sweeps look them up instead of working
+// out two stamps on every row.
+typedef struct {
+  Shape shape;
+  float radius;
+  int top;    // First row, relative to the center's
+  int count;  // Rows
+  int *spans; // Start & end column of each row, empty rows start past end
+} StampRows;
+
+// Struct to store a stroke decoded once to be rendered many times over, as
+// replay does for every block it overlaps. Only chunks of points whose area
+// reaches the clip are walked.
+typedef struct {
+  const Stroke *stroke;
+  Point *points;   // Every point, NULL for clears & fills
+  int count;       // Points
+  Bounds *chunks;  // Area each CHUNK_POINTS points & the moves into them paint
+  StampRows stamp; // Rows swept brushes stamp, spans NULL otherwise
+} DecodedStroke;
+
+// Palette that stroke colors index into, mirrors the sidebar colors
+extern const Pixel palette[NUM_COLORS];
+extern const char *const span_kernel_names[NUM_SPAN_KERNELS];
+
+// Canvas management
+void initCanvas(Canvas *canvas, int width, int height, int color);
+void initLazyCanvas(Canvas *canvas, int width, int height, TileLoader loader,
+                    void *data);
+void freeCanvas(Canvas *canvas);
+void convertCanvas(Canvas *canvas, bool indexed);
+void shareCanvas(Canvas *copy, Canvas *canvas);
+void copyArea(Canvas *canvas, Canvas *source, Bounds area);
+void clearCanvas(Canvas *canvas, int color);
+void setCanvasClip(Canvas *canvas, Bounds clip);
+void resetCanvasClip(Canvas *canvas);
+Bounds canvasBounds(const Canvas *canvas);
+Bounds stampBounds(Tool tool, Shape shape, Point center, float radius);
+size_t canvasMemory(const Canvas *canvas);
+int paletteIndex(Pixel color);
+void indexPixels(const Pixel *pixels, int count, unsigned char *out);
+
+// Tiles
+Bounds tileBounds(const Canvas *canvas, int column, int row);
+void loadTiles(Canvas *canvas, Bounds area);
+void loadAllTiles(Canvas *canvas);
+bool loadNextTile(Canvas *canvas, int *column, int *row);
+void readPixels(Canvas *canvas, Bounds area, Pixel *out);
+void markDirty(Canvas *canvas, Bounds area);
+bool nextDirtyRun(Canvas *canvas, Bounds *area);
+void *tilePixels(Canvas *canvas, int column, int row);
+void fillTile(Canvas *canvas, int column, int row, Pixel color);
+const Pixel *tileLevel(Canvas *canvas, int column, int row, int level,
+                       Pixel *color);
+const unsigned char *tileIndices(Canvas *canvas, int column, int row,
+                                 Pixel *color);
+unsigned long long tileStamp(Canvas *canvas, int column, int row);
+int mipOffset(int level);
+size_t tileDataBytes(const TileData *data);
+void expandTile(const Canvas *canvas, const TileData *data, Pixel *out);
+int packSnapshots(Canvas *const *snapshots, int count, const Canvas *canvas);
+
+// Span writing, picks the best kernel the CPU has on first use
+void writeSpan(Pixel *out, int count, Pixel value);
+SpanKernel bestSpanKernel(void);
+bool setSpanKernel(SpanKernel kernel);
+
+// Span & shape kernels, colors are palette indices
+void fillSpan(Canvas *canvas, int y, int x0, int x1, int color);
+void fillConvex(Canvas *canvas, const Point *vertices, int count, int color);
+void stampCircle(Canvas *canvas, Point center, float radius, int color);
+void stampSquare(Canvas *canvas, Point center, float radius, int color);
+void stampTriangle(Canvas *canvas, Point center, float radius, int color);
+void drawThickLine(Canvas *canvas, Point start, Point end, float thick,
+                   int color);
+
+// Strokes
+void renderStroke(Canvas *canvas, const Stroke *stroke);
+void renderStrokeTip(Canvas *canvas, const Stroke *stroke);
+void decodeStroke(DecodedStroke *decoded, const Stroke *stroke);
+void freeDecodedStroke(DecodedStroke *decoded);
+void renderDecodedStroke(Canvas *canvas, const DecodedStroke *decoded);
+
+#endif
@@ -0,0 +1,324 @@
+/*  --- render ---
+ *
+ *  Images are sampled from the canvas by the view code at the scale asked
+ *  for, so a thumbnail reads the same mip levels the zoomed out window
+ *  does. Undo inside a trace replays on whatever cores the batch leaves
+ *  idle.
+ */
+
+#include "render.h"
+#include "app.h"
+#include "project.h"
+#include "replay.h"
+#include "trace.h"
+#include "view.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Struct to store a batch being rendered across threads
+typedef struct {
+  const char *const *filenames;
+  int count;
+  const RenderOptions *options;
+  int replay_threads;  // Threads each document's undos replay on
+  atomic_int next;     // Next document to hand out
+  atomic_int rendered; // Documents written so far
+} RenderJob;
+
+// Struct to store one render thread
+typedef struct {
+  RenderJob *job;
+  pthread_t thread;
+} RenderWorker;
+
+// Monotonic time in seconds
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Where the image of input goes: its name with the format's extension, in
+// the output directory if there is one
+static void imageName(const char *input, const RenderOptions *options,
+                      char *out, int size) {
+  const char *base = strrchr(input, '/');
+  base = base != NULL ? base + 1 : input;
+  const char *dot = strrchr(base, '.');
+  int stem = dot != NULL && dot != base ? (int)(dot - base) : (int)strlen(base);
+  if (options->directory != NULL) {
+    snprintf(out, size, "%s/%.*s.%s", options->directory, stem, base,
+             options->format->extension);
+  } else {
+    snprintf(out, size, "%.*s%.*s.%s", (int)(base - input), input, stem, base,
+             options->format->extension);
+  }
+}
+
+// Samples canvas into an image the size options ask for & writes it
+static bool writeImage(Canvas *canvas, const char *input, const char *output,
+                       const RenderOptions *options) {
+  float scale = options->scale;
+  if (options->width > 0 && options->height > 0) {
+    scale = fminf((float)options->width / canvas->width,
+                  (float)options->height / canvas->height);
+  }
+  int width = (int)lroundf(canvas->width * scale);
+  int height = (int)lroundf(canvas->height * scale);
+  width = width > 1 ? width : 1;
+  height = height > 1 ? height : 1;
+  if (width > CANVAS_MAX_SIDE || height > CANVAS_MAX_SIDE) {
+    fprintf(stderr, "%s would render to %dx%d, larger than %d a side\n",
+            input, width, height, CANVAS_MAX_SIDE);
+    return false;
+  }
+
+  View view;
+  initView(&view, width, height);
+  view.zoom = scale;
+  Pixel *pixels = (Pixel *)malloc((size_t)width * height * sizeof(Pixel));
+  if (pixels == NULL) {
+    fprintf(stderr, "Failed to allocate memory for rendering\n");
+    exit(1);
+  }
+  renderView(canvas, &view, (Bounds){0, 0, width, height}, pixels);
+  ImageRows image = pixelRows(pixels, width, height);
+  bool written = options->format->writer(&image, output, NULL);
+  free(pixels);
+  if (!written) {
+    fprintf(stderr, "Failed to write %s\n", output);
+  } else if (!options->quiet) {
+    printf("%s -> %s (%dx%d)\n", input, output, width, height);
+  }
+  return written;
+}
+
+// Plays a trace onto a blank document through the update logic, as the
+// window replays one, & writes the canvas it leaves. Saves the trace asks
+// for are skipped, the image is the only output.
+static bool renderTrace(Trace *trace, const char *input, const char *output,
+                        const RenderOptions *options, int replay_threads) {
+  App app;
+  initCanvas(&app.canvas, trace->document_width, trace->document_height,
+             1); // RAYWHITE
+  initHistory(&app.history, trace->document_width, trace->document_height,
+              HISTORY_BUDGET, 1);
+  app.history.replay_threads = replay_threads;
+  initApp(&app, trace->window_width, trace->window_height, 0);
+  app.headless = true;
+
+  InputFrame input_frame;
+  while (readTraceFrame(trace, &input_frame)) {
+    input_frame.keys_pressed &= ~(1u << INPUT_KEY_S);
+    updateApp(&app, &input_frame);
+  }
+  bool written = writeImage(&app.canvas, input, output, options);
+  freeApp(&app);
+  return written;
+}
+
+// Writes the raster a project saved, tiles decode as they're sampled
+static bool renderProject(Project *project, const char *input,
+                          const char *output, const RenderOptions *options) {
+  Canvas canvas;
+  UndoHistory history;
+  initHistory(&history, project->width, project->height, HISTORY_BUDGET, 1);
+  if (!attachProject(project, &canvas, &history)) {
+    // The raster is whole, only strokes past the damage are lost
+    fprintf(stderr, "%s has a damaged stroke log\n", input);
+  }
+  bool written = writeImage(&canvas, input, output, options);
+  freeUndoHistory(&history);
+  freeCanvas(&canvas);
+  return written;
+}
+
+// Renders one trace or project file to an image. Undos a trace makes
+// replay on replay_threads threads, 0 for one per core.
+bool renderDocument(const char *filename, const RenderOptions *options,
+                    int replay_threads) {
+  char output[4096];
+  imageName(filename, options, output, sizeof(output));
+  if (strcmp(output, filename) == 0) {
+    fprintf(stderr, "Not rendering %s over itself\n", filename);
+    return false;
+  }
+
+  Trace trace;
+  Project project;
+  bool written;
+  if (openTrace(&trace, filename)) {
+    written = renderTrace(&trace, filename, output, options, replay_threads);
+    closeTrace(&trace);
+  } else if (openProject(&project, filename)) {
+    written = renderProject(&project, filename, output, options);
+    closeProject(&project);
+  } else {
+    fprintf(stderr, "%s is neither a trace nor a project\n", filename);
+    written = false;
+  }
+  return written;
+}
+
+// Threads a batch of count documents runs on
+static int renderThreadCount(const RenderOptions *options, int count) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  long threads = options->threads > 0 ? options->threads : cores;
+  threads = threads < count ? threads : count;
+  threads = threads < RENDER_MAX_THREADS ? threads : RENDER_MAX_THREADS;
+  return threads > 1 ? (int)threads : 1;
+}
+
+// Takes documents until there are none left
+static void *renderWorker(void *arg) {
+  RenderJob *job = ((RenderWorker *)arg)->job;
+  for (;;) {
+    int i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->count) {
+      break;
+    }
+    if (renderDocument(job->filenames[i], job->options, job->replay_threads)) {
+      atomic_fetch_add(&job->rendered, 1);
+    }
+  }
+  return NULL;
+}
+
+// Renders every file to an image, several at once, & returns how many were
+// written. A file that fails doesn't stop the others.
+int renderDocuments(const char *const *filenames, int count,
+                    const RenderOptions *options) {
+  if (count <= 0) {
+    return 0;
+  }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = renderThreadCount(options, count);
+  RenderJob job = {.filenames = filenames,
+                   .count = count,
+                   .options = options,
+                   // Cores left once every document has a thread, when
+                   // replay takes more than one by default
+                   .replay_threads = REPLAY_DEFAULT_THREADS != 1 &&
+                                             cores / threads > 1
+                                         ? (int)(cores / threads)
+                                         : 1};
+  atomic_init(&job.next, 0);
+  atomic_init(&job.rendered, 0);
+
+  // This thread is one of the workers
+  RenderWorker workers[RENDER_MAX_THREADS];
+  int started = 1;
+  for (int i = 0; i < threads; i++) {
+    workers[i] = (RenderWorker){.job = &job};
+  }
+  while (started < threads &&
+         pthread_create(&workers[started].thread, NULL, renderWorker,
+                        &workers[started]) == 0) {
+    started++;
+  }
+  renderWorker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  return atomic_load(&job.rendered);
+}
+
+// Save format named like "png-small", any case
+static const SaveFormat *findFormat(const char *name) {
+  for (int f = 0; f < NUM_SAVE_FORMATS; f++) {
+    const char *format = save_formats[f].name;
+    int c = 0;
+    while (format[c] != '\0' &&
+           (tolower((unsigned char)format[c]) ==
+                tolower((unsigned char)name[c]) ||
+            (format[c] == ' ' && name[c] == '-'))) {
+      c++;
+    }
+    if (format[c] == '\0' && name[c] == '\0') {
+      return &save_formats[f];
+    }
+  }
+  return NULL;
+}
+
+static void printUsage(void) {
+  fprintf(stderr,
+          "usage: cpaint --render [--size WxH | --scale S] [--format F]\n"
+          "                       [--jobs N] [-o DIR] [--quiet] FILE...\n"
+          "  FILE     a CPAINT_RECORD trace or a .cpaint project\n"
+          "  --size   fit the image into WxH, keeping its aspect\n"
+          "  --scale  image pixels per canvas pixel (1)\n"
+          "  --format qoi, png-fast, png or png-small (png)\n"
+          "  --jobs   documents rendered at once (one per core)\n"
+          "  -o       directory images go to (next to each FILE)\n");
+}
+
+// `cpaint --render`, args are what follows it. Returns the exit status.
+int renderCommand(int argc, char **argv) {
+  RenderOptions options = {.scale = 1, .format = &save_formats[2]}; // PNG
+  const char **filenames = (const char **)malloc((argc + 1) * sizeof(char *));
+  if (filenames == NULL) {
+    fprintf(stderr, "Failed to allocate memory for rendering\n");
+    exit(1);
+  }
+  int count = 0;
+  bool valid = true;
+  bool scaled = false;
+  for (int a = 0; a < argc && valid; a++) {
+    const char *value = a + 1 < argc ? argv[a + 1] : NULL;
+    if (strcmp(argv[a], "--size") == 0 && value != NULL) {
+      valid = sscanf(value, "%dx%d", &options.width, &options.height) == 2 &&
+              options.width > 0 && options.height > 0;
+      a++;
+    } else if (strcmp(argv[a], "--scale") == 0 && value != NULL) {
+      options.scale = strtof(value, NULL);
+      valid = options.scale > 0;
+      scaled = true;
+      a++;
+    } else if (strcmp(argv[a], "--format") == 0 && value != NULL) {
+      options.format = findFormat(value);
+      valid = options.format != NULL;
+      a++;
+    } else if (strcmp(argv[a], "--jobs") == 0 && value != NULL) {
+      options.threads = atoi(value);
+      valid = options.threads > 0;
+      a++;
+    } else if (strcmp(argv[a], "-o") == 0 && value != NULL) {
+      options.directory = value;
+      a++;
+    } else if (strcmp(argv[a], "--quiet") == 0) {
+      options.quiet = true;
+    } else if (argv[a][0] == '-') {
+      valid = false;
+    } else {
+      filenames[count++] = argv[a];
+    }
+  }
+  if (!valid || count == 0 || (scaled && options.width > 0)) {
+    printUsage();
+    free(filenames);
+    return 2;
+  }
+  if (options.directory != NULL) {
+    mkdir(options.directory, 0755);
+  }
+
+  double start = now();
+  int rendered = renderDocuments(filenames, count, &options);
+  double seconds = now() - start;
+  printf("Rendered %d of %d documents in %.2f s on %d threads, %.1f "
+         "documents/s\n",
+         rendered, count, seconds, renderThreadCount(&options, count),
+         seconds > 0 ? rendered / seconds : 0.0);
+  free(filenames);
+  return rendered == count ? 0 : 1;
+}
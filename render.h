@@ -0,0 +1,38 @@
+/*  --- render ---
+ *
+ *  Headless batch rendering: `cpaint --render` turns input traces &
+ *  project files into images with no window, for thumbnails & final
+ *  renders on servers. Traces are played through the same update logic as
+ *  the window, so strokes, undos & fills land exactly as the user saw them;
+ *  projects render the raster they saved. Documents are independent, each
+ *  thread takes the next one until none are left.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "export.h"
+#include <stdbool.h>
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define RENDER_MAX_THREADS 64 // Most documents rendered at once
+//--------------------------------------------------------------------------------
+
+// Struct to store how a batch is rendered
+typedef struct {
+  int width;                // Box the image is fitted into, 0 to use scale
+  int height;               // Box the image is fitted into, 0 to use scale
+  float scale;              // Image pixels per canvas pixel without a box
+  const SaveFormat *format; // Encoder & extension of the images
+  const char *directory;    // Where images go, NULL for next to each input
+  int threads;              // Documents rendered at once, 0 for one per core
+  bool quiet;               // Don't list every image written
+} RenderOptions;
+
+bool renderDocument(const char *filename, const RenderOptions *options,
+                    int replay_threads);
+int renderDocuments(const char *const *filenames, int count,
+                    const RenderOptions *options);
+int renderCommand(int argc, char **argv);
+
+#endif
@@ -0,0 +1,254 @@
+/*  --- replay ---
+ *
+ *  Blocks are dealt costliest first, round robin, into one queue per
+ *  worker. A worker takes from the front of its own queue, costliest
+ *  first, and once it runs dry steals from the back of the others', so
+ *  workers only contend when one has to help another out. Each worker
+ *  renders through its own copy of the canvas struct: the tiles are
+ *  shared, the clip & dirty count are not.
+ */
+
+#include "replay.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Struct to store one block of the area being replayed
+typedef struct {
+  Bounds clip;    // Pixels the block redraws
+  long long cost; // Points of the stroke chunks overlapping it
+} ReplayBlock;
+
+// Struct to store a run of strokes being replayed across threads
+typedef struct {
+  Canvas *canvas;
+  const DecodedStroke *strokes; // Decoded once, walked by every block
+  int count;
+  ReplayBlock *blocks; // Each worker's queue in turn, costliest first
+  int block_count;
+  int worker_count;
+} ReplayJob;
+
+// Struct to store one replay thread & the queue of blocks it owns
+typedef struct {
+  ReplayJob *job;
+  pthread_t thread;
+  int index;
+  // Blocks [front, back) not taken yet, front in the high half & back in
+  // the low one so both ends move in one compare & swap
+  _Alignas(64) _Atomic uint64_t queue;
+  int dirty_tiles; // Tiles it flagged dirty
+} ReplayWorker;
+
+// Threads a replay asked for 0 threads uses, one per core
+int replayThreadCount(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  cores = cores < REPLAY_MAX_THREADS ? cores : REPLAY_MAX_THREADS;
+  return cores > 1 ? (int)cores : 1;
+}
+
+static inline bool overlaps(Bounds a, Bounds b) {
+  return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+static inline uint64_t packQueue(uint32_t front, uint32_t back) {
+  return (uint64_t)front << 32 | back;
+}
+
+// Takes the block at the front of a queue, or the back when stealing.
+// Returns -1 once the queue is empty.
+static int takeBlock(ReplayWorker *worker, bool steal) {
+  uint64_t queue = atomic_load(&worker->queue);
+  for (;;) {
+    uint32_t front = queue >> 32;
+    uint32_t back = (uint32_t)queue;
+    if (front >= back) {
+      return -1;
+    }
+    uint64_t taken =
+        steal ? packQueue(front, back - 1) : packQueue(front + 1, back);
+    if (atomic_compare_exchange_weak(&worker->queue, &queue, taken)) {
+      return steal ? (int)back - 1 : (int)front;
+    }
+  }
+}
+
+// Takes blocks from its own queue, then from the others', until there are
+// none left
+static void *replayWorker(void *arg) {
+  ReplayWorker *worker = (ReplayWorker *)arg;
+  ReplayWorker *workers = worker - worker->index;
+  ReplayJob *job = worker->job;
+  Canvas canvas = *job->canvas;
+  int dirty = canvas.dirty_tiles;
+  int worker_count = job->worker_count;
+  for (;;) {
+    int b = takeBlock(worker, false);
+    // Nothing is ever queued again, so a full pass over empty queues means
+    // every block is taken
+    for (int tried = 1; b < 0 && tried < worker_count; tried++) {
+      b = takeBlock(&workers[(worker->index + tried) % worker_count], true);
+    }
+    if (b < 0) {
+      break;
+    }
+    canvas.clip = job->blocks[b].clip;
+    for (int s = 0; s < job->count; s++) {
+      if (overlaps(job->strokes[s].stroke->bounds, canvas.clip)) {
+        renderDecodedStroke(&canvas, &job->strokes[s]);
+      }
+    }
+  }
+  worker->dirty_tiles = canvas.dirty_tiles - dirty;
+  return NULL;
+}
+
+// Points a block walks of a stroke, those of the chunks reaching it
+static long long blockCost(const DecodedStroke *decoded, Bounds clip) {
+  if (!overlaps(decoded->stroke->bounds, clip)) {
+    return 0;
+  }
+  if (decoded->points == NULL) {
+    return 1;
+  }
+  long long cost = 1;
+  for (int first = 0; first < decoded->count; first += CHUNK_POINTS) {
+    if (overlaps(decoded->chunks[first / CHUNK_POINTS], clip)) {
+      cost += decoded->count - first < CHUNK_POINTS ? decoded->count - first
+                                                    : CHUNK_POINTS;
+    }
+  }
+  return cost;
+}
+
+static int compareCost(const void *a, const void *b) {
+  long long x = ((const ReplayBlock *)a)->cost;
+  long long y = ((const ReplayBlock *)b)->cost;
+  return x > y ? -1 : x < y;
+}
+
+// Replays strokes without fills inside the clip, on up to threads threads
+static void replayRun(Canvas *canvas, const Stroke *const *strokes, int count,
+                      int threads) {
+  Bounds clip = canvas->clip;
+  long long points = 0;
+  for (int s = 0; s < count; s++) {
+    points += strokes[s]->point_count + 1;
+  }
+  int side = REPLAY_BLOCK_TILES * TILE_SIZE;
+  int columns = 0;
+  int rows = 0;
+  if (!boundsEmpty(clip)) {
+    columns = (clip.x1 - 1) / side - clip.x0 / side + 1;
+    rows = (clip.y1 - 1) / side - clip.y0 / side + 1;
+  }
+  int block_count = columns * rows;
+  if (threads < 2 || block_count < 2 || points < REPLAY_MIN_POINTS) {
+    for (int s = 0; s < count; s++) {
+      renderStroke(canvas, strokes[s]);
+    }
+    return;
+  }
+
+  // Every block walks the same points, so they're decoded once up front
+  DecodedStroke *decoded =
+      (DecodedStroke *)malloc(count * sizeof(DecodedStroke));
+  ReplayBlock *sorted = (ReplayBlock *)malloc(block_count * sizeof(ReplayBlock));
+  ReplayJob job = {.canvas = canvas,
+                   .strokes = decoded,
+                   .count = count,
+                   .blocks = (ReplayBlock *)malloc(block_count *
+                                                   sizeof(ReplayBlock)),
+                   .block_count = block_count};
+  if (decoded == NULL || sorted == NULL || job.blocks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for replay\n");
+    exit(1);
+  }
+  for (int s = 0; s < count; s++) {
+    decodeStroke(&decoded[s], strokes[s]);
+  }
+
+  // Blocks are cut along the block grid, so neighbouring ones never share
+  // a tile whatever the clip
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < columns; c++) {
+      int x = (clip.x0 / side + c) * side;
+      int y = (clip.y0 / side + r) * side;
+      ReplayBlock *block = &sorted[r * columns + c];
+      block->clip = intersectBounds(clip, (Bounds){x, y, x + side, y + side});
+      block->cost = 0;
+      for (int s = 0; s < count; s++) {
+        block->cost += blockCost(&decoded[s], block->clip);
+      }
+    }
+  }
+  qsort(sorted, job.block_count, sizeof(ReplayBlock), compareCost);
+
+  // Deal the blocks out round robin so every queue starts with about the
+  // same cost, each one costliest first
+  job.worker_count = threads < job.block_count ? threads : job.block_count;
+  ReplayWorker workers[REPLAY_MAX_THREADS];
+  int dealt = 0;
+  for (int i = 0; i < job.worker_count; i++) {
+    int front = dealt;
+    for (int b = i; b < job.block_count; b += job.worker_count) {
+      job.blocks[dealt++] = sorted[b];
+    }
+    workers[i] = (ReplayWorker){.job = &job, .index = i};
+    atomic_init(&workers[i].queue, packQueue(front, dealt));
+  }
+  free(sorted);
+
+  // Decoding isn't thread safe, pending tiles are loaded up front
+  loadTiles(canvas, clip);
+
+  // This thread is one of the workers, the queues of any that fail to
+  // start are stolen from
+  int started = 1;
+  while (started < job.worker_count &&
+         pthread_create(&workers[started].thread, NULL, replayWorker,
+                        &workers[started]) == 0) {
+    started++;
+  }
+  replayWorker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  // Dirty counts are kept per worker & added up once they're done
+  for (int i = 0; i < started; i++) {
+    canvas->dirty_tiles += workers[i].dirty_tiles;
+  }
+  for (int s = 0; s < count; s++) {
+    freeDecodedStroke(&decoded[s]);
+  }
+  free(decoded);
+  free(job.blocks);
+}
+
+// Renders strokes in order inside the canvas clip, as calling renderStroke
+// on each would, split across up to threads threads (0 for one per core)
+void replayStrokes(Canvas *canvas, const Stroke *const *strokes, int count,
+                   int threads) {
+  threads = threads > 0 ? threads : replayThreadCount();
+  threads = threads < REPLAY_MAX_THREADS ? threads : REPLAY_MAX_THREADS;
+  int start = 0;
+  while (start < count) {
+    int end = start;
+    while (end < count && strokes[end]->tool != TOOL_FILL) {
+      end++;
+    }
+    replayRun(canvas, strokes + start, end - start, threads);
+
+    // A fill spreads across blocks, it has threads of its own
+    if (end < count) {
+      renderStroke(canvas, strokes[end]);
+      end++;
+    }
+    start = end;
+  }
+}
@@ -0,0 +1,32 @@
+/*  --- replay ---
+ *
+ *  Parallel stroke replay for undo. The area being redrawn is cut into
+ *  blocks of whole tiles and worker threads take blocks one at a time,
+ *  each rendering the strokes that overlap its block, in order, with the
+ *  clip narrowed to it. Blocks never share a tile, so every pixel sees the
+ *  same writes in the same order as a serial replay and the result is
+ *  identical.
+ *
+ *  Fills read beyond any block, so each one runs alone between the
+ *  parallel runs of the strokes before & after it.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "raster.h"
+#include "stroke.h"
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define REPLAY_BLOCK_TILES 4     // Side of a replay block in tiles
+#define REPLAY_MAX_THREADS 32    // Most threads a single replay uses
+#define REPLAY_MIN_POINTS 2048   // Fewer points than this replay on one thread
+#define REPLAY_DEFAULT_THREADS 1 // Threads undo replays on unless asked for,
+                                 // one until the replay bench shows more win
+//--------------------------------------------------------------------------------
+
+int replayThreadCount(void);
+void replayStrokes(Canvas *canvas, const Stroke *const *strokes, int count,
+                   int threads);
+
+#endif
@@ -0,0 +1,333 @@
+/*  --- resample ---
+ *
+ *  Levels are box filtered two pixels by two from the one above, with the
+ *  same rounding as the tiles' own mips, so sampling them matches
+ *  renderView pixel for pixel. Halving rows is the hot loop & has an SSE2
+ *  kernel, picked if the CPU has it.
+ */
+
+#include "resample.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_X86 1 // SSE2 halving kernel is built
+#endif
+
+// Averages each 2x2 block of rows a & b into count pixels of out
+typedef void (*RowHalver)(const Pixel *a, const Pixel *b, Pixel *out,
+                          int count);
+
+static void halveRowScalar(const Pixel *a, const Pixel *b, Pixel *out,
+                           int count) {
+  for (int i = 0; i < count; i++) {
+    const Pixel *p = a + 2 * i;
+    const Pixel *q = b + 2 * i;
+    out[i] = (Pixel){
+        (unsigned char)((p[0].r + p[1].r + q[0].r + q[1].r + 2) / 4),
+        (unsigned char)((p[0].g + p[1].g + q[0].g + q[1].g + 2) / 4),
+        (unsigned char)((p[0].b + p[1].b + q[0].b + q[1].b + 2) / 4),
+        (unsigned char)((p[0].a + p[1].a + q[0].a + q[1].a + 2) / 4)};
+  }
+}
+
+#ifdef RESAMPLE_X86
+// 8 pixels of each row in, 4 out: channels are widened to 16 bits, the
+// rows added, then neighbouring pixels
+__attribute__((target("sse2"))) static void
+halveRowSSE2(const Pixel *a, const Pixel *b, Pixel *out, int count) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i two = _mm_set1_epi16(2);
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a0 = _mm_loadu_si128((const __m128i *)(a + 2 * i));
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(a + 2 * i + 4));
+    __m128i b0 = _mm_loadu_si128((const __m128i *)(b + 2 * i));
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(b + 2 * i + 4));
+    __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                               _mm_unpacklo_epi8(b0, zero));
+    __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                               _mm_unpackhi_epi8(b0, zero));
+    __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero),
+                               _mm_unpacklo_epi8(b1, zero));
+    __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero),
+                               _mm_unpackhi_epi8(b1, zero));
+    __m128i low = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                                _mm_unpackhi_epi64(s0, s1));
+    __m128i high = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                                 _mm_unpackhi_epi64(s2, s3));
+    low = _mm_srli_epi16(_mm_add_epi16(low, two), 2);
+    high = _mm_srli_epi16(_mm_add_epi16(high, two), 2);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(low, high));
+  }
+  halveRowScalar(a + 2 * i, b + 2 * i, out + i, count - i);
+}
+#endif
+
+// Fastest halving kernel this CPU runs
+static RowHalver bestRowHalver(void) {
+#ifdef RESAMPLE_X86
+  if (__builtin_cpu_supports("sse2")) {
+    return halveRowSSE2;
+  }
+#endif
+  return halveRowScalar;
+}
+
+void initResampler(Resampler *resampler) {
+  memset(resampler, 0, sizeof(*resampler));
+  atomic_init(&resampler->state, RESAMPLE_IDLE);
+  resampler->scratch = (Pixel *)malloc(TILE_SIZE * TILE_SIZE * sizeof(Pixel));
+  if (resampler->scratch == NULL) {
+    fprintf(stderr, "Failed to allocate memory for resampling\n");
+    exit(1);
+  }
+}
+
+// Drops the levels of every tile
+static void freeTiles(Resampler *resampler) {
+  int count = resampler->tile_columns * resampler->tile_rows;
+  for (int i = 0; resampler->tiles != NULL && i < count; i++) {
+    free(resampler->tiles[i].mips);
+  }
+  free(resampler->tiles);
+  resampler->tiles = NULL;
+  resampler->tile_columns = 0;
+  resampler->tile_rows = 0;
+}
+
+// Filters a tile's levels down to level from the last one up to date,
+// level 1 from the tile's own samples
+static void filterTile(Resampler *resampler, RowHalver halve, int index,
+                       int level) {
+  const Canvas *source = &resampler->source;
+  const Tile *tile = &source->tiles[index];
+  ResampleTile *cache = &resampler->tiles[index];
+  if (cache->mips == NULL) {
+    cache->mips = (Pixel *)malloc(mipOffset(TILE_LEVELS) * sizeof(Pixel));
+    if (cache->mips == NULL) {
+      fprintf(stderr, "Failed to allocate memory for resampling\n");
+      exit(1);
+    }
+  }
+  for (int l = cache->levels + 1; l <= level; l++) {
+    int side = TILE_SIZE >> l;
+    const Pixel *src;
+    if (l > 1) {
+      src = cache->mips + mipOffset(l - 1);
+    } else if (!source->indexed && !tile->data->packed) {
+      src = tile->data->pixels;
+    } else {
+      expandTile(source, tile->data, resampler->scratch);
+      src = resampler->scratch;
+    }
+    Pixel *dst = cache->mips + mipOffset(l);
+    for (int y = 0; y < side; y++) {
+      halve(src + 4 * y * side, src + (4 * y + 2) * side, dst + y * side,
+            side);
+    }
+  }
+  cache->levels = level;
+}
+
+// Brings the levels of the tiles area touches up to date down to level.
+// Single color tiles have none.
+static void updateTiles(Resampler *resampler, int level, Bounds area) {
+  RowHalver halve = bestRowHalver();
+  const Canvas *source = &resampler->source;
+  for (int row = area.y0 / TILE_SIZE; row <= (area.y1 - 1) / TILE_SIZE;
+       row++) {
+    for (int column = area.x0 / TILE_SIZE;
+         column <= (area.x1 - 1) / TILE_SIZE; column++) {
+      int index = row * source->tile_columns + column;
+      if (source->tiles[index].data == NULL) {
+        continue;
+      }
+      if (resampler->tiles[index].levels >= level) {
+        resampler->cached_tiles++;
+        continue;
+      }
+      filterTile(resampler, halve, index, level);
+      resampler->filtered_tiles++;
+    }
+  }
+}
+
+// Samples level at the view's pixel centers, as renderView samples the
+// tiles' own mips
+static void sampleLevel(Resampler *resampler, int level, Bounds area) {
+  const View *view = &resampler->view;
+  const Canvas *canvas = &resampler->source;
+  int side = TILE_SIZE >> level;
+  int column0 = area.x0 / TILE_SIZE;
+  int columns = (area.x1 - 1) / TILE_SIZE - column0 + 1;
+
+  // Tile columns & pixels within them are the same for every row, -1 off
+  // the canvas. Each row then reads one row of every tile it crosses.
+  int *tile_x = (int *)malloc(view->width * sizeof(int));
+  int *level_x = (int *)malloc(view->width * sizeof(int));
+  const Pixel **spans = (const Pixel **)malloc(columns * sizeof(Pixel *));
+  Pixel *colors = (Pixel *)malloc(columns * sizeof(Pixel));
+  if (tile_x == NULL || level_x == NULL || spans == NULL || colors == NULL) {
+    fprintf(stderr, "Failed to allocate memory for resampling\n");
+    exit(1);
+  }
+  for (int wx = 0; wx < view->width; wx++) {
+    float x = view->x + (wx + 0.5f) / view->zoom;
+    bool inside = x >= 0 && x < canvas->width;
+    tile_x[wx] = inside ? (int)x / TILE_SIZE - column0 : -1;
+    level_x[wx] = inside ? ((int)x % TILE_SIZE) >> level : 0;
+  }
+
+  for (int wy = 0; wy < view->height; wy++) {
+    Pixel *row = resampler->pixels + (size_t)wy * view->width;
+    float y = view->y + (wy + 0.5f) / view->zoom;
+    if (y < 0 || y >= canvas->height) {
+      writeSpan(row, view->width, view_backdrop);
+      continue;
+    }
+    int tile_row = (int)y / TILE_SIZE;
+    int offset = mipOffset(level) + (((int)y % TILE_SIZE) >> level) * side;
+    for (int c = 0; c < columns; c++) {
+      int index = tile_row * canvas->tile_columns + column0 + c;
+      const Tile *tile = &canvas->tiles[index];
+      spans[c] = tile->data ? resampler->tiles[index].mips + offset : NULL;
+      colors[c] = tile->color;
+    }
+    for (int wx = 0; wx < view->width; wx++) {
+      int c = tile_x[wx];
+      row[wx] = c < 0           ? view_backdrop
+                : spans[c] != NULL ? spans[c][level_x[wx]]
+                                   : colors[c];
+    }
+  }
+  free(colors);
+  free(spans);
+  free(level_x);
+  free(tile_x);
+}
+
+static void *resampleWorker(void *arg) {
+  Resampler *resampler = (Resampler *)arg;
+  const View *view = &resampler->view;
+  int level = viewLevel(view);
+  Bounds area = viewedArea(view, &resampler->source);
+  if (level == 0 || boundsEmpty(area)) {
+    // Full size tiles are only read, never built
+    renderView(&resampler->source, view,
+               (Bounds){0, 0, view->width, view->height}, resampler->pixels);
+  } else {
+    updateTiles(resampler, level, area);
+    sampleLevel(resampler, level, area);
+  }
+  atomic_store(&resampler->state, RESAMPLE_DONE);
+  return NULL;
+}
+
+// Starts rendering view of canvas on the worker, after waiting for any run
+// still going. The tiles it shows are decoded first, decoding isn't thread
+// safe. Levels of tiles written since the last run go stale, those of tiles
+// that lost their pixels are freed.
+void startResample(Resampler *resampler, Canvas *canvas, const View *view) {
+  finishResample(resampler);
+  loadTiles(canvas, viewedArea(view, canvas));
+
+  if (resampler->tile_columns != canvas->tile_columns ||
+      resampler->tile_rows != canvas->tile_rows) {
+    freeTiles(resampler);
+    int count = canvas->tile_columns * canvas->tile_rows;
+    resampler->tiles = (ResampleTile *)calloc(count, sizeof(ResampleTile));
+    if (resampler->tiles == NULL) {
+      fprintf(stderr, "Failed to allocate memory for resampling\n");
+      exit(1);
+    }
+    resampler->tile_columns = canvas->tile_columns;
+    resampler->tile_rows = canvas->tile_rows;
+  }
+  for (int row = 0; row < canvas->tile_rows; row++) {
+    for (int column = 0; column < canvas->tile_columns; column++) {
+      ResampleTile *cache =
+          &resampler->tiles[row * canvas->tile_columns + column];
+      unsigned long long stamp = tileStamp(canvas, column, row);
+      if (stamp == 0 && cache->mips != NULL) {
+        free(cache->mips);
+        cache->mips = NULL;
+      }
+      if (stamp != cache->stamp) {
+        cache->stamp = stamp;
+        cache->levels = 0;
+      }
+    }
+  }
+  shareCanvas(&resampler->source, canvas);
+
+  size_t size = (size_t)view->width * view->height;
+  if (size > resampler->capacity) {
+    free(resampler->pixels);
+    resampler->pixels = (Pixel *)malloc(size * sizeof(Pixel));
+    if (resampler->pixels == NULL) {
+      fprintf(stderr, "Failed to allocate memory for resampling\n");
+      exit(1);
+    }
+    resampler->capacity = size;
+  }
+  resampler->view = *view;
+  resampler->filtered_tiles = 0;
+  resampler->cached_tiles = 0;
+  atomic_store(&resampler->state, RESAMPLE_RUNNING);
+
+  // Without a thread the view is still rendered, just not in the background
+  resampler->threaded = pthread_create(&resampler->thread, NULL,
+                                       resampleWorker, resampler) == 0;
+  if (!resampler->threaded) {
+    resampleWorker(resampler);
+  }
+}
+
+// Whether no run is in flight any more, its view in pixels. The worker is
+// joined once done.
+bool resampleDone(Resampler *resampler) {
+  int state = atomic_load(&resampler->state);
+  if (state == RESAMPLE_RUNNING) {
+    return false;
+  }
+  if (state == RESAMPLE_DONE) {
+    finishResample(resampler);
+  }
+  return true;
+}
+
+// Waits for the run in flight, if any, then lets go of its snapshot so
+// painting writes the canvas tiles in place again
+void finishResample(Resampler *resampler) {
+  if (atomic_load(&resampler->state) != RESAMPLE_IDLE) {
+    if (resampler->threaded) {
+      pthread_join(resampler->thread, NULL);
+    }
+    freeCanvas(&resampler->source);
+    atomic_store(&resampler->state, RESAMPLE_IDLE);
+  }
+}
+
+// Bytes the levels kept between runs take
+size_t resampleMemory(const Resampler *resampler) {
+  int count = resampler->tile_columns * resampler->tile_rows;
+  size_t bytes = count * sizeof(ResampleTile);
+  for (int i = 0; i < count; i++) {
+    if (resampler->tiles[i].mips != NULL) {
+      bytes += mipOffset(TILE_LEVELS) * sizeof(Pixel);
+    }
+  }
+  return bytes;
+}
+
+void freeResampler(Resampler *resampler) {
+  finishResample(resampler);
+  freeTiles(resampler);
+  free(resampler->scratch);
+  free(resampler->pixels);
+}
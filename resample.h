@@ -0,0 +1,64 @@
+/*  --- resample ---
+ *
+ *  Renders a whole view on a worker thread, for when the window is resized
+ *  and the canvas scales with it. The worker reads a snapshot sharing the
+ *  canvas tiles, so painting carries on while it runs, and filters its own
+ *  mip levels rather than the tiles' cached ones, which the main thread
+ *  builds as it draws. The snapshot is dropped once the run lands.
+ *
+ *  The levels are kept between runs per tile, laid out like the tiles' own
+ *  mips, and only for tiles with pixels: single color tiles are sampled
+ *  from their color. Tiles whose stamp changed since are filtered again, so
+ *  dragging the window edge mostly samples levels that are already there.
+ *  What comes out is exactly what renderView draws for the same view.
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "raster.h"
+#include "view.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// States a resampler moves through
+typedef enum {
+  RESAMPLE_IDLE,    // No view being rendered
+  RESAMPLE_RUNNING, // Worker thread is rendering the view
+  RESAMPLE_DONE,    // Rendered, waiting to be collected
+} ResampleState;
+
+// Struct to store the levels filtered from one tile's pixels
+typedef struct {
+  Pixel *mips;              // Levels 1 and up, NULL until the tile has some
+  unsigned long long stamp; // tileStamp of the pixels they're filtered from
+  int levels;               // Levels up to date, from level 1 down
+} ResampleTile;
+
+// Struct to store a view being rendered off the main thread
+typedef struct {
+  Canvas source;       // Snapshot the worker reads, only held during a run
+  ResampleTile *tiles; // Per canvas tile, kept between runs
+  int tile_columns;    // Tiles across the canvas tiles were made for
+  int tile_rows;       // Tiles down the canvas tiles were made for
+  Pixel *scratch;      // One tile expanded to RGBA
+  View view;           // View being rendered
+  Pixel *pixels;       // view.width x view.height once done
+  size_t capacity;     // Pixels allocated for pixels
+  pthread_t thread;    // Worker thread
+  atomic_int state;    // A ResampleState
+  bool threaded;       // Runs on thread, joined once done
+  int filtered_tiles;  // Tiles the last run filtered
+  int cached_tiles;    // Tiles it found up to date
+} Resampler;
+
+void initResampler(Resampler *resampler);
+void startResample(Resampler *resampler, Canvas *canvas, const View *view);
+bool resampleDone(Resampler *resampler);
+void finishResample(Resampler *resampler);
+size_t resampleMemory(const Resampler *resampler);
+void freeResampler(Resampler *resampler);
+
+#endif
@@ -0,0 +1,184 @@
+/*  --- stroke ---
+ *
+ *  Compact point encoding for strokes. Deltas between mouse samples are
+ *  tiny, so zigzag varints keep most points at 2 bytes instead of the 8 a
+ *  float Vector2 takes.
+ */
+
+#include "stroke.h"
+
+// Maps signed deltas onto unsigned ones so small negatives stay small
+static inline unsigned int zigzag(int value) {
+  return ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+}
+
+static inline int unzigzag(unsigned int value) {
+  return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static int writeVarint(unsigned char *out, unsigned int value) {
+  int size = 0;
+  while (value >= 0x80) {
+    out[size++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (unsigned char)value;
+  return size;
+}
+
+static unsigned int readVarint(const unsigned char **cursor) {
+  unsigned int value = 0;
+  int shift = 0;
+  while (**cursor & 0x80) {
+    value |= (unsigned int)(**cursor & 0x7f) << shift;
+    shift += 7;
+    (*cursor)++;
+  }
+  value |= (unsigned int)**cursor << shift;
+  (*cursor)++;
+  return value;
+}
+
+// Rounds & clamps a position to the 16 bit coordinates strokes store
+Point quantizePoint(float x, float y) {
+  float qx = x < SHRT_MIN ? SHRT_MIN : x > SHRT_MAX ? SHRT_MAX : x;
+  float qy = y < SHRT_MIN ? SHRT_MIN : y > SHRT_MAX ? SHRT_MAX : y;
+  return (Point){(float)(int)(qx < 0 ? qx - 0.5f : qx + 0.5f),
+                 (float)(int)(qy < 0 ? qy - 0.5f : qy + 0.5f)};
+}
+
+// Writes a quantized point after the stroke's last one, returns bytes used
+int encodePoint(unsigned char *out, const Stroke *stroke, Point point) {
+  int x = (int)point.x;
+  int y = (int)point.y;
+  if (stroke->point_count == 0) {
+    out[0] = (unsigned char)(x & 0xff);
+    out[1] = (unsigned char)((x >> 8) & 0xff);
+    out[2] = (unsigned char)(y & 0xff);
+    out[3] = (unsigned char)((y >> 8) & 0xff);
+    return 4;
+  }
+
+  int size = writeVarint(out, zigzag(x - (int)stroke->last.x));
+  return size + writeVarint(out + size, zigzag(y - (int)stroke->last.y));
+}
+
+void initStrokeReader(StrokeReader *reader, const Stroke *stroke) {
+  reader->cursor = stroke->data;
+  reader->end = stroke->data + stroke->size;
+  reader->point = (Point){0, 0};
+  reader->index = 0;
+}
+
+// Decodes the next point, returns false once the stroke is exhausted
+bool nextPoint(StrokeReader *reader, Point *point) {
+  if (reader->cursor >= reader->end) {
+    return false;
+  }
+
+  if (reader->index == 0) {
+    const unsigned char *c = reader->cursor;
+    reader->point.x = (short)(c[0] | (c[1] << 8));
+    reader->point.y = (short)(c[2] | (c[3] << 8));
+    reader->cursor += 4;
+  } else {
+    reader->point.x += unzigzag(readVarint(&reader->cursor));
+    reader->point.y += unzigzag(readVarint(&reader->cursor));
+  }
+  reader->index++;
+  *point = reader->point;
+  return true;
+}
+
+// Checks that encoded data from a file decodes to exactly point_count points
+// without reading past its end
+bool validStroke(const Stroke *stroke) {
+  const unsigned char *cursor = stroke->data;
+  const unsigned char *end = stroke->data + stroke->size;
+  int count = 0;
+  if (stroke->size > 0) {
+    if (end - cursor < 4) {
+      return false;
+    }
+    cursor += 4;
+    count++;
+  }
+  while (cursor < end) {
+    for (int half = 0; half < 2; half++) {
+      int length = 1;
+      while (cursor < end && (*cursor & 0x80) && length < 5) {
+        cursor++;
+        length++;
+      }
+      if (cursor >= end || (*cursor & 0x80)) {
+        return false;
+      }
+      cursor++;
+    }
+    count++;
+  }
+  return count == stroke->point_count;
+}
+
+static inline void put16(unsigned char *out, unsigned int value) {
+  out[0] = (unsigned char)value;
+  out[1] = (unsigned char)(value >> 8);
+}
+
+static inline void put32(unsigned char *out, unsigned int value) {
+  put16(out, value);
+  put16(out + 2, value >> 16);
+}
+
+static inline unsigned int get16(const unsigned char *in) {
+  return in[0] | (unsigned int)in[1] << 8;
+}
+
+static inline unsigned int get32(const unsigned char *in) {
+  return get16(in) | get16(in + 2) << 16;
+}
+
+// Writes the stroke's header & points, returns bytes used
+int writeStrokeRecord(unsigned char *out, const Stroke *stroke) {
+  out[0] = stroke->tool;
+  out[1] = stroke->shape;
+  out[2] = stroke->color;
+  out[3] = stroke->flags;
+  put16(out + 4, stroke->radius);
+  put16(out + 6, 0);
+  put32(out + 8, (unsigned int)stroke->point_count);
+  put32(out + 12, (unsigned int)stroke->size);
+  put32(out + 16, (unsigned int)stroke->bounds.x0);
+  put32(out + 20, (unsigned int)stroke->bounds.y0);
+  put32(out + 24, (unsigned int)stroke->bounds.x1);
+  put32(out + 28, (unsigned int)stroke->bounds.y1);
+  for (int i = 0; i < stroke->size; i++) {
+    out[STROKE_RECORD_BYTES + i] = stroke->data[i];
+  }
+  return STROKE_RECORD_BYTES + stroke->size;
+}
+
+// Reads a record from size bytes of in, stroke->data points into in.
+// Returns bytes used, or 0 if the record is cut short or malformed.
+int readStrokeRecord(const unsigned char *in, int size, Stroke *stroke) {
+  if (size < STROKE_RECORD_BYTES) {
+    return 0;
+  }
+  stroke->tool = in[0];
+  stroke->shape = in[1];
+  stroke->color = in[2];
+  stroke->flags = in[3];
+  stroke->radius = (unsigned short)get16(in + 4);
+  stroke->point_count = (int)get32(in + 8);
+  stroke->size = (int)get32(in + 12);
+  stroke->bounds = (Bounds){(int)get32(in + 16), (int)get32(in + 20),
+                            (int)get32(in + 24), (int)get32(in + 28)};
+  stroke->data = (unsigned char *)in + STROKE_RECORD_BYTES;
+  if (stroke->tool > TOOL_FILL || stroke->shape > SHAPE_TRIANGLE ||
+      (stroke->flags & ~STROKE_SWEPT) ||
+      stroke->size < 0 || stroke->point_count < 0 ||
+      stroke->size > size - STROKE_RECORD_BYTES || !validStroke(stroke)) {
+    return 0;
+  }
+  return STROKE_RECORD_BYTES + stroke->size;
+}
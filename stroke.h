@@ -0,0 +1,105 @@
+/*  --- stroke ---
+ *
+ *  Stroke records shared by the paint loop, the undo history and the
+ *  rasterizer. Kept free of raylib so strokes can be replayed headless.
+ */
+
+#ifndef STROKE_H
+#define STROKE_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+// Struct to store a Point, same layout as raylib's Vector2
+typedef struct {
+  float x;
+  float y;
+} Point;
+
+// Struct to store a pixel rectangle covering [x0, x1) x [y0, y1)
+typedef struct {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} Bounds;
+
+// Tools a stroke can be recorded with
+typedef enum {
+  TOOL_BRUSH,  // Stamps its shape at every point, or sweeps it between them
+  TOOL_PENCIL, // Thick line between consecutive points
+  TOOL_CLEAR,  // Fills the canvas, has no points
+  TOOL_FILL,   // Fills the region connected to its only point
+} Tool;
+
+// Brush stamp shapes
+typedef enum {
+  SHAPE_CIRCLE,
+  SHAPE_SQUARE,
+  SHAPE_TRIANGLE,
+} Shape;
+
+// Struct to store brush strokes
+//
+// Points are encoded as 16 bit canvas coordinates: the first point as two
+// little endian shorts, every later one as a zigzag varint delta from the
+// point before it. Holding still or moving a few pixels costs 2 bytes.
+typedef struct {
+  unsigned char *data;   // Encoded points, owned by the history arena
+  int size;              // Bytes of encoded point data
+  int point_count;       // Number of points currently stored
+  Point last;            // Newest point, where the next delta starts from
+  Point previous;        // Point before last, used when drawing the tip
+  unsigned char tool;    // Tool being used, a Tool
+  unsigned char shape;   // Brush shape, a Shape
+  unsigned char color;   // Color used
+  unsigned char flags;   // STROKE_* flags
+  unsigned short radius; // Radius used
+  Bounds bounds;         // Pixels the stroke can touch, grown in addToStroke
+} Stroke;
+
+// Struct to decode a stroke's points one at a time
+typedef struct {
+  const unsigned char *cursor; // Next byte to decode
+  const unsigned char *end;    // End of the encoded data
+  Point point;                 // Last decoded point
+  int index;                   // Points decoded so far
+} StrokeReader;
+
+#define MAX_POINT_BYTES 6      // Worst case encoded size of one point
+#define STROKE_RECORD_BYTES 32 // Header of a stroke written to a file
+#define STROKE_SWEPT 1 // Stroke flag: brush sweeps between points, older
+                       // records stamp at each point & replay that way
+
+// Encoding
+int encodePoint(unsigned char *out, const Stroke *stroke, Point point);
+Point quantizePoint(float x, float y);
+void initStrokeReader(StrokeReader *reader, const Stroke *stroke);
+bool nextPoint(StrokeReader *reader, Point *point);
+bool validStroke(const Stroke *stroke);
+
+// Records, a little endian header followed by the encoded points
+int writeStrokeRecord(unsigned char *out, const Stroke *stroke);
+int readStrokeRecord(const unsigned char *in, int size, Stroke *stroke);
+
+//-Bounds-helpers-----------------------------------------------------------------
+static inline Bounds emptyBounds(void) {
+  return (Bounds){INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+}
+
+static inline bool boundsEmpty(Bounds b) {
+  return b.x0 >= b.x1 || b.y0 >= b.y1;
+}
+
+static inline Bounds unionBounds(Bounds a, Bounds b) {
+  return (Bounds){a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+                  a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1};
+}
+
+static inline Bounds intersectBounds(Bounds a, Bounds b) {
+  return (Bounds){a.x0 > b.x0 ? a.x0 : b.x0, a.y0 > b.y0 ? a.y0 : b.y0,
+                  a.x1 < b.x1 ? a.x1 : b.x1, a.y1 < b.y1 ? a.y1 : b.y1};
+}
+//--------------------------------------------------------------------------------
+
+#endif
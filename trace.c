@@ -0,0 +1,170 @@
+/*  --- trace ---
+ *
+ *  Layout, every integer & float little endian:
+ *
+ *    header  0  "CPTRACE1"       8  u32 version
+ *           12  u32 window width 16  u32 window height
+ *           20  u32 document width 24 u32 document height
+ *    frames  0  f32 mouse x       4  f32 mouse y
+ *            8  f32 wheel x      12  f32 wheel y
+ *           16  u32 keys down    20  u32 keys pressed
+ *           24  u8 buttons down  25  u8 buttons pressed  26  u16 unused
+ *
+ *  Frames follow the header back to back until the end of the file, a
+ *  recording cut short by a crash replays up to its last whole frame.
+ */
+
+#include "trace.h"
+#include "raster.h"
+
+#include <math.h>
+#include <string.h>
+
+#define TRACE_MAGIC "CPTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_BYTES 28
+#define TRACE_FRAME_BYTES 28
+
+static inline void put32(unsigned char *out, unsigned int value) {
+  out[0] = (unsigned char)value;
+  out[1] = (unsigned char)(value >> 8);
+  out[2] = (unsigned char)(value >> 16);
+  out[3] = (unsigned char)(value >> 24);
+}
+
+static inline unsigned int get32(const unsigned char *in) {
+  return in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 |
+         (unsigned int)in[3] << 24;
+}
+
+static inline void putFloat(unsigned char *out, float value) {
+  unsigned int bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put32(out, bits);
+}
+
+static inline float getFloat(const unsigned char *in) {
+  unsigned int bits = get32(in);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+//-Recording----------------------------------------------------------------------
+
+// Starts a trace of a session on a blank document_width x document_height
+// canvas, shown in a window_width x window_height window
+bool createTrace(Trace *trace, const char *filename, int window_width,
+                 int window_height, int document_width, int document_height) {
+  trace->file = fopen(filename, "wb");
+  if (trace->file == NULL) {
+    return false;
+  }
+  trace->window_width = window_width;
+  trace->window_height = window_height;
+  trace->document_width = document_width;
+  trace->document_height = document_height;
+  trace->frames = 0;
+
+  unsigned char header[TRACE_HEADER_BYTES];
+  memcpy(header, TRACE_MAGIC, 8);
+  put32(header + 8, TRACE_VERSION);
+  put32(header + 12, (unsigned int)window_width);
+  put32(header + 16, (unsigned int)window_height);
+  put32(header + 20, (unsigned int)document_width);
+  put32(header + 24, (unsigned int)document_height);
+  if (fwrite(header, 1, sizeof(header), trace->file) != sizeof(header)) {
+    fclose(trace->file);
+    trace->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Appends a frame, buffered, returns false once the file can't be written
+bool writeTraceFrame(Trace *trace, const InputFrame *input) {
+  unsigned char frame[TRACE_FRAME_BYTES];
+  putFloat(frame, input->mouse.x);
+  putFloat(frame + 4, input->mouse.y);
+  putFloat(frame + 8, input->wheel.x);
+  putFloat(frame + 12, input->wheel.y);
+  put32(frame + 16, input->keys_down);
+  put32(frame + 20, input->keys_pressed);
+  frame[24] = input->buttons_down;
+  frame[25] = input->buttons_pressed;
+  frame[26] = 0;
+  frame[27] = 0;
+  if (fwrite(frame, 1, sizeof(frame), trace->file) != sizeof(frame)) {
+    return false;
+  }
+  trace->frames++;
+  return true;
+}
+//--------------------------------------------------------------------------------
+
+//-Replay-------------------------------------------------------------------------
+
+bool openTrace(Trace *trace, const char *filename) {
+  trace->file = fopen(filename, "rb");
+  if (trace->file == NULL) {
+    return false;
+  }
+
+  unsigned char header[TRACE_HEADER_BYTES];
+  if (fread(header, 1, sizeof(header), trace->file) != sizeof(header) ||
+      memcmp(header, TRACE_MAGIC, 8) != 0 ||
+      get32(header + 8) != TRACE_VERSION) {
+    fclose(trace->file);
+    trace->file = NULL;
+    return false;
+  }
+  trace->window_width = (int)get32(header + 12);
+  trace->window_height = (int)get32(header + 16);
+  trace->document_width = (int)get32(header + 20);
+  trace->document_height = (int)get32(header + 24);
+  trace->frames = 0;
+
+  // The window needs room for the sidebar, the document one tile at least
+  if (trace->window_width <= 50 || trace->window_width > CANVAS_MAX_SIDE ||
+      trace->window_height <= 0 || trace->window_height > CANVAS_MAX_SIDE ||
+      trace->document_width <= 0 ||
+      trace->document_width > CANVAS_MAX_SIDE ||
+      trace->document_height <= 0 ||
+      trace->document_height > CANVAS_MAX_SIDE) {
+    fclose(trace->file);
+    trace->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Reads the next frame, returns false at the end of the trace or at the
+// first frame that's cut short or malformed
+bool readTraceFrame(Trace *trace, InputFrame *input) {
+  unsigned char frame[TRACE_FRAME_BYTES];
+  if (fread(frame, 1, sizeof(frame), trace->file) != sizeof(frame)) {
+    return false;
+  }
+  input->mouse = (Point){getFloat(frame), getFloat(frame + 4)};
+  input->wheel = (Point){getFloat(frame + 8), getFloat(frame + 12)};
+  input->keys_down = get32(frame + 16);
+  input->keys_pressed = get32(frame + 20);
+  input->buttons_down = frame[24];
+  input->buttons_pressed = frame[25];
+  if (!isfinite(input->mouse.x) || !isfinite(input->mouse.y) ||
+      !isfinite(input->wheel.x) || !isfinite(input->wheel.y) ||
+      (input->keys_down | input->keys_pressed) >> NUM_INPUT_KEYS ||
+      (input->buttons_down | input->buttons_pressed) >> NUM_INPUT_BUTTONS) {
+    return false;
+  }
+  trace->frames++;
+  return true;
+}
+
+void closeTrace(Trace *trace) {
+  if (trace->file != NULL) {
+    fclose(trace->file);
+    trace->file = NULL;
+  }
+}
+//--------------------------------------------------------------------------------
@@ -0,0 +1,94 @@
+/*  --- trace ---
+ *
+ *  Per-frame input, decoupled from raylib. The paint loop samples the mouse
+ *  & keyboard into an InputFrame once a frame and the update logic only
+ *  reads that, so a session can be written to a trace file and fed back in
+ *  later with nobody at the keyboard: to reproduce a slow frame, or by the
+ *  benchmarks.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "stroke.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Keys the update logic reads. Left & right modifiers count as one key.
+typedef enum {
+  INPUT_KEY_B,
+  INPUT_KEY_C,
+  INPUT_KEY_F,
+  INPUT_KEY_P,
+  INPUT_KEY_S,
+  INPUT_KEY_Z,
+  INPUT_KEY_ZERO,
+  INPUT_KEY_EQUAL,
+  INPUT_KEY_MINUS,
+  INPUT_KEY_TAB,
+  INPUT_KEY_UP,
+  INPUT_KEY_DOWN,
+  INPUT_KEY_LEFT,
+  INPUT_KEY_RIGHT,
+  INPUT_KEY_CTRL,
+  INPUT_KEY_SHIFT,
+  INPUT_KEY_ALT,
+  NUM_INPUT_KEYS,
+} InputKey;
+
+// Mouse buttons the update logic reads
+typedef enum {
+  INPUT_BUTTON_LEFT,
+  INPUT_BUTTON_MIDDLE,
+  NUM_INPUT_BUTTONS,
+} InputButton;
+
+// Struct to store one frame of input
+typedef struct {
+  Point mouse;                   // Window position of the mouse
+  Point wheel;                   // Wheel movement this frame
+  unsigned int keys_down;        // Bit per InputKey held
+  unsigned int keys_pressed;     // Bit per InputKey that went down this frame
+  unsigned char buttons_down;    // Bit per InputButton held
+  unsigned char buttons_pressed; // Bit per InputButton that went down
+} InputFrame;
+
+// Struct to store a trace file being written or read
+typedef struct {
+  FILE *file;          // Open trace
+  int window_width;    // Window the trace was recorded in
+  int window_height;   // Window the trace was recorded in
+  int document_width;  // Blank document the trace starts from
+  int document_height; // Blank document the trace starts from
+  long frames;         // Frames written or read so far
+} Trace;
+
+// Recording
+bool createTrace(Trace *trace, const char *filename, int window_width,
+                 int window_height, int document_width, int document_height);
+bool writeTraceFrame(Trace *trace, const InputFrame *input);
+
+// Replay
+bool openTrace(Trace *trace, const char *filename);
+bool readTraceFrame(Trace *trace, InputFrame *input);
+void closeTrace(Trace *trace);
+
+//-Input-helpers------------------------------------------------------------------
+static inline bool keyDown(const InputFrame *input, InputKey key) {
+  return (input->keys_down >> key) & 1;
+}
+
+static inline bool keyPressed(const InputFrame *input, InputKey key) {
+  return (input->keys_pressed >> key) & 1;
+}
+
+static inline bool buttonDown(const InputFrame *input, InputButton button) {
+  return (input->buttons_down >> button) & 1;
+}
+
+static inline bool buttonPressed(const InputFrame *input, InputButton button) {
+  return (input->buttons_pressed >> button) & 1;
+}
+//--------------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,124 @@
+/*  --- view ---
+ *
+ *  Window pixels sample the canvas at their centers: nearest neighbour when
+ *  zoomed in, from the mip level at or just above the zoom when zoomed out.
+ */
+
+#include "view.h"
+
+#include <math.h>
+
+const Pixel view_backdrop = {80, 80, 80, 255};
+
+// Init a view showing the canvas 1:1 from its top left corner
+void initView(View *view, int width, int height) {
+  view->width = width;
+  view->height = height;
+  resetView(view);
+}
+
+void resetView(View *view) {
+  view->x = 0;
+  view->y = 0;
+  view->zoom = 1;
+}
+
+// Moves the view by a window space distance
+void panView(View *view, float dx, float dy) {
+  view->x += dx / view->zoom;
+  view->y += dy / view->zoom;
+}
+
+// Zooms by factor, keeping the canvas point under window point x, y in place
+void zoomView(View *view, float factor, float x, float y) {
+  Point anchor = viewToCanvas(view, x, y);
+  view->zoom = fminf(fmaxf(view->zoom * factor, MIN_ZOOM), MAX_ZOOM);
+  view->x = anchor.x - x / view->zoom;
+  view->y = anchor.y - y / view->zoom;
+}
+
+// Keeps at least half the window on the canvas, so it can't get lost
+void clampView(View *view, const Canvas *canvas) {
+  float half_width = view->width / 2.0f / view->zoom;
+  float half_height = view->height / 2.0f / view->zoom;
+  view->x = fminf(fmaxf(view->x, -half_width), canvas->width - half_width);
+  view->y = fminf(fmaxf(view->y, -half_height), canvas->height - half_height);
+}
+
+Point viewToCanvas(const View *view, float x, float y) {
+  return (Point){view->x + x / view->zoom, view->y + y / view->zoom};
+}
+
+// Window pixels whose centers can sample area, cut to the window
+Bounds canvasToView(const View *view, Bounds area) {
+  Bounds shown = {(int)floorf((area.x0 - view->x) * view->zoom),
+                  (int)floorf((area.y0 - view->y) * view->zoom),
+                  (int)ceilf((area.x1 - view->x) * view->zoom),
+                  (int)ceilf((area.y1 - view->y) * view->zoom)};
+  return intersectBounds(shown, (Bounds){0, 0, view->width, view->height});
+}
+
+// Canvas pixels the window's pixel centers sample, cut to the canvas
+Bounds viewedArea(const View *view, const Canvas *canvas) {
+  Bounds viewed = {(int)floorf(view->x), (int)floorf(view->y),
+                   (int)ceilf(view->x + view->width / view->zoom),
+                   (int)ceilf(view->y + view->height / view->zoom)};
+  return intersectBounds(viewed, canvasBounds(canvas));
+}
+
+// Mip level a zoom samples from, each one halves the tile
+int viewLevel(const View *view) {
+  int level = 0;
+  while (level < TILE_LEVELS - 1 && view->zoom <= 0.5f / (1 << level)) {
+    level++;
+  }
+  return level;
+}
+
+// Renders area of the window into out, packed row after row. Pending tiles
+// in view are decoded.
+void renderView(Canvas *canvas, const View *view, Bounds area, Pixel *out) {
+  int level = viewLevel(view);
+  int side = TILE_SIZE >> level;
+  int stride = area.x1 - area.x0;
+
+  for (int wy = area.y0; wy < area.y1; wy++) {
+    Pixel *row = out + (size_t)(wy - area.y0) * stride;
+    float y = view->y + (wy + 0.5f) / view->zoom;
+    if (y < 0 || y >= canvas->height) {
+      for (int x = 0; x < stride; x++) {
+        row[x] = view_backdrop;
+      }
+      continue;
+    }
+    int tile_row = (int)y / TILE_SIZE;
+    int offset = (((int)y % TILE_SIZE) >> level) * side;
+
+    // Tiles are looked up once per run of pixels they cover. Indexed
+    // canvases are expanded through the palette here, at full size.
+    int column = -1;
+    const Pixel *pixels = NULL;
+    const unsigned char *indices = NULL;
+    Pixel color;
+    for (int wx = area.x0; wx < area.x1; wx++) {
+      float x = view->x + (wx + 0.5f) / view->zoom;
+      if (x < 0 || x >= canvas->width) {
+        row[wx - area.x0] = view_backdrop;
+        continue;
+      }
+      int px = (int)x;
+      if (px / TILE_SIZE != column) {
+        column = px / TILE_SIZE;
+        if (level == 0 && canvas->indexed) {
+          indices = tileIndices(canvas, column, tile_row, &color);
+        } else {
+          pixels = tileLevel(canvas, column, tile_row, level, &color);
+        }
+      }
+      int at = offset + ((px % TILE_SIZE) >> level);
+      row[wx - area.x0] = pixels != NULL    ? pixels[at]
+                          : indices != NULL ? palette[indices[at]]
+                                            : color;
+    }
+  }
+}
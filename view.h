@@ -0,0 +1,43 @@
+/*  --- view ---
+ *
+ *  Maps the window onto the canvas: panning, zooming & rendering what's
+ *  visible into a window sized buffer. Zoomed out, tiles are sampled from
+ *  their cached mip levels, so a frame costs what the window shows rather
+ *  than what the document holds.
+ */
+
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "raster.h"
+#include "stroke.h"
+
+//-Definitions-&-Constants--------------------------------------------------------
+#define MIN_ZOOM (1.0f / (1 << (TILE_LEVELS - 1))) // Coarsest mip, 1 px tiles
+#define MAX_ZOOM 32.0f                             // Closest zoom in
+//--------------------------------------------------------------------------------
+
+// Struct to store the part of the canvas the window shows
+typedef struct {
+  float x;    // Canvas x at the left window edge
+  float y;    // Canvas y at the top window edge
+  float zoom; // Window pixels per canvas pixel
+  int width;  // Window area in pixels
+  int height; // Window area in pixels
+} View;
+
+// What the window shows around the canvas
+extern const Pixel view_backdrop;
+
+void initView(View *view, int width, int height);
+void resetView(View *view);
+void panView(View *view, float dx, float dy);
+void zoomView(View *view, float factor, float x, float y);
+void clampView(View *view, const Canvas *canvas);
+Point viewToCanvas(const View *view, float x, float y);
+Bounds canvasToView(const View *view, Bounds area);
+Bounds viewedArea(const View *view, const Canvas *canvas);
+int viewLevel(const View *view);
+void renderView(Canvas *canvas, const View *view, Bounds area, Pixel *out);
+
+#endif